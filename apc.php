@@ -821,6 +821,7 @@ EOB;
 		<tr class=tr-1><td class=td-0>Miss Rate</td><td>$miss_rate cache requests/second</td></tr>
 		<tr class=tr-0><td class=td-0>Insert Rate</td><td>$insert_rate cache requests/second</td></tr>
 		<tr class=tr-1><td class=td-0>Cache full count</td><td>{$cache['expunges']}</td></tr>
+		<tr class=tr-0><td class=td-0>Evicted entries</td><td>{$cache['evictions']}</td></tr>
 		</tbody></table>
 		</div>
 
@@ -834,6 +835,8 @@ EOB;
 		<tr class=tr-1><td class=td-0>Miss Rate</td><td>$miss_rate_user cache requests/second</td></tr>
 		<tr class=tr-0><td class=td-0>Insert Rate</td><td>$insert_rate_user cache requests/second</td></tr>
 		<tr class=tr-1><td class=td-0>Cache full count</td><td>{$cache_user['expunges']}</td></tr>
+		<tr class=tr-0><td class=td-0>Evicted entries</td><td>{$cache_user['evictions']}</td></tr>
+		<tr class=tr-1><td class=td-0>Relocated entries</td><td>{$cache_user['relocations']}</td></tr>
 
 		</tbody></table>
 		</div>
@@ -28,6 +28,7 @@
 
 #include "apc_globals.h"
 #include "apc_bin.h"
+#include "apc_compress.h"
 #include "apc_zend.h"
 #include "apc_php.h"
 #include "apc_sma.h"
@@ -37,7 +38,7 @@
 extern apc_cache_t* apc_cache;
 extern apc_cache_t* apc_user_cache;
 
-extern int _apc_store(char *strkey, int strkey_len, const zval *val, const uint ttl, const int exclusive TSRMLS_DC); /* this is hacky */
+extern int _apc_store(char *strkey, int strkey_len, const zval *val, const uint ttl, const uint grace, const int exclusive TSRMLS_DC); /* this is hacky */
 
 #define APC_BINDUMP_DEBUG 0
 
@@ -673,6 +674,7 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
     size_t size=0;
     apc_context_t ctxt;
     void *pool_ptr;
+    zval *val, raw;
 
     zend_llist_init(&ll, sizeof(void*), NULL, 0);
     zend_hash_init(&APCG(apc_bd_alloc_list), 0, NULL, NULL, 0);
@@ -681,19 +683,28 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
     files = apc_flip_hash(files);
     user_vars = apc_flip_hash(user_vars);
 
+    /* fold any rehash in progress so the walks below only see one slot table */
+    CACHE_LOCK(apc_user_cache);
+    apc_cache_finish_rehash(apc_user_cache TSRMLS_CC);
+    CACHE_UNLOCK(apc_user_cache);
+    CACHE_LOCK(apc_cache);
+    apc_cache_finish_rehash(apc_cache TSRMLS_CC);
+    CACHE_UNLOCK(apc_cache);
+
     /* get size and entry counts */
-    for(i=0; i < apc_user_cache->num_slots; i++) {
-        sp = apc_user_cache->slots[i];
+    for(i=0; i < apc_user_cache->header->num_slots; i++) {
+        sp = apc_user_cache->header->slots[i];
         for(; sp != NULL; sp = sp->next) {
             if(apc_bin_checkfilter(user_vars, sp->key.data.user.identifier, sp->key.data.user.identifier_len)) {
                 size += sizeof(apc_bd_entry_t*) + sizeof(apc_bd_entry_t);
                 size += sp->value->mem_size - (sizeof(apc_cache_entry_t) - sizeof(apc_cache_entry_value_t));
+                size += APC_ENTRY_SAVED(sp->value); /* dumped uncompressed */
                 count++;
             }
         }
     }
-    for(i=0; i < apc_cache->num_slots; i++) {
-        sp = apc_cache->slots[i];
+    for(i=0; i < apc_cache->header->num_slots; i++) {
+        sp = apc_cache->header->slots[i];
         for(; sp != NULL; sp = sp->next) {
             if(sp->key.type == APC_CACHE_KEY_FPFILE) {
                 if(apc_bin_checkfilter(files, sp->key.data.fpfile.fullpath, sp->key.data.fpfile.fullpath_len+1)) {
@@ -726,8 +737,8 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
     /* User entries */
     zend_hash_init(&APCG(copied_zvals), 0, NULL, NULL, 0);
     count = 0;
-    for(i=0; i < apc_user_cache->num_slots; i++) {
-        sp = apc_user_cache->slots[i];
+    for(i=0; i < apc_user_cache->header->num_slots; i++) {
+        sp = apc_user_cache->header->slots[i];
         for(; sp != NULL; sp = sp->next) {
             if(apc_bin_checkfilter(user_vars, sp->key.data.user.identifier, sp->key.data.user.identifier_len)) {
                 ep = &bd->entries[count];
@@ -735,19 +746,31 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
                 ep->val.user.info = apc_bd_alloc(sp->value->data.user.info_len TSRMLS_CC);
                 memcpy(ep->val.user.info, sp->value->data.user.info, sp->value->data.user.info_len);
                 ep->val.user.info_len = sp->value->data.user.info_len;
-                if ((Z_TYPE_P(sp->value->data.user.val) == IS_ARRAY && APCG(serializer))
-                        || Z_TYPE_P(sp->value->data.user.val) == IS_OBJECT) {
+                val = sp->value->data.user.val;
+                if (sp->value->data.user.raw_len) {
+                    /* dumped uncompressed, a load compresses it again as configured */
+                    raw = *val;
+                    Z_STRLEN(raw) = sp->value->data.user.raw_len;
+                    Z_STRVAL(raw) = emalloc(Z_STRLEN(raw) + 1);
+                    if (apc_decompress(Z_STRVAL_P(val), Z_STRLEN_P(val), Z_STRVAL(raw), Z_STRLEN(raw)) != (size_t) Z_STRLEN(raw)) {
+                        memset(Z_STRVAL(raw), 0, Z_STRLEN(raw));
+                    }
+                    Z_STRVAL(raw)[Z_STRLEN(raw)] = '\0';
+                    val = &raw;
+                }
+                if ((Z_TYPE_P(val) == IS_ARRAY && APCG(serializer))
+                        || Z_TYPE_P(val) == IS_OBJECT) {
                     /* avoiding hash copy, hack */
-                    uint type = Z_TYPE_P(sp->value->data.user.val);
-                    Z_TYPE_P(sp->value->data.user.val) = IS_STRING;
-                    ep->val.user.val = apc_copy_zval(NULL, sp->value->data.user.val, &ctxt TSRMLS_CC);
+                    uint type = Z_TYPE_P(val);
+                    Z_TYPE_P(val) = IS_STRING;
+                    ep->val.user.val = apc_copy_zval(NULL, val, &ctxt TSRMLS_CC);
                     Z_TYPE_P(ep->val.user.val) = IS_OBJECT;
-                    sp->value->data.user.val->type = type;
-                } else if (Z_TYPE_P(sp->value->data.user.val) == IS_ARRAY && !APCG(serializer)) {
+                    val->type = type;
+                } else if (Z_TYPE_P(val) == IS_ARRAY && !APCG(serializer)) {
                     /* this is a little complicated, we have to unserialize it first, then serialize it again */
                     zval *garbage;
                     ctxt.copy = APC_COPY_OUT_USER;
-                    garbage = apc_copy_zval(NULL, sp->value->data.user.val, &ctxt TSRMLS_CC);
+                    garbage = apc_copy_zval(NULL, val, &ctxt TSRMLS_CC);
                     APCG(serializer) = apc_find_serializer("php" TSRMLS_CC);
                     ctxt.copy = APC_COPY_IN_USER;
                     ep->val.user.val = apc_copy_zval(NULL, garbage, &ctxt TSRMLS_CC);
@@ -756,9 +779,13 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
                     APCG(serializer) = NULL;
                     ctxt.copy = APC_COPY_IN_OPCODE;
                 } else {
-                    ep->val.user.val = apc_copy_zval(NULL, sp->value->data.user.val, &ctxt TSRMLS_CC);
+                    ep->val.user.val = apc_copy_zval(NULL, val, &ctxt TSRMLS_CC);
                 }
                 ep->val.user.ttl = sp->value->data.user.ttl;
+                ep->val.user.grace = sp->value->data.user.grace;
+                if (val == &raw) {
+                    efree(Z_STRVAL(raw));
+                }
 
                 /* swizzle pointers */
                 apc_swizzle_ptr(bd, &ll, &bd->entries[count].val.user.info);
@@ -778,8 +805,8 @@ apc_bd_t* apc_bin_dump(HashTable *files, HashTable *user_vars TSRMLS_DC) {
     APCG(copied_zvals).nTableSize=0;
 
     /* File entries */
-    for(i=0; i < apc_cache->num_slots; i++) {
-        for(sp=apc_cache->slots[i]; sp != NULL; sp = sp->next) {
+    for(i=0; i < apc_cache->header->num_slots; i++) {
+        for(sp=apc_cache->header->slots[i]; sp != NULL; sp = sp->next) {
             if(sp->key.type == APC_CACHE_KEY_FPFILE) {
                 if(apc_bin_checkfilter(files, sp->key.data.fpfile.fullpath, sp->key.data.fpfile.fullpath_len+1)) {
                     ep = &bd->entries[count];
@@ -1009,7 +1036,7 @@ int apc_bin_load(apc_bd_t *bd, int flags TSRMLS_DC) {
                         break;
                     }
                     ctxt.copy = APC_COPY_IN_USER;
-                    _apc_store(ep->val.user.info, ep->val.user.info_len, data, ep->val.user.ttl, 0 TSRMLS_CC);
+                    _apc_store(ep->val.user.info, ep->val.user.info_len, data, ep->val.user.ttl, ep->val.user.grace, 0 TSRMLS_CC);
                     if (use_copy) {
                         zval_ptr_dtor(&data);
                     }
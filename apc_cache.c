@@ -34,108 +34,492 @@
 #include "apc_zend.h"
 #include "apc_sma.h"
 #include "apc_globals.h"
+#include "apc_lease.h"
+#include "apc_compress.h"
+#include "apc_namespace.h"
 #include "SAPI.h"
 #include "TSRM.h"
 #include "ext/standard/md5.h"
 
-/* TODO: rehash when load factor exceeds threshold */
+#ifdef PHP_WIN32
+#include "win32/time.h"
+#elif HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 #define CHECK(p) { if ((p) == NULL) return NULL; }
 
+/* {{{ slot table sizing */
+#define APC_CACHE_MIN_SLOTS  256
+#define APC_CACHE_MAX_SLOTS  (1 << 22)
+#define APC_CACHE_MAX_LOAD   2      /* average chain length that triggers a rehash */
+#define APC_REHASH_STEP      8      /* old buckets a stripe migrates per write */
+#define APC_DRAIN_STEP       1024   /* buckets of a wiped table queued per request */
+
+#define SLOT_INDEX(cache, h)     ((h) & (unsigned long)((cache)->header->num_slots - 1))
+#define OLD_SLOT_INDEX(cache, h) ((h) & (unsigned long)((cache)->header->old_num_slots - 1))
+
+/* slot tables end in the node apc_epoch_retire queues them with */
+#define TABLE_BYTES(n)           ((n) * sizeof(slot_t*))
+#define TABLE_ALLOC_SIZE(n)      (TABLE_BYTES(n) + sizeof(apc_epoch_block_t))
+#define TABLE_BLOCK(table, n)    ((apc_epoch_block_t*) ((char*) (table) + TABLE_BYTES(n)))
+/* }}} */
+
+/* {{{ lockless reads
+ * Lookups first walk the chains and the index without the stripe lock. The
+ * epoch pinned around them keeps whatever they reach from being freed, and
+ * the result only counts if the seq counter of the stripe was even and did
+ * not move meanwhile. Table and index pointers are published before their
+ * (only ever growing) sizes, and readers load the size first, so a reader
+ * never indexes past the end of a table. */
+#ifdef HAVE_ATOMIC_OPERATIONS
+# define CACHE_LOCKLESS_READS 1
+# define CACHE_PUBLISH()         MEMORY_BARRIER()
+#else
+# define CACHE_LOCKLESS_READS 0
+# define CACHE_PUBLISH()
+#endif
+#define LOCKLESS_TRIES           2      /* optimistic walks before taking the lock */
+#define LOCKLESS_MAX_HOPS        1024   /* a walk this long is racing a writer */
+
+/* user longs are changed in place from the read path, which only excludes
+ * other writers where there are no atomics */
+#ifdef HAVE_ATOMIC_OPERATIONS
+# define CACHE_LONG_ADD(lval, n)     ATOMIC_ADD(lval, n)
+# define CACHE_LONG_CAS(lval, o, n)  ATOMIC_CAS(lval, o, n)
+#else
+# define CACHE_LONG_ADD(lval, n)     ((lval) += (n))
+# define CACHE_LONG_CAS(lval, o, n)  ((lval) == (o) ? ((lval) = (n), 1) : 0)
+#endif
+/* }}} */
+
+/* {{{ slot helpers */
+/* an expunge queued behind another one may find the room already made */
+#define EXPUNGE_DONE(cache, size) \
+    ((cache)->eviction == APC_CACHE_EVICT_CLOCK ? apc_sma_get_avail_block(size TSRMLS_CC) : \
+        apc_sma_get_avail_mem() > (size_t)(APCG(shm_size)/2))
+
+/* hits only dirty the slot's cache line when something changes */
+#define SLOT_TOUCH(slot, t) { \
+    if ((slot)->access_time != (t)) (slot)->access_time = (t); \
+    if (!(slot)->referenced) (slot)->referenced = 1; \
+}
+
+/* With apc.hit_sample above 1 only every Nth hit of a process updates the
+ * slot's num_hits, by N, and its access_time. The referenced bit is kept
+ * exact, it is written once per pass of the clock hand at most. */
+#define SLOT_HIT(cache, slot, t) { \
+    if (APCG(hit_sample) <= 1) { \
+        CACHE_SAFE_INC(cache, (slot)->num_hits); \
+        SLOT_TOUCH(slot, t); \
+    } else { \
+        if (++APCG(hit_tick) >= APCG(hit_sample)) { \
+            APCG(hit_tick) = 0; \
+            CACHE_SAFE_ADD(cache, (slot)->num_hits, APCG(hit_sample)); \
+            if ((slot)->access_time != (t)) (slot)->access_time = (t); \
+        } \
+        if (!(slot)->referenced) (slot)->referenced = 1; \
+    } \
+}
+
+/* the counter shard of this process, picked by its epoch record. Processes
+ * sharing a shard may lose an update now and then, as the single shared
+ * counters always could */
+#define CACHE_STATS(cache)          (&(cache)->header->stats[APCG(epoch_record) & (APC_CACHE_STAT_SHARDS - 1)])
+#define CACHE_STAT_INC(cache, name) { CACHE_STATS(cache)->name++; }
+#define APC_STATS_ALIGN 64
+
+#define USER_SLOT_EXPIRED(slot, t) \
+    (((slot)->value->data.user.ttl && (time_t) ((slot)->creation_time + (slot)->value->data.user.ttl) < (t)) || \
+     APC_NS_STALE((slot)->value))
+
+/* past the grace period as well, nobody may be handed the entry anymore.
+ * An invalidated namespace takes its entries past it at once */
+#define USER_SLOT_DEAD(slot, t) \
+    (((slot)->value->data.user.ttl && \
+      (time_t) ((slot)->creation_time + (slot)->value->data.user.ttl + (slot)->value->data.user.grace) < (t)) || \
+     APC_NS_STALE((slot)->value))
+/* }}} */
+
 /* {{{ key_equals */
 #define key_equals(a, b) (a.inode==b.inode && a.device==b.device)
 /* }}} */
 
 static void apc_cache_expunge(apc_cache_t* cache, size_t size TSRMLS_DC);
+static slot_t** slot_link(apc_cache_t* cache, slot_t* p);
+static int cache_drain(apc_cache_t* cache, int steps TSRMLS_DC);
+
+/* {{{ hash constants
+ * MurmurHash64A on LP64, the MurmurHash2 multiplier where longs are 32 bits */
+#if ULONG_MAX > 0xffffffffUL
+# define HASH_M  0xc6a4a7935bd1e995UL
+# define HASH_R  47
+# define HASH_F1 47
+# define HASH_F2 47
+#else
+# define HASH_M  0x5bd1e995UL
+# define HASH_R  24
+# define HASH_F1 13
+# define HASH_F2 15
+#endif
+#define HASH_SEED 0x5c3a7f1dUL
+/* }}} */
+
+/* {{{ hash_mix */
+static inline unsigned long hash_mix(unsigned long h)
+{
+#if ULONG_MAX > 0xffffffffUL
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+#else
+    h ^= h >> 16;
+    h *= 0x85ebca6bUL;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35UL;
+    h ^= h >> 16;
+#endif
+    return h;
+}
+/* }}} */
 
 /* {{{ hash */
 static unsigned long hash(apc_cache_key_t key)
 {
-    return (unsigned long)(key.data.file.device + key.data.file.inode);
+    /* inodes are handed out densely and a box has few devices, so the plain
+     * sum left most of the high bits empty */
+    return hash_mix((unsigned long) key.data.file.device * HASH_M + (unsigned long) key.data.file.inode);
 }
 /* }}} */
 
-/* {{{ string_nhash_8 */
-#define string_nhash_8(s,len) (unsigned long)(zend_inline_hash_func((s), len))
+/* {{{ string_hash
+ * Hashes a key a word at a time instead of zend_inline_hash_func's byte at a
+ * time. Words are loaded with memcpy as identifiers need not be aligned; the
+ * tail bytes are folded in little endian order. */
+static inline unsigned long string_hash(const char *s, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    unsigned long h = HASH_SEED ^ ((unsigned long) len * HASH_M);
+    unsigned long k;
+    size_t n;
+
+    for (n = len / sizeof(unsigned long); n; n--) {
+        memcpy(&k, p, sizeof(k));
+        k *= HASH_M;
+        k ^= k >> HASH_R;
+        k *= HASH_M;
+        h ^= k;
+        h *= HASH_M;
+        p += sizeof(k);
+    }
+
+    n = len & (sizeof(unsigned long) - 1);
+    if (n) {
+        k = 0;
+        while (n) {
+            k = (k << 8) | p[--n];
+        }
+        h ^= k;
+        h *= HASH_M;
+    }
+
+    h ^= h >> HASH_F1;
+    h *= HASH_M;
+    h ^= h >> HASH_F2;
+    return h;
+}
 /* }}} */
 
-/* {{{ murmurhash */
-#if 0
-static inline unsigned long murmurhash(const char *skey, size_t keylen)
+/* {{{ make_table_size */
+static int make_table_size(int n)
 {
-	const long m = 0x7fd652ad;
-	const long r = 16;
-	unsigned int h = 0xdeadbeef;
+    int size = APC_CACHE_MIN_SLOTS;
 
-	while(keylen >= 4)
-	{
-		h += *(unsigned int*)skey;
-		h *= m;
-		h ^= h >> r;
+    while (size < n && size < APC_CACHE_MAX_SLOTS) {
+        size <<= 1;
+    }
+    return size;
+}
+/* }}} */
 
-		skey += 4;
-		keylen -= 4;
-	}
+/* {{{ tag index
+ * An open-addressing index over the user cache slots. Each stripe owns
+ * index_groups / num_stripes consecutive groups and keys probe linearly
+ * through the groups of their stripe, so the stripe lock covers the index
+ * as well. A tag is the high bit plus 7 bits of the mixed hash, 0 marks an
+ * empty entry and 1 an entry whose slot was removed. A probe stops at the
+ * first group that still has an empty entry; removals only free an entry
+ * outright in such a group, which keeps that rule valid.
+ */
+#define APC_INDEX_EMPTY    0x00
+#define APC_INDEX_DELETED  0x01
+#define APC_INDEX_TAG(m)   ((unsigned char)(0x80 | ((m) & 0x7f)))
+#define APC_INDEX_ALIGN    64
+
+#define INDEX_GROUPS_PER_STRIPE(cache) ((cache)->header->index_groups / (cache)->num_stripes)
+#define INDEX_BYTES(groups)            ((groups) * sizeof(cache_index_group_t) + APC_INDEX_ALIGN)
+#define INDEX_ALLOC_SIZE(groups)       (INDEX_BYTES(groups) + sizeof(apc_epoch_block_t))
+#define INDEX_BLOCK(mem, groups)       ((apc_epoch_block_t*) ((char*) (mem) + INDEX_BYTES(groups)))
+/* parts are rebuilt once 7/8th of their entries are in use */
+#define INDEX_MAX_USED(cache)          (INDEX_GROUPS_PER_STRIPE(cache) * APC_INDEX_GROUP_SIZE / 8 * 7)
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+/* bitmask of the 16 tags starting at t that equal tag */
+# define INDEX_MATCH(t, tag) \
+    ((unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)(t)), _mm_set1_epi8((char)(tag)))))
+#else
+# define INDEX_MATCH(t, tag) index_match((t), (tag))
+static inline unsigned int index_match(const unsigned char* t, unsigned char tag)
+{
+    unsigned int mask = 0;
+    int i;
 
-	switch(keylen)
-	{
-	case 3:
-		h += skey[2] << 16;
-	case 2:
-		h += skey[1] << 8;
-	case 1:
-		h += skey[0];
-		h *= m;
-		h ^= h >> r;
-	};
+    for (i = 0; i < 16; i++) {
+        if (t[i] == tag) {
+            mask |= 1U << i;
+        }
+    }
+    return mask;
+}
+#endif
 
-	h *= m;
-	h ^= h >> 10;
-	h *= m;
-	h ^= h >> 17;
+/* {{{ index_ctz */
+static inline int index_ctz(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int n = 0;
 
-	return h;
-}
+    while (!(mask & 1)) {
+        mask >>= 1;
+        n++;
+    }
+    return n;
 #endif
+}
 /* }}} */
 
-/* {{{ make_prime */
-static int const primes[] = {
-  257, /*   256 */
-  521, /*   512 */
- 1031, /*  1024 */
- 2053, /*  2048 */
- 3079, /*  3072 */
- 4099, /*  4096 */
- 5147, /*  5120 */
- 6151, /*  6144 */
- 7177, /*  7168 */
- 8209, /*  8192 */
- 9221, /*  9216 */
-10243, /* 10240 */
-11273, /* 11264 */
-12289, /* 12288 */
-13313, /* 13312 */
-14341, /* 14336 */
-15361, /* 15360 */
-16411, /* 16384 */
-17417, /* 17408 */
-18433, /* 18432 */
-19457, /* 19456 */
-0      /* sentinel */
-};
+/* {{{ index_mix */
+static inline unsigned long index_mix(unsigned long h)
+{
+    /* stripes and chains take the low bits of h, remix so that tags and
+     * groups do not repeat them */
+    return hash_mix(h ^ HASH_SEED);
+}
+/* }}} */
+
+/* {{{ index_part */
+static inline cache_index_group_t* index_part(apc_cache_t* cache, unsigned long h)
+{
+    return cache->header->index + (h & (cache->num_stripes - 1)) * INDEX_GROUPS_PER_STRIPE(cache);
+}
+/* }}} */
+
+/* {{{ index_probe */
+static slot_t* index_probe(cache_index_group_t* index, int groups, int num_stripes, const char *strkey, int keylen, unsigned long h)
+{
+    /* index and groups are passed in as lockless readers load them only once */
+    cache_index_group_t* part = index + (h & (num_stripes - 1)) * (groups / num_stripes);
+    unsigned long mask = groups / num_stripes - 1;
+    unsigned long m = index_mix(h);
+    unsigned long g = (m >> 7) & mask;
+    unsigned char tag = APC_INDEX_TAG(m);
+    unsigned long probes;
+
+    for (probes = 0; probes <= mask; probes++) {
+        cache_index_group_t* group = &part[g];
+        unsigned int empty = 0;
+        int c;
+
+        for (c = 0; c < APC_INDEX_GROUP_SIZE; c += 16) {
+            unsigned int match = INDEX_MATCH(group->tags + c, tag);
+
+            while (match) {
+                slot_t* slot = group->slots[c + index_ctz(match)];
+                /* a lockless reader can see the tag of an entry being filled in */
+                if (slot && slot->key.h == h && !memcmp(slot->key.data.user.identifier, strkey, keylen)) {
+                    return slot;
+                }
+                match &= match - 1;
+            }
+            empty |= INDEX_MATCH(group->tags + c, APC_INDEX_EMPTY);
+        }
+        if (empty) {
+            break;
+        }
+        g = (g + 1) & mask;
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ index_find */
+static slot_t* index_find(apc_cache_t* cache, const char *strkey, int keylen, unsigned long h)
+{
+    return index_probe(cache->header->index, cache->header->index_groups, cache->num_stripes, strkey, keylen, h);
+}
+/* }}} */
+
+/* {{{ index_add */
+static int index_add(apc_cache_t* cache, slot_t* slot)
+{
+    cache_index_group_t* part = index_part(cache, slot->key.h);
+    unsigned long mask = INDEX_GROUPS_PER_STRIPE(cache) - 1;
+    unsigned long m = index_mix(slot->key.h);
+    unsigned long g = (m >> 7) & mask;
+    unsigned long probes;
+
+    for (probes = 0; probes <= mask; probes++) {
+        cache_index_group_t* group = &part[g];
+        int c;
+
+        for (c = 0; c < APC_INDEX_GROUP_SIZE; c += 16) {
+            unsigned int avail = INDEX_MATCH(group->tags + c, APC_INDEX_EMPTY) | INDEX_MATCH(group->tags + c, APC_INDEX_DELETED);
+
+            if (avail) {
+                int i = c + index_ctz(avail);
+                int was_empty = (group->tags[i] == APC_INDEX_EMPTY);
+
+                group->tags[i] = APC_INDEX_TAG(m);
+                group->slots[i] = slot;
+                return was_empty;
+            }
+        }
+        g = (g + 1) & mask;
+    }
+    return -1;
+}
+/* }}} */
 
-static int make_prime(int n)
+/* {{{ index_insert */
+static void index_insert(apc_cache_t* cache, slot_t* slot)
 {
-    int *k = (int*)primes; 
-    while(*k) {
-        if((*k) > n) return *k;
-        k++;
+    /* caller holds the stripe of the slot exclusively */
+    cache_stripe_t* stripe;
+    int added = -1;
+
+    if (!cache->header->index) {
+        return;
     }
-    return *(k-1);
+
+    stripe = &cache->stripes[slot->key.h & (cache->num_stripes - 1)];
+    if (stripe->index_full) {
+        return;
+    }
+    if (stripe->index_used < INDEX_MAX_USED(cache)) {
+        added = index_add(cache, slot);
+    }
+    if (added < 0) {
+        /* lookups of this stripe walk the chains until check_index rebuilds */
+        stripe->index_full = 1;
+        cache->header->index_rebuild = 1;
+        return;
+    }
+    stripe->index_used += added;
 }
 /* }}} */
 
+/* {{{ index_remove */
+static void index_remove(apc_cache_t* cache, slot_t* slot)
+{
+    /* caller holds the stripe of the slot exclusively */
+    cache_index_group_t* part = index_part(cache, slot->key.h);
+    unsigned long mask = INDEX_GROUPS_PER_STRIPE(cache) - 1;
+    unsigned long m = index_mix(slot->key.h);
+    unsigned long g = (m >> 7) & mask;
+    unsigned char tag = APC_INDEX_TAG(m);
+    unsigned long probes;
+
+    for (probes = 0; probes <= mask; probes++) {
+        cache_index_group_t* group = &part[g];
+        unsigned int empty = 0;
+        int c;
+
+        for (c = 0; c < APC_INDEX_GROUP_SIZE; c += 16) {
+            empty |= INDEX_MATCH(group->tags + c, APC_INDEX_EMPTY);
+        }
+        for (c = 0; c < APC_INDEX_GROUP_SIZE; c += 16) {
+            unsigned int match = INDEX_MATCH(group->tags + c, tag);
+
+            while (match) {
+                int i = c + index_ctz(match);
+                if (group->slots[i] == slot) {
+                    /* no probe ever went past a group with an empty entry */
+                    group->tags[i] = empty ? APC_INDEX_EMPTY : APC_INDEX_DELETED;
+                    group->slots[i] = NULL;
+                    if (empty) {
+                        cache->stripes[slot->key.h & (cache->num_stripes - 1)].index_used--;
+                    }
+                    return;
+                }
+                match &= match - 1;
+            }
+        }
+        if (empty) {
+            return;
+        }
+        g = (g + 1) & mask;
+    }
+}
+/* }}} */
+
+/* {{{ index_reset */
+static void index_reset(apc_cache_t* cache)
+{
+    /* caller holds CACHE_LOCK */
+    int i;
+
+    if (!cache->header->index) {
+        return;
+    }
+    memset(cache->header->index, 0, cache->header->index_groups * sizeof(cache_index_group_t));
+    for (i = 0; i < cache->num_stripes; i++) {
+        cache->stripes[i].index_used = 0;
+        cache->stripes[i].index_full = 0;
+    }
+    cache->header->index_rebuild = 0;
+}
+/* }}} */
+
+/* {{{ index_groups_for */
+static int index_groups_for(apc_cache_t* cache, int entries)
+{
+    /* a fresh index is at most half full, with at least one group per stripe */
+    int groups = cache->num_stripes;
+
+    while (groups * (APC_INDEX_GROUP_SIZE / 2) < entries && groups < APC_CACHE_MAX_SLOTS) {
+        groups <<= 1;
+    }
+    return groups;
+}
+/* }}} */
+
+/* {{{ index_alloc */
+static void* index_alloc(int groups, cache_index_group_t** index TSRMLS_DC)
+{
+    size_t size = INDEX_ALLOC_SIZE(groups);
+    void* mem;
+
+    /* an index is not worth an expunge */
+    if (!apc_sma_get_avail_size(size)) {
+        return NULL;
+    }
+    mem = apc_sma_malloc(size TSRMLS_CC);
+    if (!mem) {
+        return NULL;
+    }
+    /* the tag lines are loaded with aligned SSE2 loads */
+    *index = (cache_index_group_t*) (((size_t) mem + APC_INDEX_ALIGN - 1) & ~(size_t)(APC_INDEX_ALIGN - 1));
+    memset(*index, 0, groups * sizeof(cache_index_group_t));
+    return mem;
+}
+/* }}} */
+/* }}} */
+
 /* {{{ make_slot */
 slot_t* make_slot(apc_cache_key_t *key, apc_cache_entry_t* value, slot_t* next, time_t t TSRMLS_DC)
 {
@@ -163,6 +547,12 @@ slot_t* make_slot(apc_cache_key_t *key, apc_cache_entry_t* value, slot_t* next,
     p->creation_time = t;
     p->access_time = t;
     p->deletion_time = 0;
+    /* fresh entries survive the next pass of the clock hand */
+    p->referenced = 1;
+    p->timer = APC_SLOT_TIMER_NONE;
+    p->expires = 0;
+    p->timer_next = NULL;
+    p->timer_pprev = NULL;
     return p;
 }
 /* }}} */
@@ -174,49 +564,134 @@ static void free_slot(slot_t* slot TSRMLS_DC)
 }
 /* }}} */
 
+/* {{{ timer_link */
+static void timer_link(slot_t** head, slot_t* slot)
+{
+    slot->timer_next = *head;
+    if (*head) {
+        (*head)->timer_pprev = &slot->timer_next;
+    }
+    slot->timer_pprev = head;
+    *head = slot;
+}
+/* }}} */
+
+/* {{{ timer_unlink */
+static void timer_unlink(apc_cache_t* cache, slot_t* slot)
+{
+    /* caller holds the stripe of the slot exclusively */
+    cache_stripe_t* stripe = &CACHE_STRIPE_AT(cache, slot->key.h);
+
+    if (slot->timer == APC_SLOT_TIMER_NONE) {
+        return;
+    }
+    *slot->timer_pprev = slot->timer_next;
+    if (slot->timer_next) {
+        slot->timer_next->timer_pprev = slot->timer_pprev;
+    }
+    if (slot->timer == APC_SLOT_TIMER_WHEEL) {
+        stripe->wheel_count--;
+    } else {
+        stripe->stale_count--;
+    }
+    slot->timer = APC_SLOT_TIMER_NONE;
+    slot->timer_next = NULL;
+    slot->timer_pprev = NULL;
+}
+/* }}} */
+
+/* {{{ retire_slot */
+static void retire_slot(apc_cache_t* cache, slot_t* dead)
+{
+    /* caller holds the gc lock. Other processes may still be reading the
+     * unlinked slot: queue it with the epoch it became unreachable in,
+     * process_pending_removals frees it */
+    dead->next = NULL;
+    dead->deletion_time = time(0);
+    dead->retire_epoch = apc_epoch_current();
+    if (cache->header->deleted_tail) {
+        cache->header->deleted_tail->next = dead;
+    } else {
+        cache->header->deleted_list = dead;
+    }
+    cache->header->deleted_tail = dead;
+    cache->header->deleted_epoch = dead->retire_epoch;
+}
+/* }}} */
+
 /* {{{ remove_slot */
 static void remove_slot(apc_cache_t* cache, slot_t** slot TSRMLS_DC)
 {
     slot_t* dead = *slot;
     *slot = (*slot)->next;
 
+    if (cache->header->index) {
+        index_remove(cache, dead);
+    }
+    timer_unlink(cache, dead);
+
+    CACHE_GC_LOCK(cache);
     cache->header->mem_size -= dead->value->mem_size;
+    cache->header->saved_size -= APC_ENTRY_SAVED(dead->value);
     CACHE_FAST_DEC(cache, cache->header->num_entries);
-    if (dead->value->ref_count <= 0) {
-        free_slot(dead TSRMLS_CC);
-    }
-    else {
-        dead->next = cache->header->deleted_list;
-        dead->deletion_time = time(0);
-        cache->header->deleted_list = dead;
-    }
+    retire_slot(cache, dead);
+    CACHE_GC_UNLOCK(cache);
 }
 /* }}} */
 
 /* {{{ process_pending_removals */
 static void process_pending_removals(apc_cache_t* cache TSRMLS_DC)
 {
-    slot_t** slot;
+    slot_t* dead_list = NULL;
+    slot_t** dead_tail = &dead_list;
+    slot_t* last;
+    unsigned long safe;
     time_t now;
 
-    /* This function scans the list of removed cache entries and deletes any
-     * entry whose reference count is zero (indicating that it is no longer
-     * being executed) or that has been on the pending list for more than
-     * cache->gc_ttl seconds (we issue a warning in the latter case).
+    /* This function frees the removed cache entries nobody can be reading
+     * anymore: those retired in an epoch older than every pinned one. As
+     * the queue is ordered by epoch that is a run at its head. File entries
+     * also wait for their reference count to drop to zero (indicating that
+     * they are no longer being executed) or for cache->gc_ttl seconds to
+     * pass (we issue a warning in the latter case).
      */
 
+    /* old tables and indexes retired by rehashes */
+    apc_epoch_collect(cache->gc_ttl TSRMLS_CC);
+
     if (!cache->header->deleted_list)
         return;
 
-    slot = &cache->header->deleted_list;
+    /* later pins must not hold back what was retired up to now */
+    apc_epoch_advance(cache->header->deleted_epoch TSRMLS_CC);
+    safe = apc_epoch_reclaimable(cache->gc_ttl TSRMLS_CC);
     now = time(0);
 
-    while (*slot != NULL) {
-        int gc_sec = cache->gc_ttl ? (now - (*slot)->deletion_time) : 0;
+    CACHE_GC_LOCK(cache);
 
-        if ((*slot)->value->ref_count <= 0 || gc_sec > cache->gc_ttl) {
-            slot_t* dead = *slot;
+    last = cache->header->deleted_tail;
+    while (cache->header->deleted_list && APC_EPOCH_BEFORE(cache->header->deleted_list->retire_epoch, safe)) {
+        slot_t* dead = cache->header->deleted_list;
+        int gc_sec = cache->gc_ttl ? (now - dead->deletion_time) : 0;
 
+        cache->header->deleted_list = dead->next;
+        if (!dead->next) {
+            cache->header->deleted_tail = NULL;
+        }
+        dead->next = NULL;
+
+        if (dead->value->ref_count > 0 && gc_sec <= cache->gc_ttl) {
+            /* still being executed, requeue it behind the others; restamped,
+             * as lockless readers may reach it from the slot queued before */
+            dead->retire_epoch = apc_epoch_current();
+            cache->header->deleted_epoch = dead->retire_epoch;
+            if (cache->header->deleted_tail) {
+                cache->header->deleted_tail->next = dead;
+            } else {
+                cache->header->deleted_list = dead;
+            }
+            cache->header->deleted_tail = dead;
+        } else {
             if (dead->value->ref_count > 0) {
                 switch(dead->value->type) {
                     case APC_CACHE_ENTRY_FILE:
@@ -228,13 +703,24 @@ static void process_pending_removals(apc_cache_t* cache TSRMLS_DC)
                         break;
                 }
             }
-            *slot = dead->next;
-            free_slot(dead TSRMLS_CC);
+            *dead_tail = dead;
+            dead_tail = &dead->next;
         }
-        else {
-            slot = &(*slot)->next;
+
+        if (dead == last) {
+            /* everything has been looked at once */
+            break;
         }
     }
+
+    CACHE_GC_UNLOCK(cache);
+
+    /* the pools are released outside the gc lock */
+    while (dead_list) {
+        slot_t* dead = dead_list;
+        dead_list = dead->next;
+        free_slot(dead TSRMLS_CC);
+    }
 }
 /* }}} */
 
@@ -266,17 +752,632 @@ static void prevent_garbage_collection(apc_cache_entry_t* entry)
 }
 /* }}} */
 
+/* {{{ rehash_bucket */
+static void rehash_bucket(apc_cache_t* cache, unsigned long idx)
+{
+    /* caller holds the stripe of idx: every slot of an old bucket lands in a
+     * new bucket of the same stripe since both sizes are powers of two */
+    slot_t* p = cache->header->old_slots[idx];
+
+    cache->header->old_slots[idx] = NULL;
+    while (p) {
+        slot_t* next = p->next;
+        slot_t** bucket = &cache->header->slots[SLOT_INDEX(cache, p->key.h)];
+        p->next = *bucket;
+        *bucket = p;
+        p = next;
+    }
+}
+/* }}} */
+
+/* {{{ rehash_stripe */
+static void rehash_stripe(apc_cache_t* cache, int stripe_idx, int steps)
+{
+    cache_stripe_t* stripe = &cache->stripes[stripe_idx];
+    int old_num_slots = cache->header->old_num_slots;
+
+    if (!cache->header->old_slots || stripe->rehash_idx >= old_num_slots) {
+        return;
+    }
+
+    while (steps-- > 0 && stripe->rehash_idx < old_num_slots) {
+        rehash_bucket(cache, stripe->rehash_idx);
+        stripe->rehash_idx += cache->num_stripes;
+    }
+
+    if (stripe->rehash_idx >= old_num_slots) {
+        CACHE_GC_LOCK(cache);
+        cache->header->rehash_pending--;
+        CACHE_GC_UNLOCK(cache);
+    }
+}
+/* }}} */
+
+/* {{{ rehash_key */
+static void rehash_key(apc_cache_t* cache, unsigned long h)
+{
+    /* writers hold the stripe of h exclusively: empty the old bucket of the key
+     * so only the current table needs to be searched, and do a bit of the
+     * stripe's share of the migration on the way */
+    if (cache->header->old_slots) {
+        rehash_bucket(cache, OLD_SLOT_INDEX(cache, h));
+        rehash_stripe(cache, (int)(h & (cache->num_stripes - 1)), APC_REHASH_STEP);
+    }
+}
+/* }}} */
+
+/* {{{ apc_cache_finish_rehash */
+void apc_cache_finish_rehash(apc_cache_t* cache TSRMLS_DC)
+{
+    slot_t** old_slots = cache->header->old_slots;
+    int old_num_slots = cache->header->old_num_slots;
+    int i;
+
+    if (!old_slots) {
+        return;
+    }
+
+    for (i = 0; i < old_num_slots; i++) {
+        if (old_slots[i]) {
+            rehash_bucket(cache, i);
+        }
+    }
+
+    cache->header->old_num_slots = 0;
+    CACHE_PUBLISH();
+    cache->header->old_slots = NULL;
+    cache->header->rehash_pending = 0;
+    /* lockless readers may still be walking it */
+    apc_epoch_retire(old_slots, TABLE_BLOCK(old_slots, old_num_slots) TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ index_fill */
+static void index_fill(apc_cache_t* cache)
+{
+    /* caller holds CACHE_LOCK */
+    slot_t* p;
+    int i;
+
+    for (i = 0; i < cache->header->num_slots; i++) {
+        for (p = cache->header->slots[i]; p; p = p->next) {
+            index_insert(cache, p);
+        }
+    }
+    for (i = 0; i < cache->header->old_num_slots; i++) {
+        for (p = cache->header->old_slots[i]; p; p = p->next) {
+            index_insert(cache, p);
+        }
+    }
+}
+/* }}} */
+
+/* {{{ check_index */
+static void check_index(apc_cache_t* cache TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    cache_index_group_t* index;
+    void* mem;
+    void* old_mem;
+    int old_groups;
+    int groups;
+    int i;
+
+    /* called without any cache lock held, right before an insert */
+    if (!header->index_rebuild) {
+        return;
+    }
+
+    groups = index_groups_for(cache, header->num_entries + header->num_entries / 4);
+    if (groups < header->index_groups) {
+        /* lockless readers rely on the index never shrinking */
+        groups = header->index_groups;
+    }
+    mem = index_alloc(groups, &index TSRMLS_CC);
+    if (!mem) {
+        return;
+    }
+
+    CACHE_LOCK(cache);
+    if (!header->index_rebuild) {
+        /* somebody beat us to it */
+        CACHE_UNLOCK(cache);
+        apc_sma_free(mem TSRMLS_CC);
+        return;
+    }
+    old_mem = header->index_mem;
+    old_groups = header->index_groups;
+    if (groups < old_groups) {
+        /* the cache was rehashed with a larger index meanwhile */
+        CACHE_UNLOCK(cache);
+        apc_sma_free(mem TSRMLS_CC);
+        return;
+    }
+    header->index_mem = mem;
+    header->index = index;
+    CACHE_PUBLISH();
+    header->index_groups = groups;
+    header->index_rebuild = 0;
+    for (i = 0; i < cache->num_stripes; i++) {
+        cache->stripes[i].index_used = 0;
+        cache->stripes[i].index_full = 0;
+    }
+    index_fill(cache);
+    CACHE_UNLOCK(cache);
+
+    if (old_mem) {
+        /* lockless readers may still be probing it */
+        apc_epoch_retire(old_mem, INDEX_BLOCK(old_mem, old_groups) TSRMLS_CC);
+    }
+    apc_debug("Rebuilt the tag index with %d groups\n" TSRMLS_CC, groups);
+}
+/* }}} */
+
+/* {{{ check_rehash */
+static void check_rehash(apc_cache_t* cache TSRMLS_DC)
+{
+    cache_header_t* header = cache->header;
+    slot_t** table;
+    int num_slots;
+    int i;
+
+    /* called without any cache lock held, right before an insert */
+    check_index(cache TSRMLS_CC);
+
+    if (header->old_slots) {
+        if (header->rehash_pending > 0) {
+            /* stripes which see no writes would never finish, move them along */
+            i = (int)(header->rehash_turn++ & (cache->num_stripes - 1));
+            CACHE_STRIPE_LOCK(cache, i);
+            rehash_stripe(cache, i, APC_REHASH_STEP);
+            CACHE_STRIPE_UNLOCK(cache, i);
+        } else {
+            CACHE_LOCK(cache);
+            apc_cache_finish_rehash(cache TSRMLS_CC);
+            CACHE_UNLOCK(cache);
+        }
+        return;
+    }
+
+    num_slots = header->num_slots;
+    if (header->num_entries <= num_slots * APC_CACHE_MAX_LOAD || num_slots >= APC_CACHE_MAX_SLOTS) {
+        return;
+    }
+
+    /* growing the table is not worth an expunge */
+    if (!apc_sma_get_avail_size(2 * TABLE_ALLOC_SIZE(2 * num_slots))) {
+        return;
+    }
+
+    table = (slot_t**) apc_sma_malloc(TABLE_ALLOC_SIZE(2 * num_slots) TSRMLS_CC);
+    if (!table) {
+        return;
+    }
+    memset(table, 0, TABLE_BYTES(2 * num_slots));
+
+    CACHE_LOCK(cache);
+    if (header->old_slots || header->num_slots != num_slots) {
+        /* somebody beat us to it */
+        CACHE_UNLOCK(cache);
+        apc_sma_free(table TSRMLS_CC);
+        return;
+    }
+    header->old_slots = header->slots;
+    CACHE_PUBLISH();
+    header->old_num_slots = num_slots;
+    header->slots = table;
+    CACHE_PUBLISH();
+    header->num_slots = 2 * num_slots;
+    for (i = 0; i < cache->num_stripes; i++) {
+        cache->stripes[i].rehash_idx = i;
+    }
+    header->rehash_pending = cache->num_stripes;
+    CACHE_UNLOCK(cache);
+
+    apc_debug("Rehashing cache from %d to %d slots\n" TSRMLS_CC, num_slots, 2 * num_slots);
+}
+/* }}} */
+
+/* {{{ timer wheel
+ * User entries with an expiry time sit on the timer wheel of their stripe,
+ * guarded by the stripe lock like the chains. Level 0 has a bucket per
+ * second, levels 1 and 2 cover 256 and 16384 seconds per bucket and are
+ * cascaded down as the wheel turns; entries further out than level 2 reaches
+ * wait in its farthest bucket and are filed again on every cascade. Reaping
+ * a second removes the entries of its bucket whose hard ttl (and grace
+ * period) ran out and moves those which merely outlived cache->ttl to the
+ * stripe's stale list, as they may still be fetched until memory runs out.
+ */
+#define WHEEL_L0                 (1 << APC_WHEEL_L0_BITS)
+#define WHEEL_LN                 (1 << APC_WHEEL_LN_BITS)
+#define WHEEL_L1_SPAN            (1UL << (APC_WHEEL_L0_BITS + APC_WHEEL_LN_BITS))
+#define WHEEL_L2_SPAN            (1UL << (APC_WHEEL_L0_BITS + 2 * APC_WHEEL_LN_BITS))
+#define WHEEL_L1(e)              (WHEEL_L0 + (((e) >> APC_WHEEL_L0_BITS) & (WHEEL_LN - 1)))
+#define WHEEL_L2(e)              (WHEEL_L0 + WHEEL_LN + (((e) >> (APC_WHEEL_L0_BITS + APC_WHEEL_LN_BITS)) & (WHEEL_LN - 1)))
+
+#define APC_EXPIRE_BATCH         64     /* entries apc_cache_expire removes per call */
+#define APC_EXPIRE_STEPS         4096   /* seconds a stripe's wheel turns per call */
+
+/* {{{ wheel_bucket */
+static slot_t** wheel_bucket(cache_stripe_t* stripe, time_t expires)
+{
+    unsigned long base = (unsigned long) stripe->wheel_time;
+    unsigned long e = (unsigned long) expires;
+    long delta = (long) (e - base);
+
+    if (delta < 0) {
+        /* already due, reaped with the current second */
+        return &stripe->wheel[base & (WHEEL_L0 - 1)];
+    }
+    if (delta < WHEEL_L0) {
+        return &stripe->wheel[e & (WHEEL_L0 - 1)];
+    }
+    if ((unsigned long) delta < WHEEL_L1_SPAN) {
+        return &stripe->wheel[WHEEL_L1(e)];
+    }
+    if ((unsigned long) delta >= WHEEL_L2_SPAN) {
+        e = base + WHEEL_L2_SPAN - 1;
+    }
+    return &stripe->wheel[WHEEL_L2(e)];
+}
+/* }}} */
+
+/* {{{ wheel_add */
+static void wheel_add(apc_cache_t* cache, slot_t* slot)
+{
+    /* caller holds the stripe of the slot exclusively */
+    cache_stripe_t* stripe = &CACHE_STRIPE_AT(cache, slot->key.h);
+
+    if (slot->value->type != APC_CACHE_ENTRY_USER) {
+        return;
+    }
+    if (slot->value->data.user.ttl) {
+        slot->expires = slot->creation_time + slot->value->data.user.ttl + slot->value->data.user.grace;
+    } else if (cache->ttl) {
+        slot->expires = slot->creation_time + cache->ttl;
+    } else {
+        return;
+    }
+
+    if (!stripe->wheel_count && (long) (slot->creation_time - stripe->wheel_time) > 0) {
+        /* an idle wheel does not need to turn through the seconds it missed */
+        stripe->wheel_time = slot->creation_time;
+    }
+    timer_link(wheel_bucket(stripe, slot->expires), slot);
+    slot->timer = APC_SLOT_TIMER_WHEEL;
+    stripe->wheel_count++;
+}
+/* }}} */
+
+/* {{{ wheel_cascade */
+static void wheel_cascade(cache_stripe_t* stripe, slot_t** bucket)
+{
+    slot_t* p = *bucket;
+
+    *bucket = NULL;
+    while (p) {
+        slot_t* next = p->timer_next;
+        timer_link(wheel_bucket(stripe, p->expires), p);
+        p = next;
+    }
+}
+/* }}} */
+
+/* {{{ wheel_advance */
+static int wheel_advance(apc_cache_t* cache, cache_stripe_t* stripe, time_t now, int budget, int steps TSRMLS_DC)
+{
+    /* caller holds the stripe exclusively. Reaps the seconds before now, up
+     * to budget entries and steps seconds, and returns the budget left */
+    while ((long) (now - stripe->wheel_time) > 0 && budget > 0 && steps-- > 0) {
+        unsigned long t = (unsigned long) stripe->wheel_time;
+        slot_t** bucket = &stripe->wheel[t & (WHEEL_L0 - 1)];
+
+        if (!stripe->wheel_count) {
+            stripe->wheel_time = now;
+            break;
+        }
+
+        if (!(t & (WHEEL_L0 - 1))) {
+            /* level 2 first, its entries may land in the level 1 bucket due now */
+            if (!((t >> APC_WHEEL_L0_BITS) & (WHEEL_LN - 1))) {
+                wheel_cascade(stripe, &stripe->wheel[WHEEL_L2(t)]);
+            }
+            wheel_cascade(stripe, &stripe->wheel[WHEEL_L1(t)]);
+        }
+
+        while (*bucket && budget > 0) {
+            slot_t* p = *bucket;
+
+            timer_unlink(cache, p);
+            if (p->value->data.user.ttl) {
+                slot_t** link = slot_link(cache, p);
+                if (link) {
+                    remove_slot(cache, link TSRMLS_CC);
+                }
+            } else {
+                timer_link(&stripe->stale, p);
+                p->timer = APC_SLOT_TIMER_STALE;
+                stripe->stale_count++;
+            }
+            budget--;
+        }
+        if (*bucket) {
+            /* out of budget, the rest of this second goes next time */
+            break;
+        }
+        stripe->wheel_time++;
+    }
+    return budget;
+}
+/* }}} */
+
+/* {{{ ns_sweep */
+static void ns_sweep(apc_cache_t* cache TSRMLS_DC)
+{
+    /* caller holds CACHE_LOCK. Lookups only remove invalidated entries they
+     * run into, so an expunge drops the rest once per round of invalidations */
+    unsigned long seen;
+    slot_t** p;
+    int i;
+
+    if (!apc_ns || cache->header->ns_swept == (seen = apc_ns->invalidations)) {
+        return;
+    }
+    cache->header->ns_swept = seen;
+
+    for (i = 0; i < cache->header->num_slots; i++) {
+        p = &cache->header->slots[i];
+        while (*p) {
+            if ((*p)->value->type == APC_CACHE_ENTRY_USER && APC_NS_STALE((*p)->value)) {
+                remove_slot(cache, p TSRMLS_CC);
+                continue;
+            }
+            p = &(*p)->next;
+        }
+    }
+}
+/* }}} */
+
+/* {{{ wheel_reap_all */
+static int wheel_reap_all(apc_cache_t* cache, time_t now TSRMLS_DC)
+{
+    /* caller holds CACHE_LOCK. Removes every expired entry and every stale
+     * one and returns how many entries the wheels do not track */
+    int timed = 0;
+    int i;
+
+    for (i = 0; i < cache->num_stripes; i++) {
+        cache_stripe_t* stripe = &cache->stripes[i];
+
+        wheel_advance(cache, stripe, now, INT_MAX, (int) WHEEL_L2_SPAN TSRMLS_CC);
+        while (stripe->stale) {
+            slot_t** link = slot_link(cache, stripe->stale);
+            if (!link) {
+                timer_unlink(cache, stripe->stale);
+                continue;
+            }
+            remove_slot(cache, link TSRMLS_CC);
+        }
+        timed += stripe->wheel_count;
+    }
+    return cache->header->num_entries - timed;
+}
+/* }}} */
+
+/* {{{ apc_cache_expire */
+void apc_cache_expire(apc_cache_t* cache TSRMLS_DC)
+{
+    time_t now;
+    int budget = APC_EXPIRE_BATCH;
+    int i;
+
+    if (!cache) {
+        return;
+    }
+
+    now = apc_time();
+    for (i = 0; i < cache->num_stripes && budget > 0; i++) {
+        int s = (int) (cache->header->expire_turn++ & (cache->num_stripes - 1));
+        cache_stripe_t* stripe = &cache->stripes[s];
+
+        /* unlocked peek, most stripes have nothing due */
+        if (!stripe->wheel_count || (long) (now - stripe->wheel_time) <= 0) {
+            continue;
+        }
+        CACHE_STRIPE_LOCK(cache, s);
+        budget = wheel_advance(cache, stripe, now, budget, APC_EXPIRE_STEPS TSRMLS_CC);
+        CACHE_STRIPE_UNLOCK(cache, s);
+    }
+
+    if (cache_drain(cache, APC_DRAIN_STEP TSRMLS_CC) || budget < APC_EXPIRE_BATCH) {
+        process_pending_removals(cache TSRMLS_CC);
+    }
+}
+/* }}} */
+/* }}} */
+
+/* {{{ compaction
+ * Entries freed between others leave holes, and with values of mixed sizes
+ * the free memory may end up in pieces too small for the next large value
+ * long before it runs out. apc_cache_compact copies user entries which border
+ * on a hole to a new pool, placed in a free block smaller than the one
+ * freeing the old pool leaves, and not next to it. Small holes fill up and
+ * large ones grow, so no entry is moved back and forth. The copy is made
+ * under the stripe lock, which in-place updates of the value take as well;
+ * longs are left alone as apc_inc may change them without it. A moved entry
+ * keeps its generation, the copy holds the same value. File entries are not
+ * moved: op arrays are patched in place while they are executed. */
+
+/* {{{ compact_malloc */
+static void* compact_malloc(size_t n TSRMLS_DC)
+{
+    return apc_sma_malloc_fit(n, APCG(compact_limit), APCG(compact_from) TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ relocate_slot */
+static int relocate_slot(apc_cache_t* cache, slot_t** link TSRMLS_DC)
+{
+    /* caller holds the stripe of the slot exclusively */
+    slot_t* old = *link;
+    apc_cache_entry_t* src = old->value;
+    apc_cache_entry_t* entry;
+    apc_cache_key_t key = old->key;
+    apc_context_t ctxt = {0,};
+    slot_t* p;
+
+    APCG(compact_limit) = apc_sma_get_hole(src->pool);
+    APCG(compact_from) = src->pool;
+    if (!APCG(compact_limit)) {
+        return 0;
+    }
+
+    ctxt.pool = apc_pool_create(APC_SMALL_POOL, compact_malloc, apc_sma_free, apc_sma_protect, apc_sma_unprotect TSRMLS_CC);
+    if (!ctxt.pool) {
+        return 0;
+    }
+    ctxt.copy = APC_COPY_MOVE_USER;
+
+    if (!(entry = (apc_cache_entry_t*) apc_pool_alloc(ctxt.pool, sizeof(apc_cache_entry_t)))) {
+        goto failed;
+    }
+    memcpy(entry, src, sizeof(apc_cache_entry_t));
+    entry->pool = ctxt.pool;
+    if (!(entry->data.user.info = apc_pmemcpy(src->data.user.info, src->data.user.info_len, ctxt.pool TSRMLS_CC))) {
+        goto failed;
+    }
+    if (Z_TYPE_P(src->data.user.val) == IS_ARRAY && !src->data.user.tree) {
+        zend_hash_init(&APCG(copied_zvals), 0, NULL, NULL, 0);
+        entry->data.user.val = apc_copy_zval(NULL, src->data.user.val, &ctxt TSRMLS_CC);
+        zend_hash_destroy(&APCG(copied_zvals));
+        APCG(copied_zvals).nTableSize=0;
+    } else {
+        entry->data.user.val = apc_copy_zval(NULL, src->data.user.val, &ctxt TSRMLS_CC);
+    }
+    if (!entry->data.user.val || (p = make_slot(&key, entry, old->next, old->creation_time TSRMLS_CC)) == NULL) {
+        goto failed;
+    }
+    /* the pool is never grown again, only freed */
+    ctxt.pool->allocate = apc_sma_malloc;
+    entry->mem_size = ctxt.pool->size;
+
+    p->num_hits = old->num_hits;
+    p->access_time = old->access_time;
+    p->referenced = old->referenced;
+    p->expires = old->expires;
+    if (old->timer != APC_SLOT_TIMER_NONE) {
+        /* takes the place of the old slot on its list */
+        p->timer = old->timer;
+        p->timer_next = old->timer_next;
+        p->timer_pprev = old->timer_pprev;
+        *p->timer_pprev = p;
+        if (p->timer_next) {
+            p->timer_next->timer_pprev = &p->timer_next;
+        }
+        old->timer = APC_SLOT_TIMER_NONE;
+        old->timer_next = NULL;
+        old->timer_pprev = NULL;
+    }
+
+    if (cache->header->index) {
+        index_remove(cache, old);
+    }
+    CACHE_PUBLISH();
+    *link = p;
+    index_insert(cache, p);
+
+    CACHE_GC_LOCK(cache);
+    cache->header->mem_size += entry->mem_size - src->mem_size;
+    cache->header->relocations++;
+    retire_slot(cache, old);
+    CACHE_GC_UNLOCK(cache);
+    return 1;
+
+failed:
+    apc_pool_destroy(ctxt.pool TSRMLS_CC);
+    return 0;
+}
+/* }}} */
+
+/* {{{ apc_cache_compact */
+void apc_cache_compact(apc_cache_t* cache TSRMLS_DC)
+{
+    struct timeval start, now;
+    long elapsed = 0;
+    int moved = 0;
+    int i;
+    time_t t;
+
+    if (!cache || APCG(compact_threshold) <= 0) {
+        return;
+    }
+
+    t = apc_time();
+    if (cache->header->compact_time == t) {
+        return;
+    }
+    cache->header->compact_time = t;
+    if (cache->header->old_slots || apc_sma_get_fragmentation() < APCG(compact_threshold)) {
+        return;
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < cache->header->num_slots && elapsed < APCG(compact_budget); i++) {
+        /* a bucket maps to the same stripe whatever the table size */
+        unsigned long hand = cache->header->compact_hand++;
+        slot_t** p;
+
+        CACHE_STRIPE_LOCK(cache, hand);
+        if (cache->header->old_slots) {
+            /* a rehash started meanwhile */
+            CACHE_STRIPE_UNLOCK(cache, hand);
+            break;
+        }
+        for (p = &cache->header->slots[SLOT_INDEX(cache, hand)]; *p; p = &(*p)->next) {
+            apc_cache_entry_t* value = (*p)->value;
+
+            if (value->type != APC_CACHE_ENTRY_USER || value->ref_count || USER_SLOT_EXPIRED(*p, t) ||
+                Z_TYPE_P(value->data.user.val) == IS_LONG) {
+                continue;
+            }
+            moved += relocate_slot(cache, p TSRMLS_CC);
+        }
+        CACHE_STRIPE_UNLOCK(cache, hand);
+
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_usec - start.tv_usec);
+    }
+
+    if (moved) {
+        process_pending_removals(cache TSRMLS_CC);
+    }
+}
+/* }}} */
+/* }}} */
+
 /* {{{ apc_cache_create */
-apc_cache_t* apc_cache_create(int size_hint, int gc_ttl, int ttl TSRMLS_DC)
+apc_cache_t* apc_cache_create(int size_hint, int gc_ttl, int ttl, int num_stripes, int index_mode, int eviction TSRMLS_DC)
 {
     apc_cache_t* cache;
     int cache_size;
     int num_slots;
+    int i;
+
+    num_slots = make_table_size(size_hint > 0 ? size_hint : 2000);
 
-    num_slots = make_prime(size_hint > 0 ? size_hint : 2000);
+    /* stripes must be a power of two no larger than the table */
+    if (num_stripes < 1) {
+        num_stripes = 1;
+    } else if (num_stripes > num_slots) {
+        num_stripes = num_slots;
+    }
+    for (i = 1; (i << 1) <= num_stripes; i <<= 1);
+    num_stripes = i;
 
     cache = (apc_cache_t*) apc_emalloc(sizeof(apc_cache_t) TSRMLS_CC);
-    cache_size = sizeof(cache_header_t) + num_slots*sizeof(slot_t*);
+
+    /* shm layout: header | stripes | counter shards, the slot table is allocated on its own so it can be replaced */
+    cache_size = sizeof(cache_header_t) + num_stripes*sizeof(cache_stripe_t) + APC_CACHE_STAT_SHARDS*sizeof(cache_stats_t) + APC_STATS_ALIGN;
 
     cache->shmaddr = apc_sma_malloc(cache_size TSRMLS_CC);
     if(!cache->shmaddr) {
@@ -286,22 +1387,62 @@ apc_cache_t* apc_cache_create(int size_hint, int gc_ttl, int ttl TSRMLS_DC)
     memset(cache->shmaddr, 0, cache_size);
 
     cache->header = (cache_header_t*) cache->shmaddr;
-    cache->header->num_hits = 0;
-    cache->header->num_misses = 0;
     cache->header->deleted_list = NULL;
+    cache->header->deleted_tail = NULL;
+    cache->header->deleted_epoch = 0;
     cache->header->start_time = time(NULL);
     cache->header->expunges = 0;
+    cache->header->evictions = 0;
+    cache->header->relocations = 0;
+    cache->header->clock_hand = 0;
+    cache->header->compact_hand = 0;
+    cache->header->compact_time = 0;
+    cache->header->generation = 0;
+    cache->header->ns_swept = 0;
     cache->header->busy = 0;
+    cache->header->drain_slots = NULL;
+    cache->header->drain_num_slots = 0;
+    cache->header->drain_idx = 0;
 
-    cache->slots = (slot_t**) (((char*) cache->shmaddr) + sizeof(cache_header_t));
-    cache->num_slots = num_slots;
+    cache->header->slots = (slot_t**) apc_sma_malloc(TABLE_ALLOC_SIZE(num_slots) TSRMLS_CC);
+    if(!cache->header->slots) {
+        apc_error("Unable to allocate shared memory for cache structures.  (Perhaps your shared memory size isn't large enough?). " TSRMLS_CC);
+        return NULL;
+    }
+    memset(cache->header->slots, 0, TABLE_BYTES(num_slots));
+    cache->header->num_slots = num_slots;
+    cache->header->old_slots = NULL;
+    cache->header->old_num_slots = 0;
+    cache->header->rehash_pending = 0;
+
+    cache->stripes = (cache_stripe_t*) (((char*) cache->shmaddr) + sizeof(cache_header_t));
+    cache->header->stats = (cache_stats_t*) (((size_t) (cache->stripes + num_stripes) + APC_STATS_ALIGN - 1) & ~(size_t)(APC_STATS_ALIGN - 1));
+    cache->num_stripes = num_stripes;
+
+    cache->header->index_mode = index_mode;
+    cache->header->index = NULL;
+    cache->header->index_mem = NULL;
+    cache->header->index_groups = 0;
+    cache->header->index_rebuild = 0;
+    if (index_mode == APC_CACHE_INDEX_TAGGED) {
+        cache->header->index_groups = index_groups_for(cache, num_slots);
+        cache->header->index_mem = index_alloc(cache->header->index_groups, &cache->header->index TSRMLS_CC);
+        if (!cache->header->index_mem) {
+            /* retried by the first insert */
+            cache->header->index_groups = 0;
+            cache->header->index_rebuild = 1;
+        }
+    }
     cache->gc_ttl = gc_ttl;
     cache->ttl = ttl;
+    cache->eviction = eviction;
     CREATE_LOCK(cache->header->lock);
+    for (i = 0; i < num_stripes; i++) {
+        CREATE_LOCK(cache->stripes[i].lock);
+    }
 #if NONBLOCKING_LOCK_AVAILABLE
     CREATE_LOCK(cache->header->wrlock);
 #endif
-    memset(cache->slots, 0, sizeof(slot_t*)*num_slots);
     cache->expunge_cb = apc_cache_expunge;
     cache->has_lock = 0;
 
@@ -312,45 +1453,298 @@ apc_cache_t* apc_cache_create(int size_hint, int gc_ttl, int ttl TSRMLS_DC)
 /* {{{ apc_cache_destroy */
 void apc_cache_destroy(apc_cache_t* cache TSRMLS_DC)
 {
+    int i;
+
+    for (i = 0; i < cache->num_stripes; i++) {
+        DESTROY_LOCK(cache->stripes[i].lock);
+    }
     DESTROY_LOCK(cache->header->lock);
 #if NONBLOCKING_LOCK_AVAILABLE
     DESTROY_LOCK(cache->header->wrlock);
 #endif
 
-	/* XXX this is definitely a leak, but freeing this causes all the apache
-		children to freeze. It might be because the segment is shared between
-		several processes. To figure out is how to free this safely. */
-    /*apc_sma_free(cache->shmaddr TSRMLS_CC);*/
-    apc_efree(cache TSRMLS_CC);
+	/* XXX this is definitely a leak, but freeing this causes all the apache
+		children to freeze. It might be because the segment is shared between
+		several processes. To figure out is how to free this safely. */
+    /*apc_sma_free(cache->shmaddr TSRMLS_CC);*/
+    apc_efree(cache TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ struct definition: wipe_spare_t
+   An empty slot table, and index, allocated ahead of a wipe to swap in. */
+typedef struct wipe_spare_t wipe_spare_t;
+struct wipe_spare_t {
+    slot_t** table;
+    int num_slots;
+    void* index_mem;
+    cache_index_group_t* index;
+    int index_groups;
+};
+/* }}} */
+
+/* {{{ cache_drain */
+static int cache_drain(apc_cache_t* cache, int steps TSRMLS_DC)
+{
+    /* Queues the slots of the table a wipe dropped for removal, up to steps
+     * buckets of it, and returns how many slots it queued. Only lockless
+     * readers may still be walking that table, so the gc lock is all this
+     * takes. The table itself is retired once it is empty. */
+    cache_header_t* header = cache->header;
+    slot_t** table = NULL;
+    int num_slots = 0;
+    int count = 0;
+    unsigned long stamp;
+    time_t now;
+
+    if (!header->drain_slots) {
+        return 0;
+    }
+
+    now = time(0);
+    CACHE_GC_LOCK(cache);
+    stamp = apc_epoch_current();
+    while (header->drain_slots && header->drain_idx < header->drain_num_slots && steps-- > 0) {
+        slot_t* p = header->drain_slots[header->drain_idx++];
+
+        while (p) {
+            slot_t* next = p->next;
+
+            /* the wheels were emptied along with the table */
+            p->timer = APC_SLOT_TIMER_NONE;
+            p->next = NULL;
+            p->deletion_time = now;
+            p->retire_epoch = stamp;
+            if (header->deleted_tail) {
+                header->deleted_tail->next = p;
+            } else {
+                header->deleted_list = p;
+            }
+            header->deleted_tail = p;
+            count++;
+            p = next;
+        }
+    }
+    if (count) {
+        header->deleted_epoch = stamp;
+    }
+    if (header->drain_slots && header->drain_idx >= header->drain_num_slots) {
+        table = header->drain_slots;
+        num_slots = header->drain_num_slots;
+        header->drain_slots = NULL;
+        header->drain_num_slots = 0;
+        header->drain_idx = 0;
+    }
+    CACHE_GC_UNLOCK(cache);
+
+    if (table) {
+        /* lockless readers may still be walking it */
+        apc_epoch_retire(table, TABLE_BLOCK(table, num_slots) TSRMLS_CC);
+    }
+    return count;
+}
+/* }}} */
+
+/* {{{ wipe_prepare */
+static void wipe_prepare(apc_cache_t* cache, wipe_spare_t* spare TSRMLS_DC)
+{
+    /* neither allocation is worth an expunge, without them wipe removes the
+     * entries one by one */
+    memset(spare, 0, sizeof(wipe_spare_t));
+    if (cache->header->drain_slots) {
+        /* only one dropped table is taken apart at a time */
+        return;
+    }
+
+    spare->num_slots = cache->header->num_slots;
+    if (apc_sma_get_avail_block(TABLE_ALLOC_SIZE(spare->num_slots) TSRMLS_CC)) {
+        spare->table = (slot_t**) apc_sma_malloc(TABLE_ALLOC_SIZE(spare->num_slots) TSRMLS_CC);
+    }
+    if (!spare->table) {
+        return;
+    }
+    memset(spare->table, 0, TABLE_BYTES(spare->num_slots));
+
+    spare->index_groups = cache->header->index_groups;
+    if (spare->index_groups) {
+        spare->index_mem = index_alloc(spare->index_groups, &spare->index TSRMLS_CC);
+    }
+}
+/* }}} */
+
+/* {{{ wipe */
+static int wipe(apc_cache_t* cache, wipe_spare_t* spare TSRMLS_DC)
+{
+    /* caller holds CACHE_LOCK and has finished any rehash. Empties the cache
+     * and returns how many entries it held. With a spare table that is just a
+     * swap: cache_drain takes the old table apart later, under the gc lock
+     * only, so lookups are not held up while it does. */
+    cache_header_t* header = cache->header;
+    int count = header->num_entries;
+    void* old_index_mem = NULL;
+    int old_groups = 0;
+    int i;
+
+    if (spare->table && (header->drain_slots || spare->num_slots != header->num_slots)) {
+        /* the table was dropped or grown since wipe_prepare */
+        apc_sma_free(spare->table TSRMLS_CC);
+        spare->table = NULL;
+    }
+
+    if (!spare->table) {
+        for (i = 0; i < header->num_slots; i++) {
+            slot_t* p = header->slots[i];
+            while (p) {
+                remove_slot(cache, &p TSRMLS_CC);
+            }
+            header->slots[i] = NULL;
+        }
+        index_reset(cache);
+    } else {
+        CACHE_GC_LOCK(cache);
+        header->drain_slots = header->slots;
+        header->drain_num_slots = header->num_slots;
+        header->drain_idx = 0;
+        header->mem_size = 0;
+        header->saved_size = 0;
+        header->num_entries = 0;
+        CACHE_GC_UNLOCK(cache);
+
+        /* same size, readers holding the old table fail their seq check */
+        header->slots = spare->table;
+        spare->table = NULL;
+
+        if (header->index && spare->index_mem && spare->index_groups == header->index_groups) {
+            old_index_mem = header->index_mem;
+            old_groups = header->index_groups;
+            header->index_mem = spare->index_mem;
+            header->index = spare->index;
+            spare->index_mem = NULL;
+            for (i = 0; i < cache->num_stripes; i++) {
+                cache->stripes[i].index_used = 0;
+                cache->stripes[i].index_full = 0;
+            }
+            header->index_rebuild = 0;
+        } else {
+            index_reset(cache);
+        }
+
+        for (i = 0; i < cache->num_stripes; i++) {
+            cache_stripe_t* stripe = &cache->stripes[i];
+            memset(stripe->wheel, 0, sizeof(stripe->wheel));
+            stripe->stale = NULL;
+            stripe->wheel_count = 0;
+            stripe->stale_count = 0;
+        }
+    }
+
+    if (spare->index_mem) {
+        apc_sma_free(spare->index_mem TSRMLS_CC);
+        spare->index_mem = NULL;
+    }
+    if (old_index_mem) {
+        /* lockless readers may still be probing it */
+        apc_epoch_retire(old_index_mem, INDEX_BLOCK(old_index_mem, old_groups) TSRMLS_CC);
+    }
+    return count;
 }
 /* }}} */
 
 /* {{{ apc_cache_clear */
 void apc_cache_clear(apc_cache_t* cache TSRMLS_DC)
 {
+    wipe_spare_t spare;
     int i;
 
     if(!cache) return;
 
+    /* outside the cache lock: the table an earlier wipe dropped, the
+     * allocations and whatever each stripe has left of a rehash */
+    cache_drain(cache, INT_MAX TSRMLS_CC);
+    for (i = 0; cache->header->old_slots && i < cache->num_stripes; i++) {
+        CACHE_STRIPE_LOCK(cache, i);
+        rehash_stripe(cache, i, INT_MAX);
+        CACHE_STRIPE_UNLOCK(cache, i);
+    }
+    wipe_prepare(cache, &spare TSRMLS_CC);
+
     CACHE_LOCK(cache);
-    cache->header->busy = 1;
-    cache->header->num_hits = 0;
-    cache->header->num_misses = 0;
+    for (i = 0; i < APC_CACHE_STAT_SHARDS; i++) {
+        cache->header->stats[i].num_hits = 0;
+        cache->header->stats[i].num_misses = 0;
+    }
     cache->header->start_time = time(NULL);
     cache->header->expunges = 0;
+    cache->header->evictions = 0;
+    cache->header->relocations = 0;
 
-    for (i = 0; i < cache->num_slots; i++) {
-        slot_t* p = cache->slots[i];
-        while (p) {
-            remove_slot(cache, &p TSRMLS_CC);
+    apc_cache_finish_rehash(cache TSRMLS_CC);
+    wipe(cache, &spare TSRMLS_CC);
+
+    CACHE_UNLOCK(cache);
+
+    /* the rest of the old table goes at the end of the following requests */
+    cache_drain(cache, APC_DRAIN_STEP TSRMLS_CC);
+    process_pending_removals(cache TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ clock_evict */
+static void clock_evict(apc_cache_t* cache, size_t size TSRMLS_DC)
+{
+    /* caller holds CACHE_LOCK and has finished any rehash. The hand clears
+     * the referenced bit of the entries it passes and evicts those found
+     * without one, until an allocation of size fits. Two turns give every
+     * entry its second chance, so the sweep is bounded by that. */
+    cache_header_t* header = cache->header;
+    unsigned long steps = 2 * (unsigned long) header->num_slots;
+    size_t freed = 0;
+
+    while (steps--) {
+        slot_t** p = &header->slots[header->clock_hand++ & (unsigned long)(header->num_slots - 1)];
+
+        while (*p) {
+            if ((*p)->referenced) {
+                (*p)->referenced = 0;
+                p = &(*p)->next;
+                continue;
+            }
+            freed += (*p)->value->mem_size;
+            remove_slot(cache, p TSRMLS_CC);
+            header->evictions++;
         }
-        cache->slots[i] = NULL;
-    }
 
-    memset(&cache->header->lastkey, 0, sizeof(apc_keyid_t));
+        if (freed >= size) {
+            process_pending_removals(cache TSRMLS_CC);
+            if (apc_sma_get_avail_block(size TSRMLS_CC)) {
+                return;
+            }
+            if (header->deleted_list) {
+                /* enough was evicted, readers still hold on to some of it */
+                return;
+            }
+            /* fragmented: keep going until a large enough block frees up */
+            freed = 0;
+        }
+    }
+    process_pending_removals(cache TSRMLS_CC);
+}
+/* }}} */
 
+/* {{{ expunge_wipe */
+static void expunge_wipe(apc_cache_t* cache TSRMLS_DC)
+{
+    /* caller holds CACHE_SAFE_LOCK for an expunge, which ends here */
+    wipe_spare_t spare;
+
+    wipe_prepare(cache, &spare TSRMLS_CC);
+    cache->header->evictions += wipe(cache, &spare TSRMLS_CC);
+    /* give the memory back before the writers waiting on the stripes go on,
+     * unless somebody is still reading it. Lookups carry on meanwhile. */
+    cache_drain(cache, INT_MAX TSRMLS_CC);
+    process_pending_removals(cache TSRMLS_CC);
     cache->header->busy = 0;
-    CACHE_UNLOCK(cache);
+    CACHE_SAFE_UNLOCK(cache);
 }
 /* }}} */
 
@@ -364,53 +1758,49 @@ static void apc_cache_expunge(apc_cache_t* cache, size_t size TSRMLS_DC)
 
     if(!cache) return;
 
+    /* a table dropped by a wipe holds memory nobody can reach anymore */
+    cache_drain(cache, INT_MAX TSRMLS_CC);
+
+    CACHE_SAFE_LOCK(cache);
+    if (cache->has_lock > 1 && cache->header->busy) {
+        /* an allocation of our own expunge ran out of memory, it carries on */
+        CACHE_SAFE_UNLOCK(cache);
+        return;
+    }
+    process_pending_removals(cache TSRMLS_CC);
+    if (EXPUNGE_DONE(cache, size)) {
+        /* probably a queued up expunge, we don't need to do this */
+        CACHE_SAFE_UNLOCK(cache);
+        return;
+    }
+    cache->header->busy = 1;
+    CACHE_FAST_INC(cache, cache->header->expunges);
+    apc_cache_finish_rehash(cache TSRMLS_CC);
+
     if(!cache->ttl) {
         /*
-         * If cache->ttl is not set, we wipe out the entire cache when
-         * we run out of space.
+         * If cache->ttl is not set, we evict the entries not hit recently
+         * (or wipe out the entire cache) when we run out of space.
          */
-        CACHE_SAFE_LOCK(cache);
+        /* user entries past their own ttl or namespace go first */
+        wheel_reap_all(cache, t TSRMLS_CC);
+        ns_sweep(cache TSRMLS_CC);
         process_pending_removals(cache TSRMLS_CC);
-        if (apc_sma_get_avail_mem() > (size_t)(APCG(shm_size)/2)) {
-            /* probably a queued up expunge, we don't need to do this */
-            CACHE_SAFE_UNLOCK(cache);
-            return;
-        }
-        cache->header->busy = 1;
-        CACHE_FAST_INC(cache, cache->header->expunges);
-clear_all:
-        for (i = 0; i < cache->num_slots; i++) {
-            slot_t* p = cache->slots[i];
-            while (p) {
-                remove_slot(cache, &p TSRMLS_CC);
-            }
-            cache->slots[i] = NULL;
-        }
-        memset(&cache->header->lastkey, 0, sizeof(apc_keyid_t));
-        cache->header->busy = 0;
-        CACHE_SAFE_UNLOCK(cache);
     } else {
         slot_t **p;
+        int untimed;
         /*
-         * If the ttl for the cache is set we walk through and delete stale 
-         * entries.  For the user cache that is slightly confusing since
-         * we have the individual entry ttl's we can look at, but that would be
-         * too much work.  So if you want the user cache expunged, set a high
-         * default apc.user_ttl and still provide a specific ttl for each entry
-         * on insert
+         * If the ttl for the cache is set we delete stale entries.  For the
+         * user cache that is slightly confusing since we have the individual
+         * entry ttl's we can look at: an entry goes once its own ttl and grace ran out,
+         * or without one once it is older than the default apc.user_ttl.
+         * Those are all on the timer wheels, so only a cache holding other
+         * entries (the file cache) has to be walked.
          */
-
-        CACHE_SAFE_LOCK(cache);
-        process_pending_removals(cache TSRMLS_CC);
-        if (apc_sma_get_avail_mem() > (size_t)(APCG(shm_size)/2)) {
-            /* probably a queued up expunge, we don't need to do this */
-            CACHE_SAFE_UNLOCK(cache);
-            return;
-        }
-        cache->header->busy = 1;
-        CACHE_FAST_INC(cache, cache->header->expunges);
-        for (i = 0; i < cache->num_slots; i++) {
-            p = &cache->slots[i];
+        untimed = wheel_reap_all(cache, t TSRMLS_CC);
+        ns_sweep(cache TSRMLS_CC);
+        for (i = 0; untimed > 0 && i < cache->header->num_slots; i++) {
+            p = &cache->header->slots[i];
             while(*p) {
                 /*
                  * For the user cache we look at the individual entry ttl values
@@ -418,7 +1808,7 @@ clear_all:
                  */
                 if((*p)->value->type == APC_CACHE_ENTRY_USER) {
                     if((*p)->value->data.user.ttl) {
-                        if((time_t) ((*p)->creation_time + (*p)->value->data.user.ttl) < t) {
+                        if(USER_SLOT_DEAD(*p, t)) {
                             remove_slot(cache, p TSRMLS_CC);
                             continue;
                         }
@@ -435,42 +1825,43 @@ clear_all:
                 p = &(*p)->next;
             }
         }
+        process_pending_removals(cache TSRMLS_CC);
+    }
 
-        if (!apc_sma_get_avail_size(size)) {
-            /* TODO: re-do this to remove goto across locked sections */
-            goto clear_all;
+    if (!apc_sma_get_avail_block(size TSRMLS_CC)) {
+        if (cache->eviction != APC_CACHE_EVICT_CLOCK) {
+            expunge_wipe(cache TSRMLS_CC);
+            return;
         }
-        memset(&cache->header->lastkey, 0, sizeof(apc_keyid_t));
-        cache->header->busy = 0;
-        CACHE_SAFE_UNLOCK(cache);
+        clock_evict(cache, size TSRMLS_CC);
     }
+    cache->header->busy = 0;
+    CACHE_SAFE_UNLOCK(cache);
 }
 /* }}} */
 
 /* {{{ apc_cache_insert */
 static inline int _apc_cache_insert(apc_cache_t* cache,
-                     apc_cache_key_t key,
-                     apc_cache_entry_t* value,
+                     slot_t* new_slot,
                      apc_context_t* ctxt,
                      time_t t
                      TSRMLS_DC)
 {
     slot_t** slot;
-
-    if (!value) {
-        return 0;
-    }
+    apc_cache_key_t key = new_slot->key;
+    apc_cache_entry_t* value = new_slot->value;
 
     apc_debug("Inserting [%s]\n" TSRMLS_CC, value->data.file.filename);
 
     process_pending_removals(cache TSRMLS_CC);
+    rehash_key(cache, key.h);
 
-    slot = &cache->slots[key.h % cache->num_slots];
+    slot = &cache->header->slots[SLOT_INDEX(cache, key.h)];
 
     while(*slot) {
       if(key.type == (*slot)->key.type) {
         if(key.type == APC_CACHE_KEY_FILE) {
-            if(key_equals((*slot)->key.data.file, key.data.file)) {
+            if(key.h == (*slot)->key.h && key_equals((*slot)->key.data.file, key.data.file)) {
                 /* If existing slot for the same device+inode is different, remove it and insert the new version */
                 if (ctxt->force_update || (*slot)->key.mtime != key.mtime) {
                     remove_slot(cache, slot TSRMLS_CC);
@@ -496,14 +1887,16 @@ static inline int _apc_cache_insert(apc_cache_t* cache,
       slot = &(*slot)->next;
     }
 
-    if ((*slot = make_slot(&key, value, *slot, t TSRMLS_CC)) == NULL) {
-        return -1;
-    }
+    new_slot->next = *slot;
+    *slot = new_slot;
+    index_insert(cache, new_slot);
 
     value->mem_size = ctxt->pool->size;
+    CACHE_GC_LOCK(cache);
     cache->header->mem_size += ctxt->pool->size;
     CACHE_FAST_INC(cache, cache->header->num_entries);
-    CACHE_FAST_INC(cache, cache->header->num_inserts);
+    CACHE_GC_UNLOCK(cache);
+    CACHE_STAT_INC(cache, num_inserts);
 
     return 1;
 }
@@ -513,9 +1906,22 @@ static inline int _apc_cache_insert(apc_cache_t* cache,
 int apc_cache_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_entry_t* value, apc_context_t *ctxt, time_t t TSRMLS_DC)
 {
     int rval;
-    CACHE_LOCK(cache);
-    rval = _apc_cache_insert(cache, key, value, ctxt, t TSRMLS_CC);
-    CACHE_UNLOCK(cache);
+    slot_t* new_slot;
+
+    if (!value) {
+        return 0;
+    }
+
+    check_rehash(cache TSRMLS_CC);
+
+    /* allocate before locking: a failed allocation expunges, which takes every stripe */
+    if ((new_slot = make_slot(&key, value, NULL, t TSRMLS_CC)) == NULL) {
+        return -1;
+    }
+
+    CACHE_STRIPE_LOCK(cache, key.h);
+    rval = _apc_cache_insert(cache, new_slot, ctxt, t TSRMLS_CC);
+    CACHE_STRIPE_UNLOCK(cache, key.h);
     return rval;
 }
 /* }}} */
@@ -524,62 +1930,49 @@ int apc_cache_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_entry_t*
 int *apc_cache_insert_mult(apc_cache_t* cache, apc_cache_key_t* keys, apc_cache_entry_t** values, apc_context_t *ctxt, time_t t, int num_entries TSRMLS_DC)
 {
     int *rval;
+    slot_t **new_slots;
     int i;
 
+    check_rehash(cache TSRMLS_CC);
+
     rval = emalloc(sizeof(int) * num_entries);
-    CACHE_LOCK(cache);
+    new_slots = emalloc(sizeof(slot_t*) * num_entries);
     for (i=0; i < num_entries; i++) {
+        new_slots[i] = NULL;
         if (values[i]) {
+            apc_cache_key_t key = keys[i];
+            if ((new_slots[i] = make_slot(&key, values[i], NULL, t TSRMLS_CC)) == NULL) {
+                rval[i] = -1;
+            }
+        }
+    }
+
+    CACHE_LOCK(cache);
+    for (i=0; i < num_entries; i++) {
+        if (new_slots[i]) {
             ctxt->pool = values[i]->pool;
-            rval[i] = _apc_cache_insert(cache, keys[i], values[i], ctxt, t TSRMLS_CC);
+            rval[i] = _apc_cache_insert(cache, new_slots[i], ctxt, t TSRMLS_CC);
         }
     }
     CACHE_UNLOCK(cache);
+    efree(new_slots);
     return rval;
 }
 /* }}} */
 
-/* {{{ apc_cache_user_insert */
-int apc_cache_user_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_entry_t* value, apc_context_t* ctxt, time_t t, int exclusive TSRMLS_DC)
+/* {{{ _apc_cache_user_insert */
+static int _apc_cache_user_insert(apc_cache_t* cache, slot_t* new_slot, time_t t, int exclusive TSRMLS_DC)
 {
+    /* caller holds the stripe of the key */
     slot_t** slot;
+    apc_cache_key_t key = new_slot->key;
+    apc_cache_entry_t* value = new_slot->value;
     unsigned int keylen = key.data.user.identifier_len;
-    apc_keyid_t *lastkey = &cache->header->lastkey;
-    
-    if (!value) {
-        return 0;
-    }
-    
-    if(apc_cache_busy(cache)) {
-        /* cache cleanup in progress, do not wait */ 
-        return 0;
-    }
-
-    if(apc_cache_is_last_key(cache, &key, t TSRMLS_CC)) {
-        /* potential cache slam */
-        return 0;
-    }
-
-    CACHE_LOCK(cache);
-
-    memset(lastkey, 0, sizeof(apc_keyid_t));
-
-    lastkey->h = key.h;
-    lastkey->keylen = keylen;
-    lastkey->mtime = t;
-#ifdef ZTS
-    lastkey->tid = tsrm_thread_id();
-#else
-    lastkey->pid = getpid();
-#endif
-    
-    /* we do not reset lastkey after the insert. Whether it is inserted 
-     * or not, another insert in the same second is always a bad idea. 
-     */
 
     process_pending_removals(cache TSRMLS_CC);
+    rehash_key(cache, key.h);
     
-    slot = &cache->slots[key.h % cache->num_slots];
+    slot = &cache->header->slots[SLOT_INDEX(cache, key.h)];
 
     while (*slot) {
         if (((*slot)->key.h == key.h) && 
@@ -590,10 +1983,10 @@ int apc_cache_user_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_ent
              * the user entry already exists and it has no ttl, or
              * there is a ttl and the entry has not timed out yet.
              */
-            if(exclusive && (  !(*slot)->value->data.user.ttl ||
+            if(exclusive && !APC_NS_STALE((*slot)->value) && (  !(*slot)->value->data.user.ttl ||
                               ( (*slot)->value->data.user.ttl && (time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) >= t ) 
                             ) ) {
-                goto fail;
+                return 0;
             }
             remove_slot(cache, slot TSRMLS_CC);
             break;
@@ -605,89 +1998,382 @@ int apc_cache_user_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_ent
          * access ttl on it and removing entries that haven't been accessed for ttl seconds and secondly
          * we see if the entry has a hard ttl on it and remove it if it has been around longer than its ttl
          */
-        if((cache->ttl && (*slot)->access_time < (t - cache->ttl)) || 
-           ((*slot)->value->data.user.ttl && (time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) < t)) {
+        if((cache->ttl && (*slot)->access_time < (t - cache->ttl)) || USER_SLOT_DEAD(*slot, t)) {
             remove_slot(cache, slot TSRMLS_CC);
             continue;
         }
         slot = &(*slot)->next;
     }
 
-    if ((*slot = make_slot(&key, value, *slot, t TSRMLS_CC)) == NULL) {
-        goto fail;
-    } 
+    new_slot->next = *slot;
+    *slot = new_slot;
+    index_insert(cache, new_slot);
+    wheel_add(cache, new_slot);
     
-    value->mem_size = ctxt->pool->size;
-    cache->header->mem_size += ctxt->pool->size;
+    value->mem_size = value->pool->size;
 
+    CACHE_GC_LOCK(cache);
+    value->data.user.gen = ++cache->header->generation;
+    cache->header->mem_size += value->pool->size;
+    cache->header->saved_size += APC_ENTRY_SAVED(value);
     CACHE_FAST_INC(cache, cache->header->num_entries);
-    CACHE_FAST_INC(cache, cache->header->num_inserts);
-
-    CACHE_UNLOCK(cache);
+    CACHE_GC_UNLOCK(cache);
+    CACHE_STAT_INC(cache, num_inserts);
 
     return 1;
+}
+/* }}} */
 
-fail:
-    CACHE_UNLOCK(cache);
+/* {{{ apc_cache_user_insert */
+int apc_cache_user_insert(apc_cache_t* cache, apc_cache_key_t key, apc_cache_entry_t* value, apc_context_t* ctxt, time_t t, int exclusive TSRMLS_DC)
+{
+    int rval;
+    slot_t* new_slot;
 
-    return 0;
+    if (!value) {
+        return 0;
+    }
+    
+    if(apc_cache_is_leased(cache, &key TSRMLS_CC)) {
+        /* potential cache slam */
+        return 0;
+    }
+
+    check_rehash(cache TSRMLS_CC);
+
+    /* allocate before locking: a failed allocation expunges, which takes every stripe */
+    if ((new_slot = make_slot(&key, value, NULL, t TSRMLS_CC)) == NULL) {
+        return 0;
+    }
+
+    CACHE_STRIPE_LOCK(cache, key.h);
+    rval = _apc_cache_user_insert(cache, new_slot, t, exclusive TSRMLS_CC);
+    CACHE_STRIPE_UNLOCK(cache, key.h);
+
+    return rval;
+}
+/* }}} */
+
+/* {{{ insert_mult_order */
+typedef struct insert_mult_order_t {
+    unsigned long order;        /* stripe, then bucket */
+    int i;
+} insert_mult_order_t;
+
+static int insert_mult_order_cmp(const void* a, const void* b)
+{
+    unsigned long x = ((const insert_mult_order_t*) a)->order;
+    unsigned long y = ((const insert_mult_order_t*) b)->order;
+
+    if (x != y) {
+        return x < y ? -1 : 1;
+    }
+    /* keeps the batch order among keys sharing a bucket */
+    return ((const insert_mult_order_t*) a)->i - ((const insert_mult_order_t*) b)->i;
+}
+/* }}} */
+
+/* {{{ apc_cache_user_insert_mult */
+int *apc_cache_user_insert_mult(apc_cache_t* cache, apc_cache_key_t* keys, apc_cache_entry_t** values, time_t t, int exclusive, int num_entries TSRMLS_DC)
+{
+    int *rval;
+    slot_t **new_slots;
+    insert_mult_order_t* order;
+    unsigned long num_slots;
+    int num_order = 0;
+    int i, j;
+
+    rval = emalloc(sizeof(int) * (num_entries > 0 ? num_entries : 1));
+    for (i = 0; i < num_entries; i++) {
+        rval[i] = 0;
+    }
+    if (num_entries <= 0) {
+        return rval;
+    }
+
+    check_rehash(cache TSRMLS_CC);
+    num_slots = (unsigned long) cache->header->num_slots;
+
+    /* allocate before locking: a failed allocation expunges, which takes every stripe */
+    new_slots = emalloc(sizeof(slot_t*) * num_entries);
+    order = (insert_mult_order_t*) emalloc(sizeof(insert_mult_order_t) * num_entries);
+    for (i = 0; i < num_entries; i++) {
+        apc_cache_key_t key = keys[i];
+
+        new_slots[i] = NULL;
+        if (!values[i] || apc_cache_is_leased(cache, &key TSRMLS_CC)) {
+            continue;
+        }
+        if ((new_slots[i] = make_slot(&key, values[i], NULL, t TSRMLS_CC)) == NULL) {
+            rval[i] = -1;
+            continue;
+        }
+        order[num_order].order = (key.h & (unsigned long) (cache->num_stripes - 1)) * num_slots + (key.h & (num_slots - 1));
+        order[num_order].i = i;
+        num_order++;
+    }
+    qsort(order, num_order, sizeof(insert_mult_order_t), insert_mult_order_cmp);
+
+    /* one acquisition per stripe the batch touches, never two stripes at once */
+    for (i = 0; i < num_order; i = j) {
+        unsigned long h = new_slots[order[i].i]->key.h;
+        unsigned long s = h & (unsigned long) (cache->num_stripes - 1);
+
+        j = i;
+        CACHE_STRIPE_LOCK(cache, h);
+        while (j < num_order && (new_slots[order[j].i]->key.h & (unsigned long) (cache->num_stripes - 1)) == s) {
+            rval[order[j].i] = _apc_cache_user_insert(cache, new_slots[order[j].i], t, exclusive TSRMLS_CC);
+            j++;
+        }
+        CACHE_STRIPE_UNLOCK(cache, h);
+    }
+
+    efree(order);
+    efree(new_slots);
+    return rval;
+}
+/* }}} */
+
+/* {{{ find_file_slot */
+static slot_t** find_file_slot(apc_cache_t* cache, apc_cache_key_t* key, unsigned long h)
+{
+    /* caller holds the stripe of h; during a rehash the key may still live in old_slots */
+    slot_t** slot = cache->header->old_slots ? &cache->header->old_slots[OLD_SLOT_INDEX(cache, h)] : NULL;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            slot = &cache->header->slots[SLOT_INDEX(cache, h)];
+        }
+        for (; slot && *slot; slot = &(*slot)->next) {
+            if (key->type != (*slot)->key.type) {
+                continue;
+            }
+            if (key->type == APC_CACHE_KEY_FILE) {
+                if (key->h == (*slot)->key.h && key_equals((*slot)->key.data.file, key->data.file)) {
+                    return slot;
+                }
+            } else if (((*slot)->key.h == key->h) &&
+                !memcmp((*slot)->key.data.fpfile.fullpath, key->data.fpfile.fullpath, key->data.fpfile.fullpath_len+1)) {
+                return slot;
+            }
+        }
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ find_user_slot */
+static slot_t** find_user_slot(apc_cache_t* cache, const char *strkey, int keylen, unsigned long h)
+{
+    /* caller holds the stripe of h; during a rehash the key may still live in old_slots */
+    slot_t** slot = cache->header->old_slots ? &cache->header->old_slots[OLD_SLOT_INDEX(cache, h)] : NULL;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            slot = &cache->header->slots[SLOT_INDEX(cache, h)];
+        }
+        for (; slot && *slot; slot = &(*slot)->next) {
+            if ((h == (*slot)->key.h) &&
+                !memcmp((*slot)->key.data.user.identifier, strkey, keylen)) {
+                return slot;
+            }
+        }
+    }
+    return NULL;
 }
 /* }}} */
 
+/* {{{ lookup_user_slot */
+static slot_t* lookup_user_slot(apc_cache_t* cache, const char *strkey, int keylen, unsigned long h)
+{
+    slot_t** slot;
+
+    /* caller holds the stripe of h */
+    if (cache->header->index && !cache->stripes[h & (cache->num_stripes - 1)].index_full) {
+        return index_find(cache, strkey, keylen, h);
+    }
+    slot = find_user_slot(cache, strkey, keylen, h);
+    return slot ? *slot : NULL;
+}
+/* }}} */
+
+/* {{{ slot_link */
+static slot_t** slot_link(apc_cache_t* cache, slot_t* p)
+{
+    /* returns the chain pointer to p, which remove_slot needs to unlink it */
+    slot_t** slot;
+
+    if (cache->header->old_slots) {
+        for (slot = &cache->header->old_slots[OLD_SLOT_INDEX(cache, p->key.h)]; *slot; slot = &(*slot)->next) {
+            if (*slot == p) {
+                return slot;
+            }
+        }
+    }
+    for (slot = &cache->header->slots[SLOT_INDEX(cache, p->key.h)]; *slot; slot = &(*slot)->next) {
+        if (*slot == p) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+/* }}} */
+
+#if CACHE_LOCKLESS_READS
+/* {{{ slot_matches */
+static inline int slot_matches(slot_t* p, apc_cache_key_t* key, unsigned long h)
+{
+    /* the tests of find_user_slot and find_file_slot */
+    if (key->type == APC_CACHE_KEY_USER) {
+        return p->key.h == h && !memcmp(p->key.data.user.identifier, key->data.user.identifier, key->data.user.identifier_len);
+    }
+    if (key->type != p->key.type) {
+        return 0;
+    }
+    if (key->type == APC_CACHE_KEY_FILE) {
+        return p->key.h == key->h && key_equals(p->key.data.file, key->data.file);
+    }
+    return p->key.h == key->h && !memcmp(p->key.data.fpfile.fullpath, key->data.fpfile.fullpath, key->data.fpfile.fullpath_len+1);
+}
+/* }}} */
+
+/* {{{ lockless_chain */
+static slot_t* lockless_chain(slot_t** table, int num_slots, apc_cache_key_t* key, unsigned long h, int* hops)
+{
+    slot_t* p;
+
+    for (p = table[h & (unsigned long)(num_slots - 1)]; p; p = p->next) {
+        if (++(*hops) > LOCKLESS_MAX_HOPS) {
+            return NULL;
+        }
+        if (slot_matches(p, key, h)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ lockless_find */
+static int lockless_find(apc_cache_t* cache, apc_cache_key_t* key, unsigned long h, slot_t** found)
+{
+    /* the caller has pinned an epoch. Returns 1 and sets *found, NULL for a
+     * miss, when no writer touched the stripe meanwhile and 0 otherwise */
+    cache_header_t* header = cache->header;
+    cache_stripe_t* stripe = &CACHE_STRIPE_AT(cache, h);
+    unsigned int seq = stripe->seq;
+    slot_t* p = NULL;
+    slot_t** table;
+    int hops = 0;
+    int n;
+
+    if (seq & 1) {
+        return 0;
+    }
+    MEMORY_BARRIER();
+
+    if (key->type == APC_CACHE_KEY_USER && !stripe->index_full) {
+        cache_index_group_t* index;
+
+        n = header->index_groups;
+        MEMORY_BARRIER();
+        index = header->index;
+        if (n && index) {
+            p = index_probe(index, n, cache->num_stripes, key->data.user.identifier, key->data.user.identifier_len, h);
+            goto validate;
+        }
+    }
+
+    n = header->old_num_slots;
+    MEMORY_BARRIER();
+    table = header->old_slots;
+    if (n && table) {
+        p = lockless_chain(table, n, key, h, &hops);
+    }
+    if (!p) {
+        n = header->num_slots;
+        MEMORY_BARRIER();
+        table = header->slots;
+        p = lockless_chain(table, n, key, h, &hops);
+    }
+
+validate:
+    MEMORY_BARRIER();
+    if (hops > LOCKLESS_MAX_HOPS || stripe->seq != seq) {
+        return 0;
+    }
+    *found = p;
+    return 1;
+}
+/* }}} */
+#endif
+
 /* {{{ apc_cache_find_slot */
 slot_t* apc_cache_find_slot(apc_cache_t* cache, apc_cache_key_t key, time_t t TSRMLS_DC)
 {
     slot_t** slot;
     volatile slot_t* retval = NULL;
+    unsigned long h;
 
-    CACHE_RDLOCK(cache);
-    if(key.type == APC_CACHE_KEY_FILE) slot = &cache->slots[hash(key) % cache->num_slots];
-    else slot = &cache->slots[key.h % cache->num_slots];
+    h = key.h;
 
-    while (*slot) {
-      if(key.type == (*slot)->key.type) {
-        if(key.type == APC_CACHE_KEY_FILE) {
-            if(key_equals((*slot)->key.data.file, key.data.file)) {
-                if((*slot)->key.mtime != key.mtime) {
-                    #if (USE_READ_LOCKS == 0)
-                    /* this is merely a memory-friendly optimization, if we do have a write-lock
-                     * might as well move this to the deleted_list right-away. Otherwise an insert
-                     * of the same key wil do it (or an expunge, *eventually*).
-                     */
-                    remove_slot(cache, slot TSRMLS_CC);
-                    #endif
-                    CACHE_SAFE_INC(cache, cache->header->num_misses);
-                    CACHE_RDUNLOCK(cache);
-                    return NULL;
-                }
-                CACHE_SAFE_INC(cache, (*slot)->num_hits);
-                CACHE_SAFE_INC(cache, (*slot)->value->ref_count);
-                (*slot)->access_time = t;
-                prevent_garbage_collection((*slot)->value);
-                CACHE_FAST_INC(cache, cache->header->num_hits); 
-                retval = *slot;
-                CACHE_RDUNLOCK(cache);
-                return (slot_t*)retval;
+#if CACHE_LOCKLESS_READS
+    {
+        slot_t* p = NULL;
+        int tries;
+
+        apc_epoch_enter(TSRMLS_C);
+        for (tries = 0; tries < LOCKLESS_TRIES; tries++) {
+            if (lockless_find(cache, &key, h, &p)) {
+                break;
             }
-        } else {  /* APC_CACHE_KEY_FPFILE */
-            if(((*slot)->key.h == key.h) &&
-                !memcmp((*slot)->key.data.fpfile.fullpath, key.data.fpfile.fullpath, key.data.fpfile.fullpath_len+1)) {
-                /* TTL Check ? */
-                CACHE_SAFE_INC(cache, (*slot)->num_hits);
-                CACHE_SAFE_INC(cache, (*slot)->value->ref_count);
-                (*slot)->access_time = t;
-                prevent_garbage_collection((*slot)->value);
-                CACHE_FAST_INC(cache, cache->header->num_hits);
-                retval = *slot;
-                CACHE_RDUNLOCK(cache);
-                return (slot_t*)retval;
+        }
+        /* stale entries are left to the locked path, which removes them */
+        if (tries < LOCKLESS_TRIES && !(p && key.type == APC_CACHE_KEY_FILE && p->key.mtime != key.mtime)) {
+            if (p) {
+                /* taken while pinned, so the slot is still queued at worst */
+                CACHE_SAFE_INC(cache, p->value->ref_count);
+                SLOT_HIT(cache, p, t);
+                prevent_garbage_collection(p->value);
+                CACHE_STAT_INC(cache, num_hits);
+            } else {
+                CACHE_STAT_INC(cache, num_misses);
             }
+            apc_epoch_leave(TSRMLS_C);
+            return p;
         }
-      }
-      slot = &(*slot)->next;
+        apc_epoch_leave(TSRMLS_C);
     }
-    CACHE_FAST_INC(cache, cache->header->num_misses); 
-    CACHE_RDUNLOCK(cache);
+#endif
+
+    CACHE_STRIPE_RDLOCK(cache, h);
+
+    slot = find_file_slot(cache, &key, h);
+    if (slot) {
+        if(key.type == APC_CACHE_KEY_FILE && (*slot)->key.mtime != key.mtime) {
+            #if (USE_READ_LOCKS == 0)
+            /* this is merely a memory-friendly optimization, if we do have a write-lock
+             * might as well move this to the deleted_list right-away. Otherwise an insert
+             * of the same key wil do it (or an expunge, *eventually*).
+             */
+            remove_slot(cache, slot TSRMLS_CC);
+            #endif
+            CACHE_STAT_INC(cache, num_misses);
+            CACHE_STRIPE_RDUNLOCK(cache, h);
+            return NULL;
+        }
+        CACHE_SAFE_INC(cache, (*slot)->value->ref_count);
+        SLOT_HIT(cache, *slot, t);
+        prevent_garbage_collection((*slot)->value);
+        CACHE_STAT_INC(cache, num_hits); 
+        retval = *slot;
+        CACHE_STRIPE_RDUNLOCK(cache, h);
+        return (slot_t*)retval;
+    }
+    CACHE_STAT_INC(cache, num_misses); 
+    CACHE_STRIPE_RDUNLOCK(cache, h);
     return NULL;
 }
 /* }}} */
@@ -702,94 +2388,245 @@ apc_cache_entry_t* apc_cache_find(apc_cache_t* cache, apc_cache_key_t key, time_
 /* }}} */
 
 /* {{{ apc_cache_user_find */
-apc_cache_entry_t* apc_cache_user_find(apc_cache_t* cache, char *strkey, int keylen, time_t t TSRMLS_DC)
+apc_cache_entry_t* apc_cache_user_find(apc_cache_t* cache, char *strkey, int keylen, time_t t, zend_bool* stale TSRMLS_DC)
 {
-    slot_t** slot;
+    slot_t* slot;
     volatile apc_cache_entry_t* value = NULL;
     unsigned long h;
 
-    if(apc_cache_busy(cache))
-    {
-        /* cache cleanup in progress */ 
-        return NULL;
-    }
+    h = string_hash(strkey, keylen);
 
-    CACHE_RDLOCK(cache);
+    /* keeps the entry from being freed until apc_cache_release */
+    apc_epoch_enter(TSRMLS_C);
 
-    h = string_nhash_8(strkey, keylen);
+#if CACHE_LOCKLESS_READS
+    {
+        apc_cache_key_t key;
+        int tries;
 
-    slot = &cache->slots[h % cache->num_slots];
+        key.data.user.identifier = strkey;
+        key.data.user.identifier_len = keylen;
+        key.h = h;
+        key.type = APC_CACHE_KEY_USER;
 
-    while (*slot) {
-        if ((h == (*slot)->key.h) &&
-            !memcmp((*slot)->key.data.user.identifier, strkey, keylen)) {
-            /* Check to make sure this entry isn't expired by a hard TTL */
-            if((*slot)->value->data.user.ttl && (time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) < t) {
-                #if (USE_READ_LOCKS == 0) 
-                /* this is merely a memory-friendly optimization, if we do have a write-lock
-                 * might as well move this to the deleted_list right-away. Otherwise an insert
-                 * of the same key wil do it (or an expunge, *eventually*).
-                 */
-                remove_slot(cache, slot TSRMLS_CC);
-                #endif
-                CACHE_FAST_INC(cache, cache->header->num_misses);
-                CACHE_RDUNLOCK(cache);
-                return NULL;
+        slot = NULL;
+        for (tries = 0; tries < LOCKLESS_TRIES; tries++) {
+            if (lockless_find(cache, &key, h, &slot)) {
+                break;
+            }
+        }
+        /* expired entries are left to the locked path, which removes them */
+        if (tries < LOCKLESS_TRIES && !(slot && USER_SLOT_EXPIRED(slot, t) && (!stale || USER_SLOT_DEAD(slot, t)))) {
+            if (slot) {
+                if (stale) {
+                    *stale = USER_SLOT_EXPIRED(slot, t);
+                }
+                SLOT_HIT(cache, slot, t);
+                CACHE_STAT_INC(cache, num_hits);
+                return slot->value;
             }
-            /* Otherwise we are fine, increase counters and return the cache entry */
-            CACHE_SAFE_INC(cache, (*slot)->num_hits);
-            CACHE_SAFE_INC(cache, (*slot)->value->ref_count);
-            (*slot)->access_time = t;
+            CACHE_STAT_INC(cache, num_misses);
+            apc_epoch_leave(TSRMLS_C);
+            return NULL;
+        }
+    }
+#endif
 
-            CACHE_FAST_INC(cache, cache->header->num_hits);
-            value = (*slot)->value;
-            CACHE_RDUNLOCK(cache);
-            return (apc_cache_entry_t*)value;
+    CACHE_STRIPE_RDLOCK(cache, h);
+
+    slot = lookup_user_slot(cache, strkey, keylen, h);
+    if (slot) {
+        /* Check to make sure this entry isn't expired by a hard TTL */
+        if(USER_SLOT_EXPIRED(slot, t) && (!stale || USER_SLOT_DEAD(slot, t))) {
+            #if (USE_READ_LOCKS == 0) 
+            /* this is merely a memory-friendly optimization, if we do have a write-lock
+             * might as well move this to the deleted_list right-away. Otherwise an insert
+             * of the same key wil do it (or an expunge, *eventually*).
+             * Within its grace period the entry is kept for callers taking stale values.
+             */
+            if (USER_SLOT_DEAD(slot, t)) {
+                slot_t** link = slot_link(cache, slot);
+                if (link) {
+                    remove_slot(cache, link TSRMLS_CC);
+                }
+            }
+            #endif
+            CACHE_STAT_INC(cache, num_misses);
+            CACHE_STRIPE_RDUNLOCK(cache, h);
+            apc_epoch_leave(TSRMLS_C);
+            return NULL;
         }
-        slot = &(*slot)->next;
+        if (stale) {
+            *stale = USER_SLOT_EXPIRED(slot, t);
+        }
+        /* Otherwise we are fine, increase counters and return the cache entry */
+        SLOT_HIT(cache, slot, t);
+
+        CACHE_STAT_INC(cache, num_hits);
+        value = slot->value;
+        CACHE_STRIPE_RDUNLOCK(cache, h);
+        return (apc_cache_entry_t*)value;
     }
  
-    CACHE_FAST_INC(cache, cache->header->num_misses);
-    CACHE_RDUNLOCK(cache);
+    CACHE_STAT_INC(cache, num_misses);
+    CACHE_STRIPE_RDUNLOCK(cache, h);
+    apc_epoch_leave(TSRMLS_C);
     return NULL;
 }
 /* }}} */
 
-/* {{{ apc_cache_user_exists */
-apc_cache_entry_t* apc_cache_user_exists(apc_cache_t* cache, char *strkey, int keylen, time_t t TSRMLS_DC)
+/* {{{ find_mult_order */
+typedef struct find_mult_order_t {
+    unsigned long order;        /* stripe, then bucket */
+    apc_cache_user_req_t* req;
+} find_mult_order_t;
+
+static int find_mult_order_cmp(const void* a, const void* b)
 {
-    slot_t** slot;
-    volatile apc_cache_entry_t* value = NULL;
-    unsigned long h;
+    unsigned long x = ((const find_mult_order_t*) a)->order;
+    unsigned long y = ((const find_mult_order_t*) b)->order;
 
-    if(apc_cache_busy(cache))
-    {
-        /* cache cleanup in progress */ 
-        return NULL;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+/* }}} */
+
+/* {{{ find_mult_hit */
+static int find_mult_hit(apc_cache_t* cache, apc_cache_user_req_t* req, slot_t* slot, time_t t, int flags TSRMLS_DC)
+{
+    /* the caller has pinned an epoch for the batch, a hit adds a pin of its own */
+    if (!slot || (USER_SLOT_EXPIRED(slot, t) && (!(flags & APC_FIND_STALE) || USER_SLOT_DEAD(slot, t)))) {
+        return 0;
+    }
+    if (!(flags & APC_FIND_PEEK)) {
+        SLOT_HIT(cache, slot, t);
     }
+    req->stale = USER_SLOT_EXPIRED(slot, t);
+    req->entry = slot->value;
+    apc_epoch_enter(TSRMLS_C);
+    return 1;
+}
+/* }}} */
 
-    CACHE_RDLOCK(cache);
+/* {{{ apc_cache_user_find_mult */
+int apc_cache_user_find_mult(apc_cache_t* cache, apc_cache_user_req_t* reqs, int num_reqs, time_t t, int flags TSRMLS_DC)
+{
+    find_mult_order_t* order;
+    unsigned long num_slots = (unsigned long) cache->header->num_slots;
+    int found = 0;
+    int i, j;
+
+    if (num_reqs <= 0) {
+        return 0;
+    }
+
+    order = (find_mult_order_t*) emalloc(sizeof(find_mult_order_t) * num_reqs);
+    for (i = 0; i < num_reqs; i++) {
+        apc_cache_user_req_t* req = &reqs[i];
 
-    h = string_nhash_8(strkey, keylen);
+        req->h = string_hash(req->strkey, req->keylen);
+        req->entry = NULL;
+        req->stale = 0;
+        order[i].order = (req->h & (unsigned long) (cache->num_stripes - 1)) * num_slots + (req->h & (num_slots - 1));
+        order[i].req = req;
+    }
+    qsort(order, num_reqs, sizeof(find_mult_order_t), find_mult_order_cmp);
 
-    slot = &cache->slots[h % cache->num_slots];
+    /* keeps whatever the walks reach alive until each hit is pinned */
+    apc_epoch_enter(TSRMLS_C);
 
-    while (*slot) {
-        if ((h == (*slot)->key.h) &&
-            !memcmp((*slot)->key.data.user.identifier, strkey, keylen)) {
-            /* Check to make sure this entry isn't expired by a hard TTL */
-            if((*slot)->value->data.user.ttl && (time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) < t) {
-                CACHE_UNLOCK(cache);
-                return NULL;
+    for (i = 0; i < num_reqs; i = j) {
+        unsigned long h = order[i].req->h;
+        unsigned long s = h & (unsigned long) (cache->num_stripes - 1);
+        int locked = 0;
+
+        /* order[i..j) share a stripe */
+        j = i + 1;
+        while (j < num_reqs && (order[j].req->h & (unsigned long) (cache->num_stripes - 1)) == s) {
+            j++;
+        }
+
+#if CACHE_LOCKLESS_READS
+        {
+            int k;
+
+            for (k = i; k < j; k++) {
+                apc_cache_user_req_t* req = order[k].req;
+                apc_cache_key_t key;
+                slot_t* slot = NULL;
+                int tries;
+
+                key.data.user.identifier = req->strkey;
+                key.data.user.identifier_len = req->keylen;
+                key.h = req->h;
+                key.type = APC_CACHE_KEY_USER;
+
+                for (tries = 0; tries < LOCKLESS_TRIES; tries++) {
+                    if (lockless_find(cache, &key, req->h, &slot)) {
+                        break;
+                    }
+                }
+                if (tries == LOCKLESS_TRIES) {
+                    /* a writer kept getting in the way, the rest go under the lock */
+                    break;
+                }
+                found += find_mult_hit(cache, req, slot, t, flags TSRMLS_CC);
+                order[k].req = NULL;
             }
-            /* Return the cache entry ptr */
-            value = (*slot)->value;
-            CACHE_RDUNLOCK(cache);
-            return (apc_cache_entry_t*)value;
         }
-        slot = &(*slot)->next;
+#endif
+
+        for (; i < j; i++) {
+            apc_cache_user_req_t* req = order[i].req;
+
+            if (!req) {
+                continue;
+            }
+            if (!locked) {
+                CACHE_STRIPE_RDLOCK(cache, h);
+                locked = 1;
+            }
+            found += find_mult_hit(cache, req, lookup_user_slot(cache, req->strkey, req->keylen, req->h), t, flags TSRMLS_CC);
+        }
+        if (locked) {
+            CACHE_STRIPE_RDUNLOCK(cache, h);
+        }
     }
-    CACHE_RDUNLOCK(cache);
+
+    apc_epoch_leave(TSRMLS_C);
+    efree(order);
+
+    if (!(flags & APC_FIND_PEEK)) {
+        CACHE_STATS(cache)->num_hits += found;
+        CACHE_STATS(cache)->num_misses += num_reqs - found;
+    }
+    return found;
+}
+/* }}} */
+
+/* {{{ apc_cache_user_exists */
+apc_cache_entry_t* apc_cache_user_exists(apc_cache_t* cache, char *strkey, int keylen, time_t t TSRMLS_DC)
+{
+    slot_t* slot;
+    volatile apc_cache_entry_t* value = NULL;
+    unsigned long h;
+
+    h = string_hash(strkey, keylen);
+
+    CACHE_STRIPE_RDLOCK(cache, h);
+
+    slot = lookup_user_slot(cache, strkey, keylen, h);
+    if (slot) {
+        /* Check to make sure this entry isn't expired by a hard TTL */
+        if(USER_SLOT_EXPIRED(slot, t)) {
+            CACHE_STRIPE_RDUNLOCK(cache, h);
+            return NULL;
+        }
+        /* Return the cache entry ptr */
+        value = slot->value;
+        CACHE_STRIPE_RDUNLOCK(cache, h);
+        return (apc_cache_entry_t*)value;
+    }
+    CACHE_STRIPE_RDUNLOCK(cache, h);
     return NULL;
 }
 /* }}} */
@@ -797,51 +2634,117 @@ apc_cache_entry_t* apc_cache_user_exists(apc_cache_t* cache, char *strkey, int k
 /* {{{ apc_cache_user_update */
 int _apc_cache_user_update(apc_cache_t* cache, char *strkey, int keylen, apc_cache_updater_t updater, void* data TSRMLS_DC)
 {
-    slot_t** slot;
+    slot_t* slot;
     int retval;
     unsigned long h;
 
-    if(apc_cache_busy(cache))
-    {
-        /* cache cleanup in progress */ 
-        return 0;
+    h = string_hash(strkey, keylen);
+
+    CACHE_STRIPE_LOCK(cache, h);
+
+    rehash_key(cache, h);
+    slot = lookup_user_slot(cache, strkey, keylen, h);
+    if (slot && !APC_NS_STALE(slot->value)) {
+        switch(Z_TYPE_P(slot->value->data.user.val) & ~IS_CONSTANT_INDEX) {
+            case IS_ARRAY:
+            case IS_CONSTANT_ARRAY:
+            case IS_OBJECT:
+            {
+                if(APCG(serializer)) {
+                    retval = 0;
+                    break;
+                } else {
+                    /* fall through */
+                }
+            }
+            /* fall through */
+            default:
+            {
+                retval = updater(cache, slot->value, data);
+                slot->key.mtime = apc_time();
+            }
+            break;
+        }
+        CACHE_STRIPE_UNLOCK(cache, h);
+        return retval;
     }
+    CACHE_STRIPE_UNLOCK(cache, h);
+    return 0;
+}
+/* }}} */
 
-    CACHE_LOCK(cache);
+/* {{{ user_long_update */
+static int user_long_update(apc_cache_t* cache, char *strkey, int keylen, zend_bool cas, long a, long b, long* lval TSRMLS_DC)
+{
+    /* adds a to the long value of the key, or swaps it for b if it is a.
+     * Updates of the same value never get lost, but one racing a store or
+     * a delete of the key may land on the entry on its way out */
+    slot_t* slot = NULL;
+    unsigned long h;
+    int locked = 1;
+    int ret = 0;
 
-    h = string_nhash_8(strkey, keylen);
-    slot = &cache->slots[h % cache->num_slots];
+    h = string_hash(strkey, keylen);
 
-    while (*slot) {
-        if ((h == (*slot)->key.h) &&
-            !memcmp((*slot)->key.data.user.identifier, strkey, keylen)) {
-            switch(Z_TYPE_P((*slot)->value->data.user.val) & ~IS_CONSTANT_INDEX) {
-                case IS_ARRAY:
-                case IS_CONSTANT_ARRAY:
-                case IS_OBJECT:
-                {
-                    if(APCG(serializer)) {
-                        retval = 0;
-                        break;
-                    } else {
-                        /* fall through */
-                    }
-                }
-                /* fall through */
-                default:
-                {
-                    retval = updater(cache, (*slot)->value, data);
-                    (*slot)->key.mtime = apc_time();
-                }
+#if CACHE_LOCKLESS_READS
+    apc_epoch_enter(TSRMLS_C);
+    {
+        apc_cache_key_t key;
+        int tries;
+
+        key.data.user.identifier = strkey;
+        key.data.user.identifier_len = keylen;
+        key.h = h;
+        key.type = APC_CACHE_KEY_USER;
+
+        for (tries = 0; tries < LOCKLESS_TRIES; tries++) {
+            if (lockless_find(cache, &key, h, &slot)) {
+                locked = 0;
                 break;
             }
-            CACHE_UNLOCK(cache);
-            return retval;
         }
-        slot = &(*slot)->next;
     }
-    CACHE_UNLOCK(cache);
-    return 0;
+#endif
+
+    if (locked) {
+        CACHE_STRIPE_RDLOCK(cache, h);
+        slot = lookup_user_slot(cache, strkey, keylen, h);
+    }
+
+    /* the type of a stored value never changes, only a long's value does */
+    if (slot && Z_TYPE_P(slot->value->data.user.val) == IS_LONG && !APC_NS_STALE(slot->value)) {
+        if (cas) {
+            ret = CACHE_LONG_CAS(Z_LVAL_P(slot->value->data.user.val), a, b);
+        } else {
+            *lval = CACHE_LONG_ADD(Z_LVAL_P(slot->value->data.user.val), a);
+            ret = 1;
+        }
+        if (ret) {
+            slot->key.mtime = apc_time();
+        }
+    }
+
+    if (locked) {
+        CACHE_STRIPE_RDUNLOCK(cache, h);
+    }
+#if CACHE_LOCKLESS_READS
+    apc_epoch_leave(TSRMLS_C);
+#endif
+    return ret;
+}
+/* }}} */
+
+/* {{{ apc_cache_user_inc */
+int apc_cache_user_inc(apc_cache_t* cache, char *strkey, int keylen, long step, long* lval TSRMLS_DC)
+{
+    return user_long_update(cache, strkey, keylen, 0, step, 0, lval TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ apc_cache_user_cas */
+int apc_cache_user_cas(apc_cache_t* cache, char *strkey, int keylen, long old_val, long new_val TSRMLS_DC)
+{
+    return user_long_update(cache, strkey, keylen, 1, old_val, new_val, NULL TSRMLS_CC);
 }
 /* }}} */
 
@@ -851,23 +2754,19 @@ int apc_cache_user_delete(apc_cache_t* cache, char *strkey, int keylen TSRMLS_DC
     slot_t** slot;
     unsigned long h;
 
-    CACHE_LOCK(cache);
-
-    h = string_nhash_8(strkey, keylen);
+    h = string_hash(strkey, keylen);
 
-    slot = &cache->slots[h % cache->num_slots];
+    CACHE_STRIPE_LOCK(cache, h);
 
-    while (*slot) {
-        if ((h == (*slot)->key.h) && 
-            !memcmp((*slot)->key.data.user.identifier, strkey, keylen)) {
-            remove_slot(cache, slot TSRMLS_CC);
-            CACHE_UNLOCK(cache);
-            return 1;
-        }
-        slot = &(*slot)->next;
+    rehash_key(cache, h);
+    slot = find_user_slot(cache, strkey, keylen, h);
+    if (slot) {
+        remove_slot(cache, slot TSRMLS_CC);
+        CACHE_STRIPE_UNLOCK(cache, h);
+        return 1;
     }
 
-    CACHE_UNLOCK(cache);
+    CACHE_STRIPE_UNLOCK(cache, h);
     return 0;
 }
 /* }}} */
@@ -878,6 +2777,7 @@ int apc_cache_delete(apc_cache_t* cache, char *filename, int filename_len TSRMLS
     slot_t** slot;
     time_t t;
     apc_cache_key_t key;
+    unsigned long h;
 
     t = apc_time();
 
@@ -887,34 +2787,19 @@ int apc_cache_delete(apc_cache_t* cache, char *filename, int filename_len TSRMLS
         return -1;
     }
 
-    CACHE_LOCK(cache);
+    h = key.h;
 
-    if(key.type == APC_CACHE_KEY_FILE) slot = &cache->slots[hash(key) % cache->num_slots];
-    else slot = &cache->slots[key.h % cache->num_slots];
+    CACHE_STRIPE_LOCK(cache, h);
 
-    while(*slot) {
-      if(key.type == (*slot)->key.type) {
-        if(key.type == APC_CACHE_KEY_FILE) {
-            if(key_equals((*slot)->key.data.file, key.data.file)) {
-                remove_slot(cache, slot TSRMLS_CC);
-                CACHE_UNLOCK(cache);
-                return 1;
-            }
-        } else {   /* APC_CACHE_KEY_FPFILE */
-            if(((*slot)->key.h == key.h) &&
-                (!memcmp((*slot)->key.data.fpfile.fullpath, key.data.fpfile.fullpath, key.data.fpfile.fullpath_len+1))) {
-                remove_slot(cache, slot TSRMLS_CC);
-                CACHE_UNLOCK(cache);
-                return 1;
-            }
-        }
-      }
-      slot = &(*slot)->next;
+    rehash_key(cache, h);
+    slot = find_file_slot(cache, &key, h);
+    if (slot) {
+        remove_slot(cache, slot TSRMLS_CC);
+        CACHE_STRIPE_UNLOCK(cache, h);
+        return 1;
     }
-    
-    memset(&cache->header->lastkey, 0, sizeof(apc_keyid_t));
-    
-    CACHE_UNLOCK(cache);
+
+    CACHE_STRIPE_UNLOCK(cache, h);
     return 0;
 
 }
@@ -923,7 +2808,45 @@ int apc_cache_delete(apc_cache_t* cache, char *filename, int filename_len TSRMLS
 /* {{{ apc_cache_release */
 void apc_cache_release(apc_cache_t* cache, apc_cache_entry_t* entry TSRMLS_DC)
 {
-    CACHE_SAFE_DEC(cache, entry->ref_count);
+    if (entry->type == APC_CACHE_ENTRY_USER) {
+        apc_epoch_leave(TSRMLS_C);
+    } else {
+        CACHE_SAFE_DEC(cache, entry->ref_count);
+    }
+}
+/* }}} */
+
+/* {{{ apc_cache_hold */
+void apc_cache_hold(apc_cache_t* cache, apc_cache_entry_t* entry TSRMLS_DC)
+{
+    /* called with the entry pinned; a removed entry waits on the deleted
+     * list while its reference count is up, as executing files do */
+    if (!APCG(held_entries).nTableSize) {
+        zend_hash_init(&APCG(held_entries), 8, NULL, NULL, 0);
+    } else if (zend_hash_index_exists(&APCG(held_entries), (ulong) entry)) {
+        return;
+    }
+    CACHE_SAFE_INC(cache, entry->ref_count);
+    zend_hash_index_update(&APCG(held_entries), (ulong) entry, (void*) &entry, sizeof(apc_cache_entry_t*), NULL);
+}
+/* }}} */
+
+/* {{{ apc_cache_release_held */
+void apc_cache_release_held(apc_cache_t* cache TSRMLS_DC)
+{
+    HashPosition pos;
+    apc_cache_entry_t** entry;
+
+    if (!APCG(held_entries).nTableSize) {
+        return;
+    }
+    zend_hash_internal_pointer_reset_ex(&APCG(held_entries), &pos);
+    while (zend_hash_get_current_data_ex(&APCG(held_entries), (void**) &entry, &pos) == SUCCESS) {
+        CACHE_SAFE_DEC(cache, (*entry)->ref_count);
+        zend_hash_move_forward_ex(&APCG(held_entries), &pos);
+    }
+    zend_hash_destroy(&APCG(held_entries));
+    APCG(held_entries).nTableSize = 0;
 }
 /* }}} */
 
@@ -952,7 +2875,7 @@ int apc_cache_make_file_key(apc_cache_key_t* key,
         if(IS_ABSOLUTE_PATH(filename,len) || strstr(filename, "://")) {
             key->data.fpfile.fullpath = filename;
             key->data.fpfile.fullpath_len = len;
-            key->h = string_nhash_8((char *)key->data.fpfile.fullpath, key->data.fpfile.fullpath_len);
+            key->h = string_hash((char *)key->data.fpfile.fullpath, key->data.fpfile.fullpath_len);
             key->mtime = t;
             key->type = APC_CACHE_KEY_FPFILE;
             goto success;
@@ -972,7 +2895,7 @@ int apc_cache_make_file_key(apc_cache_key_t* key,
 
             key->data.fpfile.fullpath = APCG(canon_path);
             key->data.fpfile.fullpath_len = strlen(APCG(canon_path));
-            key->h = string_nhash_8((char *)key->data.fpfile.fullpath, key->data.fpfile.fullpath_len);
+            key->h = string_hash((char *)key->data.fpfile.fullpath, key->data.fpfile.fullpath_len);
             key->mtime = t;
             key->type = APC_CACHE_KEY_FPFILE;
             goto success;
@@ -1021,7 +2944,7 @@ int apc_cache_make_file_key(apc_cache_key_t* key,
 
     key->data.file.device = fileinfo->st_buf.sb.st_dev;
     key->data.file.inode  = fileinfo->st_buf.sb.st_ino;
-    key->h = (unsigned long) key->data.file.device + (unsigned long) key->data.file.inode;
+    key->h = hash(*key);
 
     /*
      * If working with content management systems that like to munge the mtime, 
@@ -1069,7 +2992,7 @@ int apc_cache_make_user_key(apc_cache_key_t* key, char* identifier, int identifi
 
     key->data.user.identifier = identifier;
     key->data.user.identifier_len = identifier_len;
-    key->h = string_nhash_8((char *)key->data.user.identifier, key->data.user.identifier_len);
+    key->h = string_hash((char *)key->data.user.identifier, key->data.user.identifier_len);
     key->mtime = t;
     key->type = APC_CACHE_KEY_USER;
     return 1;
@@ -1110,9 +3033,124 @@ apc_cache_entry_t* apc_cache_make_file_entry(const char* filename,
 }
 /* }}} */
 
+/* {{{ store_compressed */
+static zval* store_compressed(zval* dst, const zval* src, apc_context_t* ctxt TSRMLS_DC)
+{
+    /* a string, or the serialized form of anything else, of at least
+     * apc.compress_threshold bytes is stored compressed when that saves an
+     * eighth of it. ctxt->raw_len tells which way it went */
+    zval tmp;
+    char* payload;
+    char* buf = NULL;
+    size_t len, clen;
+
+    if (Z_TYPE_P(src) == IS_STRING) {
+        memcpy(&tmp, src, sizeof(zval));
+    } else {
+        /* serialize into request memory first, its length decides */
+        apc_context_t sctxt = *ctxt;
+
+        sctxt.pool = apc_pool_create(APC_UNPOOL, apc_php_malloc, apc_php_free, NULL, NULL TSRMLS_CC);
+        if (!sctxt.pool) {
+            return NULL;
+        }
+        apc_copy_zval(&tmp, src, &sctxt TSRMLS_CC);
+        apc_pool_destroy(sctxt.pool TSRMLS_CC);
+        ctxt->linked = 1;
+        if (Z_TYPE(tmp) == IS_NULL) {
+            /* the serializer failed */
+            if (!dst) {
+                CHECK(dst = (zval*) apc_pool_alloc(ctxt->pool, sizeof(zval)));
+            }
+            ZVAL_NULL(dst);
+            return dst;
+        }
+    }
+
+    payload = Z_STRVAL(tmp);
+    len = Z_STRLEN(tmp);
+    if (len >= (size_t) APCG(compress_threshold)) {
+        buf = emalloc(len + 1);
+        clen = apc_compress(payload, len, buf, len - len / 8);
+        if (clen) {
+            buf[clen] = '\0';
+            ctxt->raw_len = len;
+            payload = buf;
+            len = clen;
+        }
+    }
+
+    if (!dst) {
+        dst = (zval*) apc_pool_alloc(ctxt->pool, sizeof(zval));
+    }
+    if (dst) {
+        memcpy(dst, &tmp, sizeof(zval));
+        Z_SET_REFCOUNT_P(dst, 1);
+        Z_UNSET_ISREF_P(dst);
+        Z_STRLEN_P(dst) = len;
+        if (!(Z_STRVAL_P(dst) = apc_pmemcpy(payload, len + 1, ctxt->pool TSRMLS_CC))) {
+            dst = NULL;
+        }
+    }
+
+    if (buf) {
+        efree(buf);
+    }
+    if (Z_TYPE_P(src) != IS_STRING) {
+        efree(Z_STRVAL(tmp));
+    }
+    return dst;
+}
+/* }}} */
+
+/* {{{ fetch_compressed */
+static zval* fetch_compressed(zval* dst, const zval* src, apc_context_t* ctxt TSRMLS_DC)
+{
+    zval tmp;
+    char* buf;
+
+    if (!dst) {
+        CHECK(dst = (zval*) apc_pool_alloc(ctxt->pool, sizeof(zval)));
+    }
+
+    buf = emalloc(ctxt->raw_len + 1);
+    if (apc_decompress(Z_STRVAL_P(src), Z_STRLEN_P(src), buf, ctxt->raw_len) != ctxt->raw_len) {
+        apc_warning("Unable to decompress a user cache value." TSRMLS_CC);
+        efree(buf);
+        ZVAL_NULL(dst);
+        return dst;
+    }
+    buf[ctxt->raw_len] = '\0';
+
+    memcpy(&tmp, src, sizeof(zval));
+    Z_STRVAL(tmp) = buf;
+    Z_STRLEN(tmp) = ctxt->raw_len;
+
+    if (Z_TYPE_P(src) == IS_STRING) {
+        /* the buffer is the copy */
+        memcpy(dst, &tmp, sizeof(zval));
+        Z_SET_REFCOUNT_P(dst, 1);
+        Z_UNSET_ISREF_P(dst);
+        return dst;
+    }
+
+    dst = apc_copy_zval(dst, &tmp, ctxt TSRMLS_CC);
+    efree(buf);
+    return dst;
+}
+/* }}} */
+
 /* {{{ apc_cache_store_zval */
 zval* apc_cache_store_zval(zval* dst, const zval* src, apc_context_t* ctxt TSRMLS_DC)
 {
+    ctxt->raw_len = 0;
+
+    if (APCG(compress_threshold) > 0 && ctxt->copy == APC_COPY_IN_USER &&
+        ((Z_TYPE_P(src) == IS_STRING && Z_STRLEN_P(src) >= APCG(compress_threshold)) ||
+         Z_TYPE_P(src) == IS_OBJECT || (Z_TYPE_P(src) == IS_ARRAY && APCG(serializer)))) {
+        return store_compressed(dst, src, ctxt TSRMLS_CC);
+    }
+
     if (Z_TYPE_P(src) == IS_ARRAY) {
         /* Maintain a list of zvals we've copied to properly handle recursive structures */
         zend_hash_init(&APCG(copied_zvals), 0, NULL, NULL, 0);
@@ -1131,7 +3169,11 @@ zval* apc_cache_store_zval(zval* dst, const zval* src, apc_context_t* ctxt TSRML
 /* {{{ apc_cache_fetch_zval */
 zval* apc_cache_fetch_zval(zval* dst, const zval* src, apc_context_t* ctxt TSRMLS_DC)
 {
-    if (Z_TYPE_P(src) == IS_ARRAY) {
+    if (ctxt->raw_len) {
+        return fetch_compressed(dst, src, ctxt TSRMLS_CC);
+    }
+
+    if (Z_TYPE_P(src) == IS_ARRAY && !ctxt->tree) {
         /* Maintain a list of zvals we've copied to properly handle recursive structures */
         zend_hash_init(&APCG(copied_zvals), 0, NULL, NULL, 0);
         dst = apc_copy_zval(dst, src, ctxt TSRMLS_CC);
@@ -1147,7 +3189,7 @@ zval* apc_cache_fetch_zval(zval* dst, const zval* src, apc_context_t* ctxt TSRML
 /* }}} */
 
 /* {{{ apc_cache_make_user_entry */
-apc_cache_entry_t* apc_cache_make_user_entry(const char* info, int info_len, const zval* val, apc_context_t* ctxt, const unsigned int ttl TSRMLS_DC)
+apc_cache_entry_t* apc_cache_make_user_entry(const char* info, int info_len, const zval* val, apc_context_t* ctxt, const unsigned int ttl, const unsigned int grace TSRMLS_DC)
 {
     apc_cache_entry_t* entry;
     apc_pool* pool = ctxt->pool;
@@ -1160,12 +3202,18 @@ apc_cache_entry_t* apc_cache_make_user_entry(const char* info, int info_len, con
     if(!entry->data.user.info) {
         return NULL;
     }
+    ctxt->linked = 0;
     entry->data.user.val = apc_cache_store_zval(NULL, val, ctxt TSRMLS_CC);
     if(!entry->data.user.val) {
         return NULL;
     }
     INIT_PZVAL(entry->data.user.val);
     entry->data.user.ttl = ttl;
+    entry->data.user.grace = ttl ? grace : 0;
+    entry->data.user.tree = !ctxt->linked;
+    entry->data.user.raw_len = ctxt->raw_len;
+    entry->data.user.ns = apc_ns_lookup(info, info_len, &entry->data.user.ns_gen TSRMLS_CC);
+    entry->data.user.gen = 0;
     entry->type = APC_CACHE_ENTRY_USER;
     entry->ref_count = 0;
     entry->mem_size = 0;
@@ -1219,6 +3267,7 @@ static zval* apc_cache_link_info(apc_cache_t *cache, slot_t* p TSRMLS_DC)
     } else if(p->value->type == APC_CACHE_ENTRY_USER) {
         add_assoc_stringl(link, "info", p->value->data.user.info, p->value->data.user.info_len-1, 1);
         add_assoc_long(link, "ttl", (long)p->value->data.user.ttl);
+        add_assoc_long(link, "grace", (long)p->value->data.user.grace);
         add_assoc_string(link, "type", "user", 1);
     }
 
@@ -1229,6 +3278,7 @@ static zval* apc_cache_link_info(apc_cache_t *cache, slot_t* p TSRMLS_DC)
     add_assoc_long(link, "access_time", p->access_time);
     add_assoc_long(link, "ref_count", p->value->ref_count);
     add_assoc_long(link, "mem_size", p->value->mem_size);
+    add_assoc_long(link, "raw_size", p->value->mem_size + APC_ENTRY_SAVED(p->value));
 
     return link;
 }
@@ -1242,6 +3292,7 @@ zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_DC)
     zval *deleted_list = NULL;
     zval *slots = NULL;
     slot_t* p;
+    double num_hits = 0, num_misses = 0, num_inserts = 0;
     int i, j;
 
     if(!cache) return NULL;
@@ -1256,16 +3307,37 @@ zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_DC)
     }
 
     array_init(info);
-    add_assoc_long(info, "num_slots", cache->num_slots);
+    add_assoc_long(info, "num_slots", cache->header->num_slots);
+    add_assoc_long(info, "old_num_slots", cache->header->old_num_slots);
+    add_assoc_long(info, "num_stripes", cache->num_stripes);
+    if (cache->header->index_mode == APC_CACHE_INDEX_TAGGED) {
+        add_assoc_stringl(info, "index_type", "tagged", sizeof("tagged")-1, 1);
+    } else {
+        add_assoc_stringl(info, "index_type", "chained", sizeof("chained")-1, 1);
+    }
+    add_assoc_long(info, "index_size", cache->header->index_groups * APC_INDEX_GROUP_SIZE);
     add_assoc_long(info, "ttl", cache->ttl);
 
-    add_assoc_double(info, "num_hits", (double)cache->header->num_hits);
-    add_assoc_double(info, "num_misses", (double)cache->header->num_misses);
-    add_assoc_double(info, "num_inserts", (double)cache->header->num_inserts);
+    for (i = 0; i < APC_CACHE_STAT_SHARDS; i++) {
+        num_hits += cache->header->stats[i].num_hits;
+        num_misses += cache->header->stats[i].num_misses;
+        num_inserts += cache->header->stats[i].num_inserts;
+    }
+    add_assoc_double(info, "num_hits", num_hits);
+    add_assoc_double(info, "num_misses", num_misses);
+    add_assoc_double(info, "num_inserts", num_inserts);
     add_assoc_double(info, "expunges", (double)cache->header->expunges);
+    add_assoc_double(info, "evictions", (double)cache->header->evictions);
+    add_assoc_double(info, "relocations", (double)cache->header->relocations);
+    if (cache->eviction == APC_CACHE_EVICT_CLOCK) {
+        add_assoc_stringl(info, "eviction_policy", "clock", sizeof("clock")-1, 1);
+    } else {
+        add_assoc_stringl(info, "eviction_policy", "wipe", sizeof("wipe")-1, 1);
+    }
     
     add_assoc_long(info, "start_time", cache->header->start_time);
     add_assoc_double(info, "mem_size", (double)cache->header->mem_size);
+    add_assoc_double(info, "raw_mem_size", (double)(cache->header->mem_size + cache->header->saved_size));
     add_assoc_long(info, "num_entries", cache->header->num_entries);
 #ifdef MULTIPART_EVENT_FORMDATA
     add_assoc_long(info, "file_upload_progress", 1);
@@ -1287,8 +3359,8 @@ zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_DC)
         ALLOC_INIT_ZVAL(slots);
         array_init(slots);
 
-        for (i = 0; i < cache->num_slots; i++) {
-            p = cache->slots[i];
+        for (i = 0; i < cache->header->num_slots; i++) {
+            p = cache->header->slots[i];
             j = 0;
             for (; p != NULL; p = p->next) {
                 zval *link = apc_cache_link_info(cache, p TSRMLS_CC);
@@ -1300,6 +3372,14 @@ zval* apc_cache_info(apc_cache_t* cache, zend_bool limited TSRMLS_DC)
             }
         }
 
+        /* slots not yet moved over by a rehash in progress */
+        for (i = 0; i < cache->header->old_num_slots; i++) {
+            for (p = cache->header->old_slots[i]; p != NULL; p = p->next) {
+                zval *link = apc_cache_link_info(cache, p TSRMLS_CC);
+                add_next_index_zval(list, link);
+            }
+        }
+
         /* For each slot pending deletion */
         ALLOC_INIT_ZVAL(deleted_list);
         array_init(deleted_list);
@@ -1326,38 +3406,15 @@ void apc_cache_unlock(apc_cache_t* cache TSRMLS_DC)
 }
 /* }}} */
 
-/* {{{ apc_cache_busy */
-zend_bool apc_cache_busy(apc_cache_t* cache)
-{
-    return cache->header->busy;
-}
-/* }}} */
-
-/* {{{ apc_cache_is_last_key */
-zend_bool apc_cache_is_last_key(apc_cache_t* cache, apc_cache_key_t* key, time_t t TSRMLS_DC)
+/* {{{ apc_cache_is_leased */
+zend_bool apc_cache_is_leased(apc_cache_t* cache, apc_cache_key_t* key TSRMLS_DC)
 {
-    apc_keyid_t *lastkey = &cache->header->lastkey;
-    unsigned int keylen = key->data.user.identifier_len;
-#ifdef ZTS
-    THREAD_T tid = tsrm_thread_id();
-    #define FROM_DIFFERENT_THREAD(k) (memcmp(&((k)->tid), &tid, sizeof(THREAD_T))!=0)
-#else
-    pid_t pid = getpid();
-    #define FROM_DIFFERENT_THREAD(k) (pid != (k)->pid) 
-#endif
-
-
-    /* unlocked reads, but we're not shooting for 100% success with this */
-    if(lastkey->h == key->h && keylen == lastkey->keylen) {
-        if(lastkey->mtime == t && FROM_DIFFERENT_THREAD(lastkey)) {
-            /* potential cache slam */
-            if(APCG(slam_defense)) {
-                apc_debug("Potential cache slam averted for key '%s'" TSRMLS_CC, key->data.user.identifier);
-                return 1;
-            }
-        }
+    /* another process holds a lease on the key and is computing its value,
+     * a store racing it would only be overwritten */
+    if (APCG(slam_defense) && apc_lease_held(key->h TSRMLS_CC)) {
+        apc_debug("Potential cache slam averted for key '%s'" TSRMLS_CC, key->data.user.identifier);
+        return 1;
     }
-
     return 0;
 }
 /* }}} */
@@ -39,6 +39,7 @@
 #include "apc.h"
 #include "apc_compile.h"
 #include "apc_lock.h"
+#include "apc_epoch.h"
 #include "apc_pool.h"
 #include "apc_main.h"
 #include "TSRM.h"
@@ -50,6 +51,12 @@
 #define APC_CACHE_KEY_USER     2
 #define APC_CACHE_KEY_FPFILE   3
 
+#define APC_CACHE_INDEX_CHAINED 0   /* lookups walk the slot chains */
+#define APC_CACHE_INDEX_TAGGED  1   /* lookups probe the tag index first */
+
+#define APC_CACHE_EVICT_WIPE    0   /* a full cache is cleared */
+#define APC_CACHE_EVICT_CLOCK   1   /* a full cache evicts entries not hit recently */
+
 #ifdef PHP_WIN32
 typedef unsigned __int64 apc_ino_t;
 typedef unsigned __int64 apc_dev_t;
@@ -58,24 +65,77 @@ typedef ino_t apc_ino_t;
 typedef dev_t apc_dev_t;
 #endif
 
-/* {{{ cache locking macros */
-#define CACHE_LOCK(cache)        { LOCK(cache->header->lock);   cache->has_lock = 1; }
-#define CACHE_UNLOCK(cache)      { UNLOCK(cache->header->lock); cache->has_lock = 0; }
-#define CACHE_SAFE_LOCK(cache)   { if ((++cache->has_lock) == 1) LOCK(cache->header->lock); }
-#define CACHE_SAFE_UNLOCK(cache) { if ((--cache->has_lock) == 0) UNLOCK(cache->header->lock); }
+/* {{{ cache locking macros
+ * The slot table is split into cache->num_stripes lock stripes, slot i being
+ * guarded by stripe (i & (num_stripes - 1)). Both the stripe count and the
+ * table size are powers of two, so a key maps to the same stripe whatever the
+ * current table size is and the macros accept either a slot index or the key
+ * hash itself. Lookups, inserts and deletes only take
+ * the stripe of the key's bucket. CACHE_LOCK and friends take every stripe in
+ * ascending order and are reserved for whole-cache operations (clear, expunge,
+ * info, iterator totals). header->lock is the innermost lock; it only guards
+ * the deleted_list and the shared size/entry statistics. The tag index is
+ * partitioned the same way, each stripe owning an equal run of groups.
+ * Where atomics are available apc_cache_user_find and apc_cache_find_slot
+ * first try without any lock, validating against the stripe's seq counter
+ * and falling back to the stripe lock when a writer got in the way.
+ */
+#define CACHE_STRIPE_AT(cache, idx) (cache->stripes[(idx) & (cache->num_stripes - 1)])
+#define CACHE_STRIPE(cache, idx)     (CACHE_STRIPE_AT(cache, idx).lock)
+
+/* Every exclusive hold of a stripe is a write section of its seq counter: the
+ * counter is odd while the chains, the index part or the tables may be
+ * changing, so readers without the lock can tell their walk was disturbed. */
+#ifdef HAVE_ATOMIC_OPERATIONS
+#define CACHE_SEQ_BEGIN(stripe)  { (stripe).seq++; MEMORY_BARRIER(); }
+#define CACHE_SEQ_END(stripe)    { MEMORY_BARRIER(); (stripe).seq++; }
+#else
+#define CACHE_SEQ_BEGIN(stripe)
+#define CACHE_SEQ_END(stripe)
+#endif
+#define STRIPE_WRLOCK(stripe)    { LOCK((stripe).lock); CACHE_SEQ_BEGIN(stripe); }
+#define STRIPE_WRUNLOCK(stripe)  { CACHE_SEQ_END(stripe); UNLOCK((stripe).lock); }
+#define STRIPE_RDLOCK(stripe)    RDLOCK((stripe).lock)
+#define STRIPE_RDUNLOCK(stripe)  RDUNLOCK((stripe).lock)
+
+#define CACHE_ALL_STRIPES(cache, op) { int _s; for (_s = 0; _s < cache->num_stripes; _s++) op(cache->stripes[_s]); }
+#define CACHE_ALL_STRIPES_REV(cache, op) { int _s; for (_s = cache->num_stripes - 1; _s >= 0; _s--) op(cache->stripes[_s]); }
+
+#define CACHE_LOCK(cache)        { CACHE_ALL_STRIPES(cache, STRIPE_WRLOCK);       cache->has_lock = 1; }
+#define CACHE_UNLOCK(cache)      { CACHE_ALL_STRIPES_REV(cache, STRIPE_WRUNLOCK); cache->has_lock = 0; }
+#define CACHE_SAFE_LOCK(cache)   { if ((++cache->has_lock) == 1) CACHE_ALL_STRIPES(cache, STRIPE_WRLOCK); }
+#define CACHE_SAFE_UNLOCK(cache) { if ((--cache->has_lock) == 0) CACHE_ALL_STRIPES_REV(cache, STRIPE_WRUNLOCK); }
+
+#define CACHE_STRIPE_LOCK(cache, idx)   STRIPE_WRLOCK(CACHE_STRIPE_AT(cache, idx))
+#define CACHE_STRIPE_UNLOCK(cache, idx) STRIPE_WRUNLOCK(CACHE_STRIPE_AT(cache, idx))
+
+#define CACHE_GC_LOCK(cache)     LOCK(cache->header->lock)
+#define CACHE_GC_UNLOCK(cache)   UNLOCK(cache->header->lock)
 
 #if (RDLOCK_AVAILABLE == 1) && defined(HAVE_ATOMIC_OPERATIONS)
 #define USE_READ_LOCKS 1
-#define CACHE_RDLOCK(cache)        { RDLOCK(cache->header->lock);  cache->has_lock = 0; }
-#define CACHE_RDUNLOCK(cache)      { RDUNLOCK(cache->header->lock);  cache->has_lock = 0; }
+#define CACHE_RDLOCK(cache)        { CACHE_ALL_STRIPES(cache, STRIPE_RDLOCK);       cache->has_lock = 0; }
+#define CACHE_RDUNLOCK(cache)      { CACHE_ALL_STRIPES_REV(cache, STRIPE_RDUNLOCK); cache->has_lock = 0; }
+#define CACHE_STRIPE_RDLOCK(cache, idx)   STRIPE_RDLOCK(CACHE_STRIPE_AT(cache, idx))
+#define CACHE_STRIPE_RDUNLOCK(cache, idx) STRIPE_RDUNLOCK(CACHE_STRIPE_AT(cache, idx))
+#else
+#define USE_READ_LOCKS 0
+#define CACHE_RDLOCK(cache)        CACHE_LOCK(cache)
+#define CACHE_RDUNLOCK(cache)      CACHE_UNLOCK(cache)
+#define CACHE_STRIPE_RDLOCK(cache, idx)   CACHE_STRIPE_LOCK(cache, idx)
+#define CACHE_STRIPE_RDUNLOCK(cache, idx) CACHE_STRIPE_UNLOCK(cache, idx)
+#endif
+
+#ifdef HAVE_ATOMIC_OPERATIONS
+/* lockless readers bump counters shared across stripes (ref_count, num_hits) too */
 #define CACHE_SAFE_INC(cache, obj) { ATOMIC_INC(obj); }
 #define CACHE_SAFE_DEC(cache, obj) { ATOMIC_DEC(obj); }
+#define CACHE_SAFE_ADD(cache, obj, n) { ATOMIC_ADD(obj, n); }
 #else
-#define USE_READ_LOCKS 0
-#define CACHE_RDLOCK(cache)        { LOCK(cache->header->lock);  cache->has_lock = 1; }
-#define CACHE_RDUNLOCK(cache)      { UNLOCK(cache->header->lock);  cache->has_lock = 0; }
-#define CACHE_SAFE_INC(cache, obj) { CACHE_SAFE_LOCK(cache); obj++; CACHE_SAFE_UNLOCK(cache);}
-#define CACHE_SAFE_DEC(cache, obj) { CACHE_SAFE_LOCK(cache); obj--; CACHE_SAFE_UNLOCK(cache);}
+/* without atomics, counters shared across stripes (ref_count) go through the gc lock */
+#define CACHE_SAFE_INC(cache, obj) { CACHE_GC_LOCK(cache); obj++; CACHE_GC_UNLOCK(cache); }
+#define CACHE_SAFE_DEC(cache, obj) { CACHE_GC_LOCK(cache); obj--; CACHE_GC_UNLOCK(cache); }
+#define CACHE_SAFE_ADD(cache, obj, n) { CACHE_GC_LOCK(cache); obj += (n); CACHE_GC_UNLOCK(cache); }
 #endif
 
 #define CACHE_FAST_INC(cache, obj) { obj++; }
@@ -109,20 +169,6 @@ struct apc_cache_key_t {
     unsigned char type;
     unsigned char md5[16];        /* md5 hash of the source file */
 };
-
-
-typedef struct apc_keyid_t apc_keyid_t;
-
-struct apc_keyid_t {
-    unsigned int h;
-    unsigned int keylen;
-    time_t mtime;
-#ifdef ZTS
-    THREAD_T tid;
-#else
-    pid_t pid;
-#endif
-};
 /* }}} */
 
 /* {{{ struct definition: apc_cache_entry_t */
@@ -140,6 +186,12 @@ typedef union _apc_cache_entry_value_t {
         int info_len;
         zval *val;
         unsigned int ttl;
+        unsigned int grace;     /* seconds past ttl the entry may still be fetched stale */
+        unsigned char tree;     /* val holds no objects and reaches no reference or array twice */
+        unsigned long gen;      /* stamped on insert, unique across the cache's lifetime */
+        size_t raw_len;         /* length of val's string or serialized form before compression, 0 if stored as is */
+        unsigned int ns;        /* namespace of the key, 0 for none (see apc_namespace.h) */
+        unsigned long ns_gen;   /* generation of the namespace the entry was stored under */
     } user;
 } apc_cache_entry_value_t;
 
@@ -147,12 +199,17 @@ typedef struct apc_cache_entry_t apc_cache_entry_t;
 struct apc_cache_entry_t {
     apc_cache_entry_value_t data;
     unsigned char type;
-    int ref_count;
+    int ref_count;              /* file entries only, user entries are protected by epochs */
     size_t mem_size;
     apc_pool *pool;
 };
 /* }}} */
 
+/* bytes compression saved on an entry, mem_size plus this is what it would take uncompressed */
+#define APC_ENTRY_SAVED(e) \
+    ((e)->type == APC_CACHE_ENTRY_USER && (e)->data.user.raw_len ? \
+        (e)->data.user.raw_len - Z_STRLEN_P((e)->data.user.val) : 0)
+
 /*
  * apc_cache_create creates the shared memory compiler cache. This function
  * should be called just once (ideally in the web server parent process, e.g.
@@ -166,12 +223,31 @@ struct apc_cache_entry_t {
  * gc_ttl is the maximum time a cache entry may speed on the garbage
  * collection list. This is basically a work around for the inherent
  * unreliability of our reference counting mechanism (see apc_cache_release).
+ * Epoch pins older than gc_ttl stop holding back reclamation as well.
  *
  * ttl is the maximum time a cache entry can idle in a slot in case the slot
  * is needed.  This helps in cleaning up the cache and ensuring that entries 
  * hit frequently stay cached and ones not hit very often eventually disappear.
+ *
+ * num_stripes is the number of locks the slot table is split into (rounded
+ * down to a power of two). Operations on a single key only take the lock of
+ * the stripe its slot falls into.
+ *
+ * The slot table starts at the next power of two above size_hint and doubles
+ * once the average chain length passes APC_CACHE_MAX_LOAD. Buckets are moved
+ * to the new table a few at a time by the writers of each stripe, so no single
+ * request pays for the whole rehash.
+ *
+ * index_mode selects how user keys are looked up. APC_CACHE_INDEX_TAGGED keeps
+ * an open-addressing index of 1-byte hash tags next to the chains, so a fetch
+ * usually touches a single tag group instead of every slot of a chain.
+ *
+ * eviction selects what happens once shared memory runs out and no entry has
+ * outlived ttl. APC_CACHE_EVICT_WIPE clears the whole cache,
+ * APC_CACHE_EVICT_CLOCK sweeps a clock hand over the slots, evicting entries
+ * which were not hit since its last pass until the allocation fits.
  */
-extern T apc_cache_create(int size_hint, int gc_ttl, int ttl TSRMLS_DC);
+extern T apc_cache_create(int size_hint, int gc_ttl, int ttl, int num_stripes, int index_mode, int eviction TSRMLS_DC);
 
 /*
  * apc_cache_destroy releases any OS resources associated with a cache object.
@@ -183,6 +259,8 @@ extern void apc_cache_destroy(T cache TSRMLS_DC);
 /*
  * apc_cache_clear empties a cache. This can safely be called at any time,
  * even while other server processes are executing cached source files.
+ * The cache lock is only held to swap in an empty slot table; the entries
+ * of the old one are queued for removal a bit at a time afterwards.
  */
 extern void apc_cache_clear(T cache TSRMLS_DC);
 
@@ -204,6 +282,16 @@ extern int apc_cache_insert(T cache, apc_cache_key_t key,
 extern int apc_cache_user_insert(T cache, apc_cache_key_t key,
                             apc_cache_entry_t* value, apc_context_t* ctxt, time_t t, int exclusive TSRMLS_DC);
 
+/*
+ * apc_cache_user_insert_mult inserts a batch of user entries, as
+ * apc_cache_user_insert would one by one, taking the lock of each stripe the
+ * batch touches once. It returns an emalloc'd array holding, for each entry,
+ * 1 if it was inserted, -1 if there was no memory left for it and 0 if it
+ * was refused. The caller frees the entries which were not inserted.
+ */
+extern int *apc_cache_user_insert_mult(T cache, apc_cache_key_t* keys,
+                            apc_cache_entry_t** values, time_t t, int exclusive, int num_entries TSRMLS_DC);
+
 extern int *apc_cache_insert_mult(apc_cache_t* cache, apc_cache_key_t* keys,
                             apc_cache_entry_t** values, apc_context_t *ctxt, time_t t, int num_entries TSRMLS_DC);
 
@@ -221,8 +309,35 @@ extern apc_cache_entry_t* apc_cache_find(T cache, apc_cache_key_t key, time_t t
  * apc_cache_user_find searches for a cache entry by its hashed identifier,
  * and returns a pointer to the entry if found, NULL otherwise.
  *
+ * If stale is not NULL, an entry past its ttl but still within its grace
+ * period is returned as well, with *stale set; it is a miss otherwise.
+ */
+extern apc_cache_entry_t* apc_cache_user_find(T cache, char* strkey, int keylen, time_t t, zend_bool* stale TSRMLS_DC);
+
+/* {{{ struct definition: apc_cache_user_req_t
+   One key of an apc_cache_user_find_mult batch and what was found for it */
+typedef struct apc_cache_user_req_t apc_cache_user_req_t;
+struct apc_cache_user_req_t {
+    char* strkey;
+    int keylen;                 /* including the terminating NUL */
+    unsigned long h;            /* set by apc_cache_user_find_mult */
+    apc_cache_entry_t* entry;   /* pinned entry found for the key, or NULL */
+    zend_bool stale;            /* entry is past its ttl, within its grace */
+};
+/* }}} */
+
+#define APC_FIND_STALE  0x1     /* hand out entries within their grace period */
+#define APC_FIND_PEEK   0x2     /* leave hit counts and access times alone */
+
+/*
+ * apc_cache_user_find_mult looks up a batch of keys at once and returns how
+ * many were found. The keys are hashed and ordered by stripe and bucket
+ * first, so each stripe is walked (or locked) once for all of its keys.
+ * Every entry found is pinned like one returned by apc_cache_user_find and
+ * must be given to apc_cache_release; the values can be copied out without
+ * any lock held meanwhile.
  */
-extern apc_cache_entry_t* apc_cache_user_find(T cache, char* strkey, int keylen, time_t t TSRMLS_DC);
+extern int apc_cache_user_find_mult(T cache, apc_cache_user_req_t* reqs, int num_reqs, time_t t, int flags TSRMLS_DC);
 
 /*
  * apc_cache_user_exists searches for a cache entry by its hashed identifier,
@@ -242,6 +357,10 @@ extern int apc_cache_user_delete(apc_cache_t* cache, char *strkey, int keylen TS
 /* apc_cach_fetch_zval takes a zval in the cache and reconstructs a runtime
  * zval from it.
  *
+ * An array stored with data.user.tree set may be fetched with ctxt->tree,
+ * which skips the bookkeeping that keeps references and cycles intact.
+ * Such a copy behaves as a value, so a request may also reuse it for as
+ * long as the key maps to the same entry and generation.
  */
 zval* apc_cache_fetch_zval(zval* dst, const zval* src, apc_context_t* ctxt TSRMLS_DC);
 
@@ -252,10 +371,23 @@ zval* apc_cache_fetch_zval(zval* dst, const zval* src, apc_context_t* ctxt TSRML
  * original value. Failing to do so will prevent the entry from being
  * garbage-collected.
  *
+ * User entries are not reference counted: apc_cache_user_find pins the
+ * reclamation epoch instead and apc_cache_release unpins it, so the entry
+ * must not be used after the release.
+ *
  * entry is the cache entry whose ref count you want to decrement.
  */
 extern void apc_cache_release(T cache, apc_cache_entry_t* entry TSRMLS_DC);
 
+/*
+ * apc_cache_hold keeps a user entry from being freed until the request ends,
+ * for values copied out of it which still point into it, on top of the pin
+ * apc_cache_release drops. apc_cache_release_held lets go of every entry
+ * held, once the request's variables are gone.
+ */
+extern void apc_cache_hold(T cache, apc_cache_entry_t* entry TSRMLS_DC);
+extern void apc_cache_release_held(T cache TSRMLS_DC);
+
 /*
  * apc_cache_make_file_key creates a key object given a relative or absolute
  * filename and an optional list of auxillary paths to search. include_path is
@@ -294,9 +426,10 @@ zend_bool apc_compile_cache_entry(apc_cache_key_t *key, zend_file_handle* h, int
 
 /*
  * apc_cache_make_user_entry creates an apc_cache_entry_t object given an info string
- * and the zval to be stored.
+ * and the zval to be stored. An entry with a ttl may be fetched stale for grace
+ * seconds past it.
  */
-extern apc_cache_entry_t* apc_cache_make_user_entry(const char* info, int info_len, const zval *val, apc_context_t* ctxt, const unsigned int ttl TSRMLS_DC);
+extern apc_cache_entry_t* apc_cache_make_user_entry(const char* info, int info_len, const zval *val, apc_context_t* ctxt, const unsigned int ttl, const unsigned int grace TSRMLS_DC);
 
 extern int apc_cache_make_user_key(apc_cache_key_t* key, char* identifier, int identifier_len, const time_t t);
 
@@ -309,7 +442,63 @@ struct slot_t {
     unsigned long num_hits;     /* number of hits to this bucket */
     time_t creation_time;       /* time slot was initialized */
     time_t deletion_time;       /* time slot was removed from cache */
+    unsigned long retire_epoch; /* epoch the slot was removed in */
     time_t access_time;         /* time slot was last accessed */
+    unsigned char referenced;   /* hit since the clock hand last passed */
+    unsigned char timer;        /* APC_SLOT_TIMER_*: the expiry list the slot is on */
+    time_t expires;             /* user entries: end of the hard ttl and grace, or of cache->ttl without one */
+    slot_t* timer_next;         /* next slot in the same wheel bucket or stale list */
+    slot_t** timer_pprev;       /* link pointing at this slot while it is on a list */
+};
+/* }}} */
+
+#define APC_SLOT_TIMER_NONE    0
+#define APC_SLOT_TIMER_WHEEL   1   /* waiting for its expiry on the timer wheel */
+#define APC_SLOT_TIMER_STALE   2   /* outlived cache->ttl, first to go when memory runs out */
+
+/* one second buckets for 256 seconds, then two levels of 64 coarser ones */
+#define APC_WHEEL_L0_BITS      8
+#define APC_WHEEL_LN_BITS      6
+#define APC_WHEEL_BUCKETS      ((1 << APC_WHEEL_L0_BITS) + 2 * (1 << APC_WHEEL_LN_BITS))
+
+/* {{{ struct definition: cache_stripe_t */
+typedef struct cache_stripe_t cache_stripe_t;
+struct cache_stripe_t {
+    apc_lck_t lock;             /* lock for the slots of this stripe */
+    int rehash_idx;             /* next old_slots bucket of this stripe to migrate */
+    int index_used;             /* live and deleted tags in this stripe's part of the index */
+    int index_full;             /* index part overflowed, lookups walk the chains until a rebuild */
+    volatile unsigned int seq;  /* odd while a writer holds the stripe */
+    time_t wheel_time;          /* the wheel's buckets before this second have been reaped */
+    int wheel_count;            /* slots on the wheel */
+    int stale_count;            /* slots on the stale list */
+    slot_t* stale;              /* entries which outlived cache->ttl */
+    slot_t* wheel[APC_WHEEL_BUCKETS]; /* timer wheel of the stripe's user entries */
+};
+/* }}} */
+
+/* {{{ struct definition: cache_index_group_t
+   A probe group of the tag index: one cache line of 1-byte hash tags followed
+   by the slot each tag points at. */
+#define APC_INDEX_GROUP_SIZE 64
+typedef struct cache_index_group_t cache_index_group_t;
+struct cache_index_group_t {
+    unsigned char tags[APC_INDEX_GROUP_SIZE];
+    slot_t* slots[APC_INDEX_GROUP_SIZE];
+};
+/* }}} */
+
+/* {{{ struct definition: cache_stats_t
+   Hit, miss and insert counters of the processes mapped to one shard. A shard
+   fills a cache line, so lookups in different processes don't write to the
+   same line, nor to the one holding the locks. */
+#define APC_CACHE_STAT_SHARDS 64
+typedef struct cache_stats_t cache_stats_t;
+struct cache_stats_t {
+    unsigned long num_hits;     /* successful lookups */
+    unsigned long num_misses;   /* unsuccessful lookups */
+    unsigned long num_inserts;  /* successful inserts */
+    char pad[64 - 3 * sizeof(unsigned long)];
 };
 /* }}} */
 
@@ -317,18 +506,40 @@ struct slot_t {
    Any values that must be shared among processes should go in here. */
 typedef struct cache_header_t cache_header_t;
 struct cache_header_t {
-    apc_lck_t lock;             /* read/write lock (exclusive blocking cache lock) */
+    apc_lck_t lock;             /* gc lock (deleted_list and shared statistics) */
     apc_lck_t wrlock;           /* write lock (non-blocking used to prevent cache slams) */
-    unsigned long num_hits;     /* total successful hits in cache */
-    unsigned long num_misses;   /* total unsuccessful hits in cache */
-    unsigned long num_inserts;  /* total successful inserts in cache */
+    cache_stats_t* stats;       /* APC_CACHE_STAT_SHARDS counter shards (64 byte aligned), summed by apc_cache_info */
     unsigned long expunges;     /* total number of expunges */
-    slot_t* deleted_list;       /* linked list of to-be-deleted slots */
+    unsigned long evictions;    /* total number of entries removed to make room */
+    unsigned long relocations;  /* total number of entries moved by compaction */
+    unsigned long clock_hand;   /* next bucket looked at by the clock eviction */
+    unsigned long generation;   /* last data.user.gen handed out, survives apc_clear_cache */
+    unsigned long ns_swept;     /* apc_ns->invalidations at the last sweep for invalidated entries */
+    slot_t* deleted_list;       /* queue of removed slots, oldest retire_epoch first */
+    slot_t* deleted_tail;       /* last slot of deleted_list */
+    unsigned long deleted_epoch; /* newest retire_epoch queued */
     time_t start_time;          /* time the above counters were reset */
-    zend_bool busy;             /* Flag to tell clients when we are busy cleaning the cache */
+    zend_bool busy;             /* set while an expunge holds the stripes, so an allocation of its own does not start another */
     int num_entries;            /* Statistic on the number of entries */
     size_t mem_size;            /* Statistic on the memory size used by this cache */
-    apc_keyid_t lastkey;        /* the key that is being inserted (user cache) */
+    size_t saved_size;          /* of which compression saved this much */
+    slot_t** slots;             /* slot table, num_slots is a power of two */
+    int num_slots;              /* number of slots in the table */
+    slot_t** old_slots;         /* previous slot table while a rehash is in progress */
+    int old_num_slots;          /* number of slots in old_slots */
+    int rehash_pending;         /* number of stripes with old_slots buckets left to migrate */
+    slot_t** drain_slots;       /* table dropped by a wipe, its slots not queued for removal yet */
+    int drain_num_slots;        /* number of slots in drain_slots */
+    int drain_idx;              /* next drain_slots bucket to queue */
+    unsigned int rehash_turn;   /* next stripe helped along by an insert */
+    unsigned int expire_turn;   /* next stripe reaped by apc_cache_expire */
+    unsigned long compact_hand; /* next bucket looked at by apc_cache_compact */
+    time_t compact_time;        /* second the last compaction step ran in */
+    int index_mode;             /* APC_CACHE_INDEX_CHAINED or APC_CACHE_INDEX_TAGGED */
+    cache_index_group_t* index; /* tag index (64 byte aligned), NULL when chained */
+    void* index_mem;            /* SMA block holding the index */
+    int index_groups;           /* number of groups in the index, a power of two */
+    int index_rebuild;          /* set when a stripe's part of the index overflowed */
 };
 /* }}} */
 
@@ -338,10 +549,11 @@ typedef void (*apc_expunge_cb_t)(T cache, size_t n TSRMLS_DC);
 struct apc_cache_t {
     void* shmaddr;                /* process (local) address of shared cache */
     cache_header_t* header;       /* cache header (stored in SHM) */
-    slot_t** slots;               /* array of cache slots (stored in SHM) */
-    int num_slots;                /* number of slots in cache */
+    cache_stripe_t* stripes;      /* array of slot stripes (stored in SHM) */
+    int num_stripes;              /* number of stripes, a power of two */
     int gc_ttl;                   /* maximum time on GC list for a slot */
     int ttl;                      /* if slot is needed and entry's access time is older than this ttl, remove it */
+    int eviction;                 /* APC_CACHE_EVICT_WIPE or APC_CACHE_EVICT_CLOCK */
     apc_expunge_cb_t expunge_cb;  /* cache specific expunge callback to free up sma memory */
     uint has_lock;                /* flag for possible recursive locks within the same process */
 };
@@ -349,10 +561,47 @@ struct apc_cache_t {
 
 extern zval* apc_cache_info(T cache, zend_bool limited TSRMLS_DC);
 extern void apc_cache_unlock(apc_cache_t* cache TSRMLS_DC);
-extern zend_bool apc_cache_busy(apc_cache_t* cache);
 extern zend_bool apc_cache_write_lock(apc_cache_t* cache TSRMLS_DC);
 extern void apc_cache_write_unlock(apc_cache_t* cache TSRMLS_DC);
-extern zend_bool apc_cache_is_last_key(apc_cache_t* cache, apc_cache_key_t* key, time_t t TSRMLS_DC);
+
+/*
+ * apc_cache_is_leased tells whether a store of key should be skipped as a
+ * potential cache slam: another process holds a lease on it (see apc_lease.h)
+ * and apc.slam_defense is on.
+ */
+extern zend_bool apc_cache_is_leased(apc_cache_t* cache, apc_cache_key_t* key TSRMLS_DC);
+
+/*
+ * apc_cache_expire removes a bounded number of user entries whose ttl ran
+ * out, found through the stripes' timer wheels, and of the entries a clear
+ * left behind. It is called at the end of every request so neither piles up
+ * until memory runs out.
+ */
+extern void apc_cache_expire(apc_cache_t* cache TSRMLS_DC);
+
+/*
+ * apc_cache_compact moves user entries which border on free shared memory
+ * into smaller holes elsewhere, so the holes they leave merge into larger
+ * ones. It runs for apc.compact_budget microseconds at most, picking up the
+ * walk of the slot table where the last call left it, once
+ * apc.compact_threshold percent of the free memory is outside the largest
+ * free block of each segment. At most one call per second does any work;
+ * it is made at the end of every request.
+ */
+extern void apc_cache_compact(apc_cache_t* cache TSRMLS_DC);
+
+/* moves every bucket left in old_slots to the current table, the caller must hold CACHE_LOCK */
+extern void apc_cache_finish_rehash(apc_cache_t* cache TSRMLS_DC);
+
+/*
+ * apc_cache_user_inc adds step to the long value of a user entry in place and
+ * sets *lval to the result. apc_cache_user_cas sets the value to new_val if
+ * it is old_val. Neither takes the stripe lock exclusively where there are
+ * atomics. They return 0 if the entry is missing, not a long or, for
+ * apc_cache_user_cas, does not hold old_val.
+ */
+extern int apc_cache_user_inc(T cache, char *strkey, int keylen, long step, long* lval TSRMLS_DC);
+extern int apc_cache_user_cas(T cache, char *strkey, int keylen, long old_val, long new_val TSRMLS_DC);
 
 /* used by apc_rfc1867 to update data in-place - not to be used elsewhere */
 
@@ -316,6 +316,10 @@ static APC_HOTSPOT zval* my_copy_zval(zval* dst, const zval* src, apc_context_t*
             if(Z_ISREF_P((zval*)src)) {
                 Z_SET_ISREF_PP(tmp);
             }
+            if(Z_ISREF_P((zval*)src) || Z_TYPE_P(src) == IS_ARRAY) {
+                /* shared scalars copy out alike as separate zvals, these may not */
+                ctxt->linked = 1;
+            }
             Z_ADDREF_PP(tmp);
             return *tmp;
         }
@@ -324,7 +328,7 @@ static APC_HOTSPOT zval* my_copy_zval(zval* dst, const zval* src, apc_context_t*
     }
 
 
-    if(ctxt->copy == APC_COPY_OUT_USER || ctxt->copy == APC_COPY_IN_USER) {
+    if(ctxt->copy == APC_COPY_OUT_USER || ctxt->copy == APC_COPY_IN_USER || ctxt->copy == APC_COPY_MOVE_USER) {
         /* deep copies are refcount(1), but moved up for recursive 
          * arrays,  which end up being add_ref'd during its copy. */
         Z_SET_REFCOUNT_P(dst, 1);
@@ -345,6 +349,15 @@ static APC_HOTSPOT zval* my_copy_zval(zval* dst, const zval* src, apc_context_t*
 
     case IS_CONSTANT:
     case IS_STRING:
+#if defined(ZEND_ENGINE_2_4) && !defined(ZTS)
+        if (ctxt->share_strings && (src->type & IS_CONSTANT_TYPE_MASK) == IS_STRING &&
+            src->value.str.len >= APCG(shared_strings) && IS_INTERNED(src->value.str.val)) {
+            /* the engine neither frees nor writes to an interned string, so
+             * the cached one is handed out as is while the caller holds the entry */
+            ctxt->shared = 1;
+            break;
+        }
+#endif
         if (src->value.str.val) {
             CHECK(dst->value.str.val = apc_string_pmemcpy(src->value.str.val,
                                                    src->value.str.len+1,
@@ -372,9 +385,16 @@ static APC_HOTSPOT zval* my_copy_zval(zval* dst, const zval* src, apc_context_t*
     
         dst->type = IS_NULL;
         if(ctxt->copy == APC_COPY_IN_USER) {
+            /* unserialized copies of one object are objects of their own,
+             * and a serialized array may hold some */
+            ctxt->linked = 1;
             dst = my_serialize_object(dst, src, ctxt TSRMLS_CC);
         } else if(ctxt->copy == APC_COPY_OUT_USER) {
             dst = my_unserialize_object(dst, src, ctxt TSRMLS_CC);
+        } else if(ctxt->copy == APC_COPY_MOVE_USER) {
+            /* the serialized form */
+            dst->type = src->type;
+            CHECK(dst->value.str.val = apc_pmemcpy(src->value.str.val, src->value.str.len + 1, pool TSRMLS_CC));
         }
         break;
 #ifdef ZEND_ENGINE_2_4
@@ -995,7 +1015,7 @@ static APC_HOTSPOT HashTable* my_copy_hashtable_ex(HashTable* dst,
 #ifdef ZEND_ENGINE_2_4
         if (!curr->nKeyLength) {
             CHECK((newp = (Bucket*) apc_pmemcpy(curr, sizeof(Bucket), pool TSRMLS_CC)));
-        } else if (IS_INTERNED(curr->arKey)) {
+        } else if (APC_IS_INTERNED(curr->arKey)) {
             CHECK((newp = (Bucket*) apc_pmemcpy(curr, sizeof(Bucket), pool TSRMLS_CC)));
 #ifndef ZTS
         } else if (pool->type != APC_UNPOOL) {
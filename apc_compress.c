@@ -0,0 +1,175 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+ */
+
+/* $Id$ */
+
+#include "apc_compress.h"
+
+#define LZF_HLOG        13                      /* log2 of the match finder's table size */
+#define LZF_HSIZE       (1 << LZF_HLOG)
+#define LZF_MAX_LIT     (1 << 5)                /* literals per run */
+#define LZF_MAX_OFF     (1 << 13)               /* distance of a match */
+#define LZF_MAX_REF     ((1 << 8) + (1 << 3))      /* length of a match */
+
+#define LZF_HASH(p)     ((((unsigned int) (p)[0] << 16 | (p)[1] << 8 | (p)[2]) * 2654435761U) >> (32 - LZF_HLOG))
+
+/* {{{ apc_compress */
+size_t apc_compress(const void* in, size_t in_len, void* out, size_t out_len)
+{
+    /* positions of the last three byte sequence seen per hash, a stale or
+     * colliding one merely fails the comparison */
+    unsigned int htab[LZF_HSIZE];
+    const unsigned char* ip = (const unsigned char*) in;
+    const unsigned char* in_end = ip + in_len;
+    unsigned char* op = (unsigned char*) out;
+    unsigned char* out_end = op + out_len;
+    int lit = 0;
+
+    if (!in_len || !out_len) {
+        return 0;
+    }
+    memset(htab, 0, sizeof(htab));
+
+    op++;   /* control byte of the first literal run */
+
+    while (ip < in_end) {
+        if (in_end - ip > 2) {
+            unsigned int h = LZF_HASH(ip) & (LZF_HSIZE - 1);
+            const unsigned char* ref = (const unsigned char*) in + htab[h];
+
+            htab[h] = (unsigned int) (ip - (const unsigned char*) in);
+
+            if (ref < ip && ip - ref <= LZF_MAX_OFF &&
+                ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+                size_t off = ip - ref - 1;
+                size_t max = in_end - ip;
+                size_t len = 3;
+
+                if (max > LZF_MAX_REF) {
+                    max = LZF_MAX_REF;
+                }
+                while (len < max && ref[len] == ip[len]) {
+                    len++;
+                }
+
+                /* close the literal run, or take back its unused control byte */
+                if (lit) {
+                    op[-lit - 1] = lit - 1;
+                } else {
+                    op--;
+                }
+                if (out_end - op < 4) {
+                    return 0;
+                }
+
+                len -= 2;
+                if (len < 7) {
+                    *op++ = (unsigned char) ((off >> 8) + (len << 5));
+                } else {
+                    *op++ = (unsigned char) ((off >> 8) + (7 << 5));
+                    *op++ = (unsigned char) (len - 7);
+                }
+                *op++ = (unsigned char) off;
+
+                ip += len + 2;
+                lit = 0;
+                op++;
+                continue;
+            }
+        }
+
+        if (op >= out_end) {
+            return 0;
+        }
+        *op++ = *ip++;
+        if (++lit == LZF_MAX_LIT) {
+            op[-lit - 1] = lit - 1;
+            lit = 0;
+            if (op >= out_end) {
+                return 0;
+            }
+            op++;
+        }
+    }
+
+    if (lit) {
+        op[-lit - 1] = lit - 1;
+    } else {
+        op--;
+    }
+    return op - (unsigned char*) out;
+}
+/* }}} */
+
+/* {{{ apc_decompress */
+size_t apc_decompress(const void* in, size_t in_len, void* out, size_t out_len)
+{
+    const unsigned char* ip = (const unsigned char*) in;
+    const unsigned char* in_end = ip + in_len;
+    unsigned char* op = (unsigned char*) out;
+    unsigned char* out_end = op + out_len;
+
+    while (ip < in_end) {
+        size_t ctrl = *ip++;
+
+        if (ctrl < LZF_MAX_LIT) {
+            ctrl++;
+            if ((size_t) (out_end - op) < ctrl || (size_t) (in_end - ip) < ctrl) {
+                return 0;
+            }
+            memcpy(op, ip, ctrl);
+            op += ctrl;
+            ip += ctrl;
+        } else {
+            size_t len = ctrl >> 5;
+            size_t off;
+            const unsigned char* ref;
+
+            if (len == 7) {
+                if (ip >= in_end) {
+                    return 0;
+                }
+                len += *ip++;
+            }
+            if (ip >= in_end) {
+                return 0;
+            }
+            off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+            len += 2;
+            if ((size_t) (out_end - op) < len || (size_t) (op - (unsigned char*) out) < off) {
+                return 0;
+            }
+            /* the match may overlap the bytes it produces */
+            ref = op - off;
+            while (len--) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op - (unsigned char*) out;
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -0,0 +1,53 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_COMPRESS_H
+#define APC_COMPRESS_H
+
+#include "apc.h"
+
+/*
+ * A small LZF codec for large user cache values.
+ *
+ * The stream is a sequence of runs. A control byte below 32 is followed by
+ * that many plus one literal bytes. Any other control byte copies earlier
+ * output: its top three bits hold the length less two (7 meaning a further
+ * byte adds to it), its low five bits and the byte after the length give
+ * the distance back less one, so matches reach 8k back and 264 bytes long.
+ * This is the format of liblzf, which favours speed over ratio.
+ */
+
+/* compresses in_len bytes into at most out_len bytes at out, returns the
+ * length written or 0 when the data does not fit */
+extern size_t apc_compress(const void* in, size_t in_len, void* out, size_t out_len);
+
+/* expands a stream made by apc_compress into at most out_len bytes at out,
+ * returns the length written or 0 for a stream which is corrupt or too long */
+extern size_t apc_decompress(const void* in, size_t in_len, void* out, size_t out_len);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -0,0 +1,371 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+ */
+
+/* $Id$ */
+
+#include "apc_epoch.h"
+#include "apc_sma.h"
+#include "apc_globals.h"
+
+#if !defined(ZTS) && !defined(PHP_WIN32)
+# include <signal.h>
+# include <errno.h>
+# ifdef HAVE_PTHREAD_ATFORK
+#  include <pthread.h>
+#  define EPOCH_CACHE_PID 1
+# endif
+#endif
+
+/* pins held this long get their owner checked for liveness */
+#define APC_EPOCH_CHECK_AFTER 10
+
+apc_epoch_t* apc_epoch = NULL;
+
+/* {{{ publishing a record
+ * The pin has to be visible before the cache is read and the unpin must not
+ * be visible before the reads are done. Without atomics the registry lock
+ * provides the barrier. */
+#ifdef HAVE_ATOMIC_OPERATIONS
+# define EPOCH_PIN(rec, e)   { (rec)->epoch = (e); MEMORY_BARRIER(); }
+# define EPOCH_UNPIN(rec)    { MEMORY_BARRIER(); (rec)->epoch = 0; }
+# define EPOCH_OVERFLOW(d)   { if (d > 0) ATOMIC_INC(apc_epoch->overflow); else ATOMIC_DEC(apc_epoch->overflow); }
+#else
+# define EPOCH_PIN(rec, e)   { LOCK(apc_epoch->lock); (rec)->epoch = (e); UNLOCK(apc_epoch->lock); }
+# define EPOCH_UNPIN(rec)    { LOCK(apc_epoch->lock); (rec)->epoch = 0; UNLOCK(apc_epoch->lock); }
+# define EPOCH_OVERFLOW(d)   { LOCK(apc_epoch->lock); apc_epoch->overflow += (d); UNLOCK(apc_epoch->lock); }
+#endif
+/* }}} */
+
+#ifdef EPOCH_CACHE_PID
+/* getpid() would be a system call on every pin, a fork resets the copy */
+static pid_t epoch_pid = 0;
+
+/* {{{ epoch_forked */
+static void epoch_forked(void)
+{
+    epoch_pid = 0;
+}
+/* }}} */
+#endif
+
+/* {{{ epoch_owner */
+static long epoch_owner(void)
+{
+#ifdef ZTS
+    return (long) tsrm_thread_id();
+#elif defined(EPOCH_CACHE_PID)
+    if (!epoch_pid) {
+        epoch_pid = getpid();
+    }
+    return (long) epoch_pid;
+#else
+    return (long) getpid();
+#endif
+}
+/* }}} */
+
+/* {{{ epoch_claim */
+static int epoch_claim(long owner TSRMLS_DC)
+{
+    int i;
+
+    LOCK(apc_epoch->lock);
+    for (i = 0; i < APC_EPOCH_RECORDS; i++) {
+        if (!apc_epoch->records[i].owner) {
+            break;
+        }
+    }
+#if !defined(ZTS) && !defined(PHP_WIN32)
+    if (i == APC_EPOCH_RECORDS) {
+        /* processes which exited without a shutdown still own their record */
+        for (i = 0; i < APC_EPOCH_RECORDS; i++) {
+            if (!apc_epoch->records[i].epoch && kill((pid_t) apc_epoch->records[i].owner, 0) == -1 && errno == ESRCH) {
+                break;
+            }
+        }
+    }
+#endif
+    if (i < APC_EPOCH_RECORDS) {
+        apc_epoch->records[i].owner = owner;
+        apc_epoch->records[i].epoch = 0;
+        if (i >= apc_epoch->num_records) {
+            apc_epoch->num_records = i + 1;
+        }
+    }
+    UNLOCK(apc_epoch->lock);
+
+    if (i == APC_EPOCH_RECORDS) {
+        apc_debug("All %d epoch records are taken, reclamation waits for this process\n" TSRMLS_CC, APC_EPOCH_RECORDS);
+        return -1;
+    }
+    return i;
+}
+/* }}} */
+
+/* {{{ apc_epoch_init */
+void apc_epoch_init(TSRMLS_D)
+{
+    apc_epoch = (apc_epoch_t*) apc_sma_malloc(sizeof(apc_epoch_t) TSRMLS_CC);
+    if (!apc_epoch) {
+        apc_error("Unable to allocate shared memory for the epoch records.  (Perhaps your shared memory size isn't large enough?). " TSRMLS_CC);
+        return;
+    }
+    memset(apc_epoch, 0, sizeof(apc_epoch_t));
+    CREATE_LOCK(apc_epoch->lock);
+#ifdef EPOCH_CACHE_PID
+    pthread_atfork(NULL, NULL, epoch_forked);
+#endif
+    apc_epoch->epoch = 1;
+    apc_epoch->safe = 1;
+}
+/* }}} */
+
+/* {{{ apc_epoch_enter */
+void apc_epoch_enter(TSRMLS_D)
+{
+    long owner;
+
+    if (!apc_epoch || APCG(epoch_depth)++ > 0) {
+        return;
+    }
+
+    owner = epoch_owner();
+    if (APCG(epoch_owner) != owner || APCG(epoch_record) < 0 ||
+        apc_epoch->records[APCG(epoch_record)].owner != owner) {
+        /* first pin, or a record inherited across fork() */
+        APCG(epoch_owner) = owner;
+        APCG(epoch_record) = epoch_claim(owner TSRMLS_CC);
+    }
+
+    if (APCG(epoch_record) < 0) {
+        /* no record: hold back every reclamation until we leave */
+        EPOCH_OVERFLOW(1);
+        return;
+    }
+
+    apc_epoch->records[APCG(epoch_record)].since = time(0);
+    EPOCH_PIN(&apc_epoch->records[APCG(epoch_record)], apc_epoch->epoch);
+}
+/* }}} */
+
+/* {{{ apc_epoch_leave */
+void apc_epoch_leave(TSRMLS_D)
+{
+    if (!apc_epoch || APCG(epoch_depth) <= 0 || --APCG(epoch_depth) > 0) {
+        return;
+    }
+
+    if (APCG(epoch_record) < 0) {
+        EPOCH_OVERFLOW(-1);
+        apc_epoch->changes++;
+    } else {
+        apc_epoch_record_t* rec = &apc_epoch->records[APCG(epoch_record)];
+        unsigned long e = rec->epoch;
+
+        EPOCH_UNPIN(rec);
+        /* a pin of the current epoch never held anything back, and leaving
+         * it alone keeps readers off a cache line they would all share */
+        if (e != apc_epoch->epoch) {
+            apc_epoch->changes++;
+        }
+    }
+}
+/* }}} */
+
+/* {{{ apc_epoch_reset */
+void apc_epoch_reset(TSRMLS_D)
+{
+    if (APCG(epoch_depth) > 0) {
+        APCG(epoch_depth) = 1;
+        apc_epoch_leave(TSRMLS_C);
+    }
+}
+/* }}} */
+
+/* {{{ apc_epoch_release */
+void apc_epoch_release(TSRMLS_D)
+{
+    apc_epoch_reset(TSRMLS_C);
+
+    if (!apc_epoch || APCG(epoch_record) < 0 || APCG(epoch_owner) != epoch_owner()) {
+        return;
+    }
+
+    LOCK(apc_epoch->lock);
+    if (apc_epoch->records[APCG(epoch_record)].owner == APCG(epoch_owner)) {
+        apc_epoch->records[APCG(epoch_record)].epoch = 0;
+        apc_epoch->records[APCG(epoch_record)].owner = 0;
+    }
+    UNLOCK(apc_epoch->lock);
+    APCG(epoch_record) = -1;
+}
+/* }}} */
+
+/* {{{ apc_epoch_current */
+unsigned long apc_epoch_current(void)
+{
+    return apc_epoch ? apc_epoch->epoch : 0;
+}
+/* }}} */
+
+/* {{{ apc_epoch_advance */
+void apc_epoch_advance(unsigned long stamp TSRMLS_DC)
+{
+    if (!apc_epoch || apc_epoch->epoch != stamp) {
+        return;
+    }
+
+    LOCK(apc_epoch->lock);
+    if (apc_epoch->epoch == stamp) {
+        apc_epoch->epoch++;
+        if (!apc_epoch->epoch) {
+            /* 0 marks a quiescent record */
+            apc_epoch->epoch++;
+        }
+        /* a scan right after this may well find more to free */
+        apc_epoch->changes++;
+    }
+    UNLOCK(apc_epoch->lock);
+}
+/* }}} */
+
+/* {{{ apc_epoch_reclaimable */
+unsigned long apc_epoch_reclaimable(int gc_ttl TSRMLS_DC)
+{
+    unsigned long oldest;
+    unsigned int changes;
+    time_t now;
+    int i;
+
+    if (!apc_epoch) {
+        return 0;
+    }
+
+    now = time(0);
+    changes = apc_epoch->changes;
+
+    /* nothing was unpinned or advanced since the last scan */
+    if (changes == apc_epoch->scan_changes && now == apc_epoch->scan_time) {
+        return apc_epoch->safe;
+    }
+
+    if (apc_epoch->overflow > 0) {
+        /* whatever was safe before stays safe, the owners without a record
+         * may hold anything retired since */
+        return apc_epoch->safe;
+    }
+
+    oldest = apc_epoch->epoch;
+    for (i = 0; i < apc_epoch->num_records; i++) {
+        apc_epoch_record_t* rec = &apc_epoch->records[i];
+        unsigned long e = rec->epoch;
+        long owner = rec->owner;
+
+        if (!e || !owner || !APC_EPOCH_BEFORE(e, oldest)) {
+            continue;
+        }
+        if (gc_ttl && now - rec->since > gc_ttl) {
+            apc_debug("Ignoring epoch %lu pinned by %ld for %d seconds\n" TSRMLS_CC, e, owner, (int)(now - rec->since));
+            continue;
+        }
+#if !defined(ZTS) && !defined(PHP_WIN32)
+        if (now - rec->since > APC_EPOCH_CHECK_AFTER && kill((pid_t) owner, 0) == -1 && errno == ESRCH) {
+            /* the owner died while pinned */
+            LOCK(apc_epoch->lock);
+            if (rec->owner == owner) {
+                rec->epoch = 0;
+                rec->owner = 0;
+            }
+            UNLOCK(apc_epoch->lock);
+            continue;
+        }
+#endif
+        oldest = e;
+    }
+
+    apc_epoch->safe = oldest;
+    apc_epoch->scan_changes = changes;
+    apc_epoch->scan_time = now;
+    return oldest;
+}
+/* }}} */
+
+/* {{{ apc_epoch_retire */
+void apc_epoch_retire(void* mem, apc_epoch_block_t* node TSRMLS_DC)
+{
+    if (!apc_epoch) {
+        apc_sma_free(mem TSRMLS_CC);
+        return;
+    }
+
+    node->mem = mem;
+    node->next = NULL;
+    LOCK(apc_epoch->lock);
+    node->stamp = apc_epoch->epoch;
+    if (apc_epoch->blocks_tail) {
+        apc_epoch->blocks_tail->next = node;
+    } else {
+        apc_epoch->blocks = node;
+    }
+    apc_epoch->blocks_tail = node;
+    UNLOCK(apc_epoch->lock);
+}
+/* }}} */
+
+/* {{{ apc_epoch_collect */
+void apc_epoch_collect(int gc_ttl TSRMLS_DC)
+{
+    apc_epoch_block_t* dead = NULL;
+    apc_epoch_block_t** dead_tail = &dead;
+    unsigned long safe;
+
+    if (!apc_epoch || !apc_epoch->blocks) {
+        return;
+    }
+
+    /* later pins must not hold back what was retired up to now */
+    apc_epoch_advance(apc_epoch->epoch TSRMLS_CC);
+    safe = apc_epoch_reclaimable(gc_ttl TSRMLS_CC);
+
+    LOCK(apc_epoch->lock);
+    while (apc_epoch->blocks && APC_EPOCH_BEFORE(apc_epoch->blocks->stamp, safe)) {
+        *dead_tail = apc_epoch->blocks;
+        dead_tail = &apc_epoch->blocks->next;
+        apc_epoch->blocks = apc_epoch->blocks->next;
+    }
+    *dead_tail = NULL;
+    if (!apc_epoch->blocks) {
+        apc_epoch->blocks_tail = NULL;
+    }
+    UNLOCK(apc_epoch->lock);
+
+    while (dead) {
+        void* mem = dead->mem;
+        dead = dead->next;
+        apc_sma_free(mem TSRMLS_CC);
+    }
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
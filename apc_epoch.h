@@ -0,0 +1,129 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_EPOCH_H
+#define APC_EPOCH_H
+
+#include "apc.h"
+#include "apc_lock.h"
+
+/*
+ * Epoch based reclamation of removed cache slots.
+ *
+ * Every process (or thread) owns a record in a shared table. While it holds
+ * pointers into the cache outside of the cache locks it publishes the global
+ * epoch it started in, and clears it again once done. Removed slots are
+ * stamped with the epoch they were retired in and may be freed as soon as
+ * every published epoch is newer than that stamp.
+ */
+
+#define APC_EPOCH_RECORDS 1024
+
+/* wrap-safe "a is older than b" */
+#define APC_EPOCH_BEFORE(a, b) ((long)((a) - (b)) < 0)
+
+/* {{{ struct definition: apc_epoch_record_t */
+typedef struct apc_epoch_record_t apc_epoch_record_t;
+struct apc_epoch_record_t {
+    volatile unsigned long epoch;   /* epoch the owner is pinned in, 0 when quiescent */
+    volatile long owner;            /* pid (thread id under ZTS) owning the record, 0 if free */
+    time_t since;                   /* when the owner pinned its epoch */
+    char pad[64 - 2 * sizeof(long) - sizeof(time_t)]; /* one cache line per record */
+};
+/* }}} */
+
+/* {{{ struct definition: apc_epoch_block_t
+   Node queueing a shared block whose release waits for the readers. It lives
+   in the block's own allocation, past the part readers look at. */
+typedef struct apc_epoch_block_t apc_epoch_block_t;
+struct apc_epoch_block_t {
+    void* mem;                      /* the SMA block to free */
+    unsigned long stamp;            /* epoch the block was retired in */
+    apc_epoch_block_t* next;
+};
+/* }}} */
+
+/* {{{ struct definition: apc_epoch_t */
+typedef struct apc_epoch_t apc_epoch_t;
+struct apc_epoch_t {
+    apc_lck_t lock;                 /* guards record claims and epoch advances */
+    volatile unsigned long epoch;   /* the global epoch, never 0 */
+    volatile unsigned long safe;    /* oldest epoch pinned at the last scan */
+    volatile unsigned int changes;  /* bumped by unpins of older epochs and epoch advances */
+    unsigned int scan_changes;      /* value of changes at the last scan */
+    time_t scan_time;               /* time of the last scan */
+    int num_records;                /* records claimed so far (high water mark) */
+    volatile long overflow;         /* pinned owners that found the table full */
+    apc_epoch_block_t* blocks;      /* retired blocks, oldest stamp first */
+    apc_epoch_block_t* blocks_tail;
+    apc_epoch_record_t records[APC_EPOCH_RECORDS];
+};
+/* }}} */
+
+extern apc_epoch_t* apc_epoch;
+
+/*
+ * apc_epoch_init allocates the shared record table, once, from the module
+ * init of the parent process.
+ */
+extern void apc_epoch_init(TSRMLS_D);
+
+/*
+ * apc_epoch_enter pins the current epoch for this process and apc_epoch_leave
+ * unpins it. Calls nest; only the outermost pair touches the shared record.
+ * apc_epoch_reset drops any pin left behind by a bailout.
+ */
+extern void apc_epoch_enter(TSRMLS_D);
+extern void apc_epoch_leave(TSRMLS_D);
+extern void apc_epoch_reset(TSRMLS_D);
+
+/* gives this process' record back, from its shutdown */
+extern void apc_epoch_release(TSRMLS_D);
+
+/* the stamp for a slot being removed now */
+extern unsigned long apc_epoch_current(void);
+
+/* moves the global epoch past stamp, so that later pins do not hold it back */
+extern void apc_epoch_advance(unsigned long stamp TSRMLS_DC);
+
+/*
+ * apc_epoch_reclaimable returns the oldest epoch still pinned: slots stamped
+ * before it are unreachable by everybody. Pins older than gc_ttl seconds and
+ * pins of processes that died are ignored.
+ */
+extern unsigned long apc_epoch_reclaimable(int gc_ttl TSRMLS_DC);
+
+/*
+ * apc_epoch_retire queues mem, a block readers may still be looking at without
+ * a lock, to be freed once they are done. node must lie inside the block.
+ * apc_epoch_collect frees whatever became unreachable.
+ */
+extern void apc_epoch_retire(void* mem, apc_epoch_block_t* node TSRMLS_DC);
+extern void apc_epoch_collect(int gc_ttl TSRMLS_DC);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
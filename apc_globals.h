@@ -66,11 +66,22 @@ ZEND_BEGIN_MODULE_GLOBALS(apc)
     zend_bool enabled;      /* if true, apc is enabled (defaults to true) */
     long shm_segments;      /* number of shared memory segments to use */
     long shm_size;          /* size of each shared memory segment (in MB) */
+    long sma_magazine_size; /* bytes of freed blocks a process keeps for itself, 0 for none */
+    char *shm_placement;    /* segment an allocation tries first, "mru", "process" or "key" */
     long num_files_hint;    /* parameter to apc_cache_create */
     long user_entries_hint;
+    long user_lock_stripes; /* number of lock stripes for the user cache */
+    char *user_index;       /* user cache lookup index, "chained" or "tagged" */
     long gc_ttl;            /* parameter to apc_cache_create */
     long ttl;               /* parameter to apc_cache_create */
     long user_ttl;
+    char *eviction;         /* what a full file cache does, "clock" or "wipe" */
+    char *user_eviction;    /* the same for the user cache */
+    long lease_slots;       /* entries in the shared lease table */
+    char* namespace_separator;  /* user keys up to it name their namespace, empty for none */
+    long namespaces;        /* entries in the shared namespace generation table */
+    long lease_ttl;         /* seconds a lease on a missing user key lasts */
+    long lease_wait;        /* milliseconds a miss waits for the lease holder */
 #if APC_MMAP
     char *mmap_file_mask;   /* mktemp-style file-mask to pass to mmap */
 #endif
@@ -80,6 +91,14 @@ ZEND_BEGIN_MODULE_GLOBALS(apc)
     /* module variables */
     zend_bool initialized;       /* true if module was initialized */
     apc_stack_t* cache_stack;    /* the stack of cached executable code */
+    int epoch_record;            /* index of our record in the epoch table, -1 if none */
+    long epoch_owner;            /* pid (thread id) the record was claimed for */
+    int epoch_depth;             /* nesting of apc_epoch_enter calls */
+    int lease_count;             /* leases this process took and did not release */
+    long hit_tick;               /* hits since the last one apc.hit_sample recorded */
+    size_t compact_limit;        /* an entry being relocated takes free blocks smaller than this */
+    const void* compact_from;    /* and none next to its old pool here */
+    unsigned long sma_hint;      /* hash of the key being stored, picks its segment, 0 for none */
     zend_bool cache_by_default;  /* true if files should be cached unless filtered out */
                                  /* false if files should only be cached if filtered in */
     long file_update_protection; /* Age in seconds before a file is eligible to be cached - 0 to disable */
@@ -102,6 +121,10 @@ ZEND_BEGIN_MODULE_GLOBALS(apc)
     apc_rfc1867_data rfc1867_data;/* Per-request data */
 #endif
     HashTable copied_zvals;      /* my_copy recursion detection list */
+    HashTable held_entries;      /* user entries whose strings were handed out in place */
+    HashTable local_cache;       /* copies of values fetched in this request, see apc.local_size */
+    unsigned long local_hits;    /* apc_fetch calls answered from local_cache */
+    unsigned long local_misses;  /* and those which copied from shared memory */
     zend_bool force_file_update; /* force files to be updated during apc_compile_file */
     char canon_path[MAXPATHLEN]; /* canonical path for key data */
 #ifdef APC_FILEHITS
@@ -115,6 +138,13 @@ ZEND_BEGIN_MODULE_GLOBALS(apc)
     void *apc_bd_alloc_ubptr;    /* bindump alloc() upper bound ptr */
     HashTable apc_bd_alloc_list; /* bindump alloc() ptr list */
     zend_bool use_request_time;  /* use the SAPI request start time for TTL */
+    zend_bool atomic_inc;        /* apc_inc/apc_dec/apc_cas update longs in place */
+    long hit_sample;             /* entries record one in this many hits */
+    long shared_strings;         /* fetched strings this long are left in shared memory, 0 for never */
+    long local_size;             /* fetched values a request keeps copies of, 0 for none */
+    long compress_threshold;     /* user values this long are stored compressed, 0 for never */
+    long compact_threshold;      /* percent of free memory outside the largest blocks that starts compaction, 0 for never */
+    long compact_budget;         /* microseconds a compaction step may take */
     zend_bool lazy_functions;        /* enable/disable lazy function loading */
     HashTable *lazy_function_table;  /* lazy function entry table */
     zend_bool lazy_classes;          /* enable/disable lazy class loading */
@@ -22,6 +22,7 @@
 #include "php_apc.h"
 #include "apc_iterator.h"
 #include "apc_cache.h"
+#include "apc_namespace.h"
 #include "apc_zend.h"
 
 #include "ext/standard/md5.h"
@@ -108,6 +109,8 @@ static apc_iterator_item_t* apc_iterator_item_ctor(apc_iterator_t *iterator, slo
 
             ctxt.pool = apc_pool_create(APC_UNPOOL, apc_php_malloc, apc_php_free, NULL, NULL TSRMLS_CC);
             ctxt.copy = APC_COPY_OUT_USER;
+            ctxt.tree = slot->value->data.user.tree;
+            ctxt.raw_len = slot->value->data.user.raw_len;
 
             MAKE_STD_ZVAL(zvalue);
             apc_cache_fetch_zval(zvalue, slot->value->data.user.val, &ctxt TSRMLS_CC);
@@ -143,6 +146,7 @@ static apc_iterator_item_t* apc_iterator_item_ctor(apc_iterator_t *iterator, slo
     }
     if (APC_ITER_MEM_SIZE & iterator->format) {
         add_assoc_long(item->value, "mem_size", slot->value->mem_size);
+        add_assoc_long(item->value, "raw_size", slot->value->mem_size + APC_ENTRY_SAVED(slot->value));
     }
     if (APC_ITER_TTL & iterator->format) {
         if(slot->value->type == APC_CACHE_ENTRY_USER) {
@@ -281,6 +285,9 @@ static int apc_iterator_search_match(apc_iterator_t *iterator, slot_t **slot) {
 static int apc_iterator_check_expiry(apc_cache_t* cache, slot_t **slot, time_t t)
 {
     if((*slot)->value->type == APC_CACHE_ENTRY_USER) {
+        if(APC_NS_STALE((*slot)->value)) {
+            return 0;
+        }
         if((*slot)->value->data.user.ttl) {
             if((time_t) ((*slot)->creation_time + (*slot)->value->data.user.ttl) < t) {
                 return 0;
@@ -298,11 +305,51 @@ static int apc_iterator_check_expiry(apc_cache_t* cache, slot_t **slot, time_t t
 }
 /* }}} */
 
+/* {{{ apc_iterator_fetch_chain */
+static int apc_iterator_fetch_chain(apc_iterator_t *iterator, slot_t **slot, time_t t TSRMLS_DC) {
+    int count=0;
+    apc_iterator_item_t *item;
+    unsigned long mask = (unsigned long) iterator->num_slots - 1;
+
+    while(*slot) {
+        /* the chain may hold keys of other buckets of the walk, they are
+         * taken when the walk gets to them */
+        if (((*slot)->key.h & mask) == (unsigned long) iterator->slot_idx &&
+            apc_iterator_check_expiry(iterator->cache, slot, t)) {
+            if (apc_iterator_search_match(iterator, slot)) {
+                count++;
+                item = apc_iterator_item_ctor(iterator, slot TSRMLS_CC);
+                if (item) {
+                    apc_stack_push(iterator->stack, item TSRMLS_CC);
+                }
+            }
+        }
+        slot = &(*slot)->next;
+    }
+    return count;
+}
+/* }}} */
+
+/* {{{ apc_iterator_fetch_bucket */
+static int apc_iterator_fetch_bucket(apc_iterator_t *iterator, slot_t **slots, long num_slots, time_t t TSRMLS_DC) {
+    int count=0;
+    long step = num_slots < iterator->num_slots ? num_slots : iterator->num_slots;
+    long i;
+
+    /* the keys of bucket slot_idx of the walk, in a table of num_slots: the
+     * table sizes are powers of two and never below the number of stripes,
+     * so these chains all belong to the stripe of slot_idx */
+    for (i = iterator->slot_idx & (step - 1); i < num_slots; i += step) {
+        count += apc_iterator_fetch_chain(iterator, &slots[i], t TSRMLS_CC);
+    }
+    return count;
+}
+/* }}} */
+
 /* {{{ apc_iterator_fetch_active */
 static int apc_iterator_fetch_active(apc_iterator_t *iterator TSRMLS_DC) {
     int count=0;
-    slot_t **slot;
-    apc_iterator_item_t *item;
+    cache_header_t *header = iterator->cache->header;
     time_t t;
 
     t = apc_time();
@@ -311,24 +358,23 @@ static int apc_iterator_fetch_active(apc_iterator_t *iterator TSRMLS_DC) {
         apc_iterator_item_dtor(apc_stack_pop(iterator->stack));
     }
 
-    CACHE_LOCK(iterator->cache);
-    while(count <= iterator->chunk_size && iterator->slot_idx < iterator->cache->num_slots) {
-        slot = &iterator->cache->slots[iterator->slot_idx];
-        while(*slot) {
-            if (apc_iterator_check_expiry(iterator->cache, slot, t)) {
-                if (apc_iterator_search_match(iterator, slot)) {
-                    count++;
-                    item = apc_iterator_item_ctor(iterator, slot TSRMLS_CC);
-                    if (item) {
-                        apc_stack_push(iterator->stack, item TSRMLS_CC);
-                    }
-                }
-            }
-            slot = &(*slot)->next;
+    /* a rehash moves the keys of an old bucket the walk has been through to
+     * one it has not, so the walk goes by the key hashes under the table size
+     * it started with: every key belongs to one of its buckets, whichever
+     * table and chain it sits in when the walk gets there */
+    if (iterator->num_slots == 0) {
+        iterator->num_slots = header->num_slots;
+    }
+
+    while(count <= iterator->chunk_size && iterator->slot_idx < iterator->num_slots) {
+        CACHE_STRIPE_RDLOCK(iterator->cache, iterator->slot_idx);
+        count += apc_iterator_fetch_bucket(iterator, header->slots, header->num_slots, t TSRMLS_CC);
+        if (header->old_slots) {
+            count += apc_iterator_fetch_bucket(iterator, header->old_slots, header->old_num_slots, t TSRMLS_CC);
         }
+        CACHE_STRIPE_RDUNLOCK(iterator->cache, iterator->slot_idx);
         iterator->slot_idx++;
     }
-    CACHE_UNLOCK(iterator->cache);
     iterator->stack_idx = 0;
     return count;
 }
@@ -340,7 +386,7 @@ static int apc_iterator_fetch_deleted(apc_iterator_t *iterator TSRMLS_DC) {
     slot_t **slot;
     apc_iterator_item_t *item;
 
-    CACHE_LOCK(iterator->cache);
+    CACHE_GC_LOCK(iterator->cache);
     slot = &iterator->cache->header->deleted_list;
     while ((*slot) && count <= iterator->slot_idx) {
         count++;
@@ -357,7 +403,7 @@ static int apc_iterator_fetch_deleted(apc_iterator_t *iterator TSRMLS_DC) {
         }
         slot = &(*slot)->next;
     }
-    CACHE_UNLOCK(iterator->cache);
+    CACHE_GC_UNLOCK(iterator->cache);
     iterator->slot_idx += count;
     iterator->stack_idx = 0;
     return count;
@@ -370,8 +416,9 @@ static void apc_iterator_totals(apc_iterator_t *iterator TSRMLS_DC) {
     int i;
 
     CACHE_LOCK(iterator->cache);
-    for (i=0; i < iterator->cache->num_slots; i++) {
-        slot = &iterator->cache->slots[i];
+    apc_cache_finish_rehash(iterator->cache TSRMLS_CC);
+    for (i=0; i < iterator->cache->header->num_slots; i++) {
+        slot = &iterator->cache->header->slots[i];
         while((*slot)) {
             if (apc_iterator_search_match(iterator, slot)) {
                 iterator->size += (*slot)->value->mem_size;
@@ -431,6 +478,7 @@ PHP_METHOD(apc_iterator, __construct) {
     }
 
     iterator->slot_idx = 0;
+    iterator->num_slots = 0;
     iterator->stack_idx = 0;
     iterator->key_idx = 0;
     iterator->chunk_size = chunk_size == 0 ? APC_DEFAULT_CHUNK_SIZE : chunk_size;
@@ -476,6 +524,7 @@ PHP_METHOD(apc_iterator, rewind) {
     }
 
     iterator->slot_idx = 0;
+    iterator->num_slots = 0;
     iterator->stack_idx = 0;
     iterator->key_idx = 0;
     iterator->fetch(iterator TSRMLS_CC);
@@ -75,6 +75,7 @@ typedef struct _apc_iterator_t {
                              /* fetch callback to fetch items from cache slots or lists */
     apc_cache_t *cache;      /* cache which we are iterating on */
     long slot_idx;           /* index to the slot array or linked list */
+    long num_slots;          /* table size the walk of slot_idx follows, 0 before it starts */
     long chunk_size;         /* number of entries to pull down per fetch */
     apc_stack_t *stack;      /* stack of entries pulled from cache */
     int stack_idx;           /* index into the current stack */
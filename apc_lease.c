@@ -0,0 +1,240 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+ */
+
+/* $Id$ */
+
+#include "apc_lease.h"
+#include "apc_sma.h"
+#include "apc_globals.h"
+
+apc_lease_t* apc_lease = NULL;
+
+#define LEASE_AT(h, i)      (&apc_lease->entries[((h) + (i)) & (unsigned long)(apc_lease->num_entries - 1)])
+#define LEASE_LIVE(e, now)  ((e)->token && (e)->expires > (now))
+
+/* {{{ lease_owner */
+static long lease_owner(void)
+{
+#ifdef ZTS
+    return (long) tsrm_thread_id();
+#else
+    return (long) getpid();
+#endif
+}
+/* }}} */
+
+/* {{{ lease_find */
+static apc_lease_entry_t* lease_find(unsigned long h, time_t now, apc_lease_entry_t** avail)
+{
+    /* caller holds the lease lock, except apc_lease_held. Returns the live
+     * lease on h, if any, and sets *avail to an entry a new lease could take */
+    int i;
+
+    if (avail) {
+        *avail = NULL;
+    }
+    for (i = 0; i < APC_LEASE_PROBES; i++) {
+        apc_lease_entry_t* e = LEASE_AT(h, i);
+
+        if (!LEASE_LIVE(e, now)) {
+            if (avail && !*avail) {
+                *avail = e;
+            }
+            continue;
+        }
+        if (e->h == h) {
+            return e;
+        }
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ apc_lease_init */
+void apc_lease_init(int num_entries TSRMLS_DC)
+{
+    int n;
+
+    for (n = APC_LEASE_PROBES; n < num_entries; n <<= 1);
+
+    apc_lease = (apc_lease_t*) apc_sma_malloc(sizeof(apc_lease_t) + (n - 1) * sizeof(apc_lease_entry_t) TSRMLS_CC);
+    if (!apc_lease) {
+        apc_error("Unable to allocate shared memory for the lease table.  (Perhaps your shared memory size isn't large enough?). " TSRMLS_CC);
+        return;
+    }
+    memset(apc_lease, 0, sizeof(apc_lease_t) + (n - 1) * sizeof(apc_lease_entry_t));
+    CREATE_LOCK(apc_lease->lock);
+    apc_lease->next_token = 1;
+    apc_lease->num_entries = n;
+}
+/* }}} */
+
+/* {{{ apc_lease_acquire */
+unsigned long apc_lease_acquire(unsigned long h, int ttl TSRMLS_DC)
+{
+    apc_lease_entry_t* e;
+    apc_lease_entry_t* avail;
+    unsigned long token;
+    long owner = lease_owner();
+    time_t now = time(0);
+
+    if (!apc_lease) {
+        /* no table, every misser computes the value as before */
+        return 1;
+    }
+
+    LOCK(apc_lease->lock);
+    e = lease_find(h, now, &avail);
+    if (e) {
+        token = (e->owner == owner) ? e->token : 0;
+        UNLOCK(apc_lease->lock);
+        return token;
+    }
+
+    token = apc_lease->next_token++;
+    if (!apc_lease->next_token) {
+        apc_lease->next_token = 1;
+    }
+    apc_lease->granted++;
+    if (avail) {
+        /* with the probe window full of live leases the key goes unprotected */
+        avail->h = h;
+        avail->token = token;
+        avail->owner = owner;
+        avail->expires = now + (ttl > 0 ? ttl : 1);
+        APCG(lease_count)++;
+    }
+    UNLOCK(apc_lease->lock);
+
+    return token;
+}
+/* }}} */
+
+/* {{{ apc_lease_release */
+int apc_lease_release(unsigned long h, unsigned long token TSRMLS_DC)
+{
+    apc_lease_entry_t* e;
+    int ret = 1;
+
+    if (!apc_lease) {
+        return 1;
+    }
+
+    LOCK(apc_lease->lock);
+    e = lease_find(h, time(0), NULL);
+    if (e) {
+        if (token ? e->token == token : e->owner == lease_owner()) {
+            e->token = 0;
+            if (APCG(lease_count) > 0) {
+                APCG(lease_count)--;
+            }
+        } else {
+            /* ours lapsed and was handed to somebody else */
+            ret = 0;
+        }
+    }
+    UNLOCK(apc_lease->lock);
+
+    return ret;
+}
+/* }}} */
+
+/* {{{ apc_lease_held */
+zend_bool apc_lease_held(unsigned long h TSRMLS_DC)
+{
+    /* unlocked reads, every store asks and we're not shooting for 100% here */
+    apc_lease_entry_t* e;
+
+    if (!apc_lease) {
+        return 0;
+    }
+    e = lease_find(h, time(0), NULL);
+    return e && e->owner != lease_owner();
+}
+/* }}} */
+
+/* {{{ apc_lease_waited */
+void apc_lease_waited(zend_bool backed_off TSRMLS_DC)
+{
+    if (!apc_lease) {
+        return;
+    }
+    LOCK(apc_lease->lock);
+    apc_lease->waits++;
+    if (backed_off) {
+        apc_lease->backoffs++;
+    }
+    UNLOCK(apc_lease->lock);
+}
+/* }}} */
+
+/* {{{ apc_lease_release_all */
+void apc_lease_release_all(TSRMLS_D)
+{
+    long owner;
+    int i;
+
+    if (!apc_lease || APCG(lease_count) <= 0) {
+        return;
+    }
+
+    owner = lease_owner();
+    LOCK(apc_lease->lock);
+    for (i = 0; i < apc_lease->num_entries; i++) {
+        if (apc_lease->entries[i].token && apc_lease->entries[i].owner == owner) {
+            apc_lease->entries[i].token = 0;
+        }
+    }
+    UNLOCK(apc_lease->lock);
+    APCG(lease_count) = 0;
+}
+/* }}} */
+
+/* {{{ apc_lease_info */
+void apc_lease_info(zval* info TSRMLS_DC)
+{
+    int i;
+    long held = 0;
+    time_t now;
+
+    if (!apc_lease) {
+        return;
+    }
+
+    now = time(0);
+    LOCK(apc_lease->lock);
+    for (i = 0; i < apc_lease->num_entries; i++) {
+        if (LEASE_LIVE(&apc_lease->entries[i], now)) {
+            held++;
+        }
+    }
+    add_assoc_long(info, "leases_held", held);
+    add_assoc_long(info, "leases_granted", apc_lease->granted);
+    add_assoc_long(info, "lease_waits", apc_lease->waits);
+    add_assoc_long(info, "lease_backoffs", apc_lease->backoffs);
+    UNLOCK(apc_lease->lock);
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
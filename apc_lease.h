@@ -0,0 +1,107 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_LEASE_H
+#define APC_LEASE_H
+
+#include "apc.h"
+#include "apc_lock.h"
+
+/*
+ * Leases on missing user cache keys.
+ *
+ * The first process to miss a key is handed a lease token and is expected to
+ * compute the value and store it with the token. Others missing the same key
+ * meanwhile see the lease and wait for the value or back off instead of all
+ * computing it at once. A lease lapses after its ttl, so a holder which died
+ * or gave up does not block the key for longer than that.
+ *
+ * Leases are kept by key hash in a small open-addressing table. Two keys
+ * with the same hash share a lease, which at worst makes a misser wait.
+ */
+
+#define APC_LEASE_PROBES 8      /* table entries looked at for a key */
+
+/* {{{ struct definition: apc_lease_entry_t */
+typedef struct apc_lease_entry_t apc_lease_entry_t;
+struct apc_lease_entry_t {
+    unsigned long h;            /* hash of the leased key */
+    unsigned long token;        /* handed to the holder, 0 when the entry is free */
+    long owner;                 /* pid (thread id under ZTS) of the holder */
+    time_t expires;             /* the lease lapses at this time */
+};
+/* }}} */
+
+/* {{{ struct definition: apc_lease_t */
+typedef struct apc_lease_t apc_lease_t;
+struct apc_lease_t {
+    apc_lck_t lock;             /* guards the entries and the counters */
+    unsigned long next_token;   /* never 0 */
+    unsigned long granted;      /* leases handed out */
+    unsigned long waits;        /* misses which found the key leased */
+    unsigned long backoffs;     /* misses sent away without value or lease */
+    int num_entries;            /* size of entries, a power of two */
+    apc_lease_entry_t entries[1];
+};
+/* }}} */
+
+extern apc_lease_t* apc_lease;
+
+/*
+ * apc_lease_init allocates the shared lease table, once, from the module
+ * init of the parent process. num_entries is rounded up to a power of two.
+ */
+extern void apc_lease_init(int num_entries TSRMLS_DC);
+
+/*
+ * apc_lease_acquire hands out a lease on the key hashing to h, valid for ttl
+ * seconds, and returns its token. It returns 0 while another process holds a
+ * lease on the key; the holder asking again gets its own token back.
+ */
+extern unsigned long apc_lease_acquire(unsigned long h, int ttl TSRMLS_DC);
+
+/*
+ * apc_lease_release gives up the lease token was handed for, or with a token
+ * of 0 whatever lease this process holds on the key. It returns 0 if that
+ * lease lapsed and another process holds the key now, 1 otherwise.
+ */
+extern int apc_lease_release(unsigned long h, unsigned long token TSRMLS_DC);
+
+/* whether another process holds a live lease on the key hashing to h */
+extern zend_bool apc_lease_held(unsigned long h TSRMLS_DC);
+
+/* counts a miss which found the key leased, and whether it backed off empty handed */
+extern void apc_lease_waited(zend_bool backed_off TSRMLS_DC);
+
+/* drops the leases this process still holds, from its request shutdown */
+extern void apc_lease_release_all(TSRMLS_D);
+
+/* adds the lease counters to an apc_cache_info() array */
+extern void apc_lease_info(zval* info TSRMLS_DC);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
@@ -58,9 +58,15 @@
 # ifdef PHP_WIN32
 #  define ATOMIC_INC(a) InterlockedIncrement(&a)
 #  define ATOMIC_DEC(a) InterlockedDecrement(&a)
+#  define ATOMIC_ADD(a, n) (InterlockedExchangeAdd(&a, n) + (n))
+#  define ATOMIC_CAS(a, o, n) (InterlockedCompareExchange(&a, n, o) == (o))
+#  define MEMORY_BARRIER() MemoryBarrier()
 # else
 #  define ATOMIC_INC(a) __sync_add_and_fetch(&a, 1)
 #  define ATOMIC_DEC(a) __sync_sub_and_fetch(&a, 1)
+#  define ATOMIC_ADD(a, n) __sync_add_and_fetch(&a, n)
+#  define ATOMIC_CAS(a, o, n) __sync_bool_compare_and_swap(&a, o, n)
+#  define MEMORY_BARRIER() __sync_synchronize()
 # endif
 #endif
 
@@ -35,6 +35,9 @@
 #include "apc.h"
 #include "apc_lock.h"
 #include "apc_cache.h"
+#include "apc_epoch.h"
+#include "apc_lease.h"
+#include "apc_namespace.h"
 #include "apc_compile.h"
 #include "apc_globals.h"
 #include "apc_sma.h"
@@ -550,7 +553,7 @@ apc_cache_entry_t* apc_get_cache_entry(zend_file_handle* h TSRMLS_DC)
     apc_cache_key_t key;
     time_t t;
 
-    if (!APCG(enabled) || apc_cache_busy(apc_cache)) {
+    if (!APCG(enabled)) {
         return NULL;
     }
 
@@ -577,7 +580,7 @@ static zend_op_array* my_compile_file(zend_file_handle* h,
     int bailout=0;
     const char* filename = NULL;
 
-    if (!APCG(enabled) || apc_cache_busy(apc_cache)) {
+    if (!APCG(enabled)) {
         return old_compile_file(h, type TSRMLS_CC);
     }
 
@@ -725,7 +728,7 @@ static zend_op_array* my_compile_file(zend_file_handle* h,
 
 /* {{{ data preload */
 
-extern int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int ttl, const int exclusive TSRMLS_DC);
+extern int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int ttl, const unsigned int grace, const int exclusive TSRMLS_DC);
 
 static zval* data_unserialize(const char *filename TSRMLS_DC)
 {
@@ -792,7 +795,7 @@ static int apc_load_data(const char *data_file TSRMLS_DC)
 
             data = data_unserialize(data_file TSRMLS_CC);
             if(data) {
-                _apc_store(key, key_len, data, 0, 1 TSRMLS_CC);
+                _apc_store(key, key_len, data, 0, 0, 1 TSRMLS_CC);
             }
             return 1;
         }
@@ -893,18 +896,54 @@ apc_serializer_t* apc_get_serializers(TSRMLS_D)
 }
 /* }}} */
 
+/* {{{ apc_eviction_policy */
+static int apc_eviction_policy(const char* directive, const char* value TSRMLS_DC)
+{
+    if (!value || !strcmp(value, "clock")) {
+        return APC_CACHE_EVICT_CLOCK;
+    }
+    if (strcmp(value, "wipe")) {
+        apc_warning("Unknown %s '%s', using 'clock'." TSRMLS_CC, directive, value);
+        return APC_CACHE_EVICT_CLOCK;
+    }
+    return APC_CACHE_EVICT_WIPE;
+}
+/* }}} */
+
 /* {{{ module init and shutdown */
 
 int apc_module_init(int module_number TSRMLS_DC)
 {
+    int user_index = APC_CACHE_INDEX_CHAINED;
+
     /* apc initialization */
 #if APC_MMAP
     apc_sma_init(APCG(shm_segments), APCG(shm_size), APCG(mmap_file_mask) TSRMLS_CC);
 #else
     apc_sma_init(APCG(shm_segments), APCG(shm_size), NULL TSRMLS_CC);
 #endif
-    apc_cache = apc_cache_create(APCG(num_files_hint), APCG(gc_ttl), APCG(ttl) TSRMLS_CC);
-    apc_user_cache = apc_cache_create(APCG(user_entries_hint), APCG(gc_ttl), APCG(user_ttl) TSRMLS_CC);
+    if (APCG(shm_placement) && !strcmp(APCG(shm_placement), "process")) {
+        apc_sma_set_placement(APC_SMA_PLACE_PROCESS);
+    } else if (APCG(shm_placement) && !strcmp(APCG(shm_placement), "key")) {
+        apc_sma_set_placement(APC_SMA_PLACE_KEY);
+    } else if (APCG(shm_placement) && strcmp(APCG(shm_placement), "mru")) {
+        apc_warning("Unknown apc.shm_placement '%s', using 'mru'." TSRMLS_CC, APCG(shm_placement));
+    }
+    apc_epoch_init(TSRMLS_C);
+    apc_lease_init(APCG(lease_slots) TSRMLS_CC);
+    if (APCG(namespace_separator) && APCG(namespace_separator)[0]) {
+        apc_ns_init(APCG(namespaces) TSRMLS_CC);
+    }
+    apc_cache = apc_cache_create(APCG(num_files_hint), APCG(gc_ttl), APCG(ttl), 1, APC_CACHE_INDEX_CHAINED,
+                                 apc_eviction_policy("apc.eviction", APCG(eviction) TSRMLS_CC) TSRMLS_CC);
+
+    if (APCG(user_index) && !strcmp(APCG(user_index), "tagged")) {
+        user_index = APC_CACHE_INDEX_TAGGED;
+    } else if (APCG(user_index) && strcmp(APCG(user_index), "chained")) {
+        apc_warning("Unknown apc.user_index '%s', using 'chained'." TSRMLS_CC, APCG(user_index));
+    }
+    apc_user_cache = apc_cache_create(APCG(user_entries_hint), APCG(gc_ttl), APCG(user_ttl), APCG(user_lock_stripes), user_index,
+                                      apc_eviction_policy("apc.user_eviction", APCG(user_eviction) TSRMLS_CC) TSRMLS_CC);
 
     /* override compilation */
     if (APCG(enable_opcode_cache)) {
@@ -926,6 +965,16 @@ int apc_module_init(int module_number TSRMLS_DC)
 #ifdef ZEND_ENGINE_2_4
 #ifndef ZTS
     apc_interned_strings_init(TSRMLS_C);
+    if (APCG(shared_strings) > 0) {
+        size_t seg_size = 0;
+        void* seg = apc_sma_get_segment(0, &seg_size);
+
+        /* the engine has a single interned range, which has to cover the
+         * one segment along with our interned strings buffer */
+        if (apc_sma_get_segment(1, &seg_size) || !apc_shared_strings_init(seg, seg_size TSRMLS_CC)) {
+            apc_warning("apc.shared_strings needs apc.shm_segments=1 and an apc.shm_strings_buffer, fetched strings are copied" TSRMLS_CC);
+        }
+    }
 #endif
 #endif
 
@@ -999,6 +1048,8 @@ int apc_process_init(int module_number TSRMLS_DC)
 
 int apc_process_shutdown(TSRMLS_D)
 {
+    apc_epoch_release(TSRMLS_C);
+    apc_sma_release_magazines(TSRMLS_C);
     return 0;
 }
 /* }}} */
@@ -1111,6 +1162,19 @@ int apc_request_shutdown(TSRMLS_D)
 {
     apc_deactivate(TSRMLS_C);
 
+    /* a bailout between apc_cache_user_find and apc_cache_release leaves a pin */
+    apc_epoch_reset(TSRMLS_C);
+
+    /* leases taken but never stored with would hold the keys until they lapse */
+    apc_lease_release_all(TSRMLS_C);
+
+    /* a few expired user entries, and cleared ones, go at the end of every request */
+    apc_cache_expire(apc_cache TSRMLS_CC);
+    apc_cache_expire(apc_user_cache TSRMLS_CC);
+
+    /* and now and then a few user entries move out of the way of the free memory */
+    apc_cache_compact(apc_user_cache TSRMLS_CC);
+
 #ifdef APC_FILEHITS
     zval_ptr_dtor(&APCG(filehits));
 #endif
@@ -53,7 +53,8 @@ typedef enum _apc_copy_type {
     APC_COPY_IN_OPCODE,
     APC_COPY_OUT_OPCODE,
     APC_COPY_IN_USER,
-    APC_COPY_OUT_USER
+    APC_COPY_OUT_USER,
+    APC_COPY_MOVE_USER      /* a stored user value to another pool, as it is */
 } apc_copy_type;
 
 typedef struct _apc_context_t
@@ -61,6 +62,11 @@ typedef struct _apc_context_t
     apc_pool *pool;
     apc_copy_type copy;
     unsigned int force_update:1;
+    unsigned int share_strings:1;   /* a user copy-out may leave long strings in shared memory */
+    unsigned int shared:1;          /* and it did, the entry must be held till the request ends */
+    unsigned int linked:1;          /* a copy-in reached a reference or an array twice, or an object */
+    unsigned int tree:1;            /* a copy-out source known to have none of these */
+    size_t raw_len;                 /* length of a user value before compression, 0 if stored as is */
 } apc_context_t;
 
 /* {{{ struct apc_serializer_t */
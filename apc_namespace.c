@@ -0,0 +1,108 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+ */
+
+/* $Id$ */
+
+#include "apc_namespace.h"
+#include "apc_sma.h"
+#include "apc_globals.h"
+
+apc_ns_t* apc_ns = NULL;
+
+#define NS_INDEX(ns, len)   (zend_inline_hash_func((ns), (len)) & (unsigned long)(apc_ns->num_entries - 1))
+
+/* {{{ apc_ns_init */
+void apc_ns_init(int num_entries TSRMLS_DC)
+{
+    int n;
+
+    for (n = 1; n < num_entries; n <<= 1);
+
+    apc_ns = (apc_ns_t*) apc_sma_malloc(sizeof(apc_ns_t) + (n - 1) * sizeof(unsigned long) TSRMLS_CC);
+    if (!apc_ns) {
+        apc_error("Unable to allocate shared memory for the namespace table.  (Perhaps your shared memory size isn't large enough?). " TSRMLS_CC);
+        return;
+    }
+    memset(apc_ns, 0, sizeof(apc_ns_t) + (n - 1) * sizeof(unsigned long));
+    CREATE_LOCK(apc_ns->lock);
+    apc_ns->num_entries = n;
+}
+/* }}} */
+
+/* {{{ apc_ns_lookup */
+unsigned int apc_ns_lookup(const char* key, int keylen, unsigned long* gen TSRMLS_DC)
+{
+    const char* sep;
+    unsigned long i;
+
+    if (!apc_ns || !APCG(namespace_separator) || !APCG(namespace_separator)[0]) {
+        return 0;
+    }
+
+    /* keylen counts the terminating zero */
+    sep = memchr(key, APCG(namespace_separator)[0], keylen - 1);
+    if (!sep || sep == key) {
+        return 0;
+    }
+
+    i = NS_INDEX(key, sep - key);
+    *gen = apc_ns->gens[i];
+    return (unsigned int) i + 1;
+}
+/* }}} */
+
+/* {{{ apc_ns_invalidate */
+int apc_ns_invalidate(const char* ns, int ns_len TSRMLS_DC)
+{
+    unsigned long i;
+
+    if (!apc_ns) {
+        return 0;
+    }
+
+    i = NS_INDEX(ns, ns_len);
+#ifdef HAVE_ATOMIC_OPERATIONS
+    ATOMIC_INC(apc_ns->gens[i]);
+    ATOMIC_INC(apc_ns->invalidations);
+#else
+    LOCK(apc_ns->lock);
+    apc_ns->gens[i]++;
+    apc_ns->invalidations++;
+    UNLOCK(apc_ns->lock);
+#endif
+    return 1;
+}
+/* }}} */
+
+/* {{{ apc_ns_info */
+void apc_ns_info(zval* info TSRMLS_DC)
+{
+    if (!apc_ns) {
+        return;
+    }
+    add_assoc_long(info, "namespace_invalidations", apc_ns->invalidations);
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
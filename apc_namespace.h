@@ -0,0 +1,89 @@
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+ */
+
+/* $Id$ */
+
+#ifndef APC_NAMESPACE_H
+#define APC_NAMESPACE_H
+
+#include "apc.h"
+#include "apc_lock.h"
+
+/*
+ * Namespace generations for the user cache.
+ *
+ * With apc.namespace_separator set, the part of a user key before the first
+ * separator names its namespace. Every namespace has a generation, and an
+ * entry remembers the one it was stored under, so bumping the generation
+ * invalidates all entries of the namespace at once. Lookups take such
+ * entries for expired; removing them is left to lookups, stores of the same
+ * key and expunges.
+ *
+ * Generations are kept by namespace hash in a fixed table. Namespaces with
+ * the same hash share a generation, invalidating one at worst drops the
+ * entries of the other as well.
+ */
+
+/* {{{ struct definition: apc_ns_t */
+typedef struct apc_ns_t apc_ns_t;
+struct apc_ns_t {
+    apc_lck_t lock;                 /* guards the generations without atomic operations */
+    unsigned long invalidations;    /* generations bumped so far */
+    int num_entries;                /* size of gens, a power of two */
+    unsigned long gens[1];          /* generation by namespace hash */
+};
+/* }}} */
+
+extern apc_ns_t* apc_ns;
+
+/* a user entry whose namespace was invalidated since it was stored */
+#define APC_NS_STALE(e) \
+    ((e)->data.user.ns && (e)->data.user.ns_gen != apc_ns->gens[(e)->data.user.ns - 1])
+
+/*
+ * apc_ns_init allocates the shared generation table, once, from the module
+ * init of the parent process. num_entries is rounded up to a power of two.
+ */
+extern void apc_ns_init(int num_entries TSRMLS_DC);
+
+/*
+ * apc_ns_lookup returns the namespace of a user key, or 0 when it has none,
+ * and sets *gen to the namespace's current generation.
+ */
+extern unsigned int apc_ns_lookup(const char* key, int keylen, unsigned long* gen TSRMLS_DC);
+
+/*
+ * apc_ns_invalidate bumps the generation of the namespace ns names,
+ * returning 0 when namespaces are not enabled.
+ */
+extern int apc_ns_invalidate(const char* ns, int ns_len TSRMLS_DC);
+
+/*
+ * apc_ns_info adds the namespace counters to an apc_cache_info() array.
+ */
+extern void apc_ns_info(zval* info TSRMLS_DC);
+
+#endif
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim>600: expandtab sw=4 ts=4 sts=4 fdm=marker
+ * vim<600: expandtab sw=4 ts=4 sts=4
+ */
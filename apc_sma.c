@@ -42,6 +42,16 @@
 #include <valgrind/memcheck.h>
 #endif
 
+/* magazines keep blocks per process, which needs processes and fork hooks */
+#if !defined(ZTS) && !defined(PHP_WIN32) && defined(HAVE_PTHREAD_ATFORK)
+# include <signal.h>
+# include <errno.h>
+# include <pthread.h>
+# define SMA_MAGAZINES 1
+#else
+# define SMA_MAGAZINES 0
+#endif
+
 enum { DEFAULT_NUMSEG=1, DEFAULT_SEGSIZE=30*1024*1024 };
 
 static int sma_initialized = 0;     /* true if the sma has been initialized */
@@ -49,16 +59,7 @@ static uint sma_numseg;     /* number of shm segments to allow */
 static size_t sma_segsize;          /* size of each shm segment */
 static apc_segment_t* sma_segments; /* array of shm segments */
 static int sma_lastseg = 0;         /* index of MRU segment */
-
-typedef struct sma_header_t sma_header_t;
-struct sma_header_t {
-    apc_lck_t sma_lock;     /* segment lock, MUST BE ALIGNED for futex locks */
-    size_t segsize;         /* size of entire segment */
-    size_t avail;           /* bytes available (not necessarily contiguous) */
-#if ALLOC_DISTRIBUTION
-    size_t adist[30];
-#endif
-};
+static int sma_placement = APC_SMA_PLACE_MRU;  /* how the first segment to try is picked */
 
 #define SMA_HDR(i)  ((sma_header_t*)((sma_segments[i]).shmaddr))
 #define SMA_ADDR(i) ((char*)(SMA_HDR(i)))
@@ -93,6 +94,31 @@ struct block_t {
 #endif
 };
 
+/* {{{ size classes
+ * Free blocks are kept on one list per size class. Below SMA_SMALL_SIZE the
+ * classes are 16 bytes apart, above it each power of two is split into
+ * four. The last class also takes all larger blocks, from 56GB on. */
+#define SMA_NUM_BINS     128
+#define SMA_SMALL_SHIFT  8
+#define SMA_SMALL_SIZE   (1 << SMA_SMALL_SHIFT)
+#define SMA_SMALL_BINS   (SMA_SMALL_SIZE >> 4)
+/* blocks looked at in the class of a request before taking a larger class */
+#define SMA_BIN_SEARCH   8
+/* }}} */
+
+typedef struct sma_header_t sma_header_t;
+struct sma_header_t {
+    apc_lck_t sma_lock;     /* segment lock, MUST BE ALIGNED for futex locks */
+    size_t segsize;         /* size of entire segment */
+    size_t avail;           /* bytes available (not necessarily contiguous) */
+    unsigned int binmap[SMA_NUM_BINS / 32];  /* bit b is set while bins[b] has a free block */
+    block_t bins[SMA_NUM_BINS];  /* heads of the circular free lists of each size class */
+    size_t mags;            /* offset of the magazine records, 0 without magazines */
+#if ALLOC_DISTRIBUTION
+    size_t adist[30];
+#endif
+};
+
 /* The macros BLOCKAT and OFFSET are used for convenience throughout this
  * module. Both assume the presence of a variable shmaddr that points to the
  * beginning of the shared memory segment in question. */
@@ -119,39 +145,170 @@ struct block_t {
 #define MINBLOCKSIZE (ALIGNWORD(1) + ALIGNWORD(sizeof(block_t)))
 /* }}} */
 
+/* {{{ sma_log2: index of the highest bit set in size */
+static inline int sma_log2(size_t size)
+{
+#if defined(__GNUC__)
+    return (int)(sizeof(unsigned long long) * CHAR_BIT) - 1 - __builtin_clzll((unsigned long long) size);
+#else
+    int n = 0;
+
+    while (size >>= 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+/* }}} */
+
+/* {{{ sma_ctz */
+static inline int sma_ctz(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int n = 0;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+/* }}} */
+
+/* {{{ sma_bin: the size class of a block of size bytes */
+static inline int sma_bin(size_t size)
+{
+    int f, b;
+
+    if (size < SMA_SMALL_SIZE) {
+        return (int)(size >> 4);
+    }
+    f = sma_log2(size);
+    b = SMA_SMALL_BINS + ((f - SMA_SMALL_SHIFT) << 2) + (int)((size >> (f - 2)) & 3);
+    return b < SMA_NUM_BINS ? b : SMA_NUM_BINS - 1;
+}
+/* }}} */
+
+/* {{{ sma_next_bin: the first class from b on that has a free block, -1 if none has */
+static inline int sma_next_bin(sma_header_t* header, int b)
+{
+    int w = b >> 5;
+    unsigned int mask;
+
+    if (b >= SMA_NUM_BINS) {
+        return -1;
+    }
+    mask = header->binmap[w] & (~0U << (b & 31));
+    while (!mask) {
+        if (++w == SMA_NUM_BINS / 32) {
+            return -1;
+        }
+        mask = header->binmap[w];
+    }
+    return (w << 5) + sma_ctz(mask);
+}
+/* }}} */
+
+/* {{{ sma_link: puts a free block at the head of the list of its class */
+static inline void sma_link(sma_header_t* header, block_t* cur)
+{
+    void* shmaddr = header;
+    int b = sma_bin(cur->size);
+    block_t* head = &header->bins[b];
+
+    cur->fnext = head->fnext;
+    cur->fprev = OFFSET(head);
+    BLOCKAT(head->fnext)->fprev = OFFSET(cur);
+    head->fnext = OFFSET(cur);
+    header->binmap[b >> 5] |= 1U << (b & 31);
+}
+/* }}} */
+
+/* {{{ sma_unlink: takes a free block off its list, before its size changes */
+static inline void sma_unlink(sma_header_t* header, block_t* cur)
+{
+    void* shmaddr = header;
+
+    BLOCKAT(cur->fnext)->fprev = cur->fprev;
+    BLOCKAT(cur->fprev)->fnext = cur->fnext;
+    if (cur->fnext == cur->fprev) {
+        /* both were the head, the class is empty now */
+        int b = sma_bin(cur->size);
+        header->binmap[b >> 5] &= ~(1U << (b & 31));
+    }
+}
+/* }}} */
+
+/* {{{ sma_find_block: a free block of at least realsize bytes, NULL if there is none */
+static APC_HOTSPOT block_t* sma_find_block(sma_header_t* header, size_t realsize)
+{
+    void* shmaddr = header;
+    int b = sma_bin(realsize);
+    block_t* head = &header->bins[b];
+    block_t* cur = BLOCKAT(head->fnext);
+    int n;
+
+    /* the class of realsize also holds blocks a little smaller than it */
+    for (n = 0; cur != head && n < SMA_BIN_SEARCH; n++) {
+        if (cur->size >= realsize) {
+            return cur;
+        }
+        cur = BLOCKAT(cur->fnext);
+    }
+
+    /* any block of a larger class fits */
+    n = sma_next_bin(header, b + 1);
+    if (n >= 0) {
+        return BLOCKAT(header->bins[n].fnext);
+    }
+
+    for (; cur != head; cur = BLOCKAT(cur->fnext)) {
+        if (cur->size >= realsize) {
+            return cur;
+        }
+    }
+    return NULL;
+}
+/* }}} */
+
 #if 0
 /* {{{ sma_debug_state(apc_sma_segment_t *segment, int canary_check, int verbose)
  *        useful for debuging state of memory blocks and free list, and sanity checking
  */
 static void sma_debug_state(void* shmaddr, int canary_check, int verbose TSRMLS_DC) {
     sma_header_t *header = (sma_header_t*)shmaddr;
-    block_t *cur = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
-    block_t *prv = NULL;
-    size_t avail;
+    block_t *cur;
+    block_t *prv;
+    size_t avail = 0;
+    int b;
 
-    /* Verify free list */
+    /* Verify free lists */
     if (verbose) apc_warning("Free List: " TSRMLS_CC);
-    while(1) {
-        if (verbose) apc_warning(" 0x%x[%d] (s%d)" TSRMLS_CC, cur, OFFSET(cur), cur->size);
-        if (canary_check) CHECK_CANARY(cur);
-        if (!cur->fnext) break;
-        cur = BLOCKAT(cur->fnext);
-        avail += cur->size;
-        if (prv == cur) {
-            apc_warning("Circular list detected!" TSRMLS_CC);
-            assert(0);
-        }
-        if (prv && cur->fprev != OFFSET(prv)) {
-            apc_warning("Previous pointer does not point to previous!" TSRMLS_CC);
-            assert(0);
+    for (b = 0; b < SMA_NUM_BINS; b++) {
+        block_t *head = &header->bins[b];
+        assert(!(head->fnext == OFFSET(head)) == !!(header->binmap[b >> 5] & (1U << (b & 31))));
+        prv = head;
+        for (cur = BLOCKAT(head->fnext); cur != head; cur = BLOCKAT(cur->fnext)) {
+            if (verbose) apc_warning(" 0x%x[%d] (s%d)" TSRMLS_CC, cur, OFFSET(cur), cur->size);
+            if (canary_check) CHECK_CANARY(cur);
+            assert(sma_bin(cur->size) == b);
+            avail += cur->size;
+            if (cur->fprev != OFFSET(prv)) {
+                apc_warning("Previous pointer does not point to previous!" TSRMLS_CC);
+                assert(0);
+            }
+            prv = cur;
         }
-        prv = cur;
     }
     assert(avail == header->avail);
 
     /* Verify each block */
     if (verbose) apc_warning("Block List: " TSRMLS_CC);
     cur = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
+    prv = NULL;
     while(1) {
         if(!cur->fnext) {
             if (verbose) apc_warning(" 0x%x[%d] (s%d) (u)" TSRMLS_CC, cur, OFFSET(cur), cur->size);
@@ -159,12 +316,8 @@ static void sma_debug_state(void* shmaddr, int canary_check, int verbose TSRMLS_
             if (verbose) apc_warning(" 0x%x[%d] (s%d) (f)" TSRMLS_CC, cur, OFFSET(cur), cur->size);
         }
         if (canary_check) CHECK_CANARY(cur);
-        if (!cur->size && !cur->fnext) break;
-        if (!cur->size) {
-            cur = BLOCKAT(OFFSET(cur) + ALIGNWORD(sizeof(block_t)));
-        } else {
-            cur = NEXT_SBLOCK(cur);
-        }
+        if (!cur->size) break;
+        cur = NEXT_SBLOCK(cur);
         if (prv == cur) {
             apc_warning("Circular list detected!" TSRMLS_CC);
             assert(0);
@@ -175,63 +328,45 @@ static void sma_debug_state(void* shmaddr, int canary_check, int verbose TSRMLS_
 /* }}} */
 #endif
 
-/* {{{ sma_allocate: tries to allocate at least size bytes in a segment */
-static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, size_t size, size_t fragment, size_t *allocated)
+/* {{{ sma_find_fit: a free block of at least realsize bytes and less than limit,
+ * which is not next to the block at avoid, NULL if there is none */
+static block_t* sma_find_fit(sma_header_t* header, size_t realsize, size_t limit, block_t* avoid)
 {
-    void* shmaddr;          /* header of shared memory segment */
-    block_t* prv;           /* block prior to working block */
-    block_t* cur;           /* working block in list */
-    block_t* prvnextfit;    /* block before next fit */
-    size_t realsize;        /* actual size of block needed, including header */
-    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
-
-    realsize = ALIGNWORD(size + block_size);
-
-    /*
-     * First, insure that the segment contains at least realsize free bytes,
-     * even if they are not contiguous.
-     */
-    shmaddr = header;
-
-    if (header->avail < realsize) {
-        return -1;
-    }
-
-    prvnextfit = 0;     /* initially null (no fit) */
-    prv = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
-    CHECK_CANARY(prv);
-
-    while (prv->fnext != 0) {
-        cur = BLOCKAT(prv->fnext);
-#ifdef __APC_SMA_DEBUG__
-        CHECK_CANARY(cur);
-#endif
-        /* If it can fit realsize bytes in cur block, stop searching */
-        if (cur->size >= realsize) {
-            prvnextfit = prv;
-            break;
+    void* shmaddr = header;
+    int b;
+
+    for (b = sma_next_bin(header, sma_bin(realsize)); b >= 0 && b <= sma_bin(limit - 1); b = sma_next_bin(header, b + 1)) {
+        block_t* head = &header->bins[b];
+        block_t* cur = BLOCKAT(head->fnext);
+        int n;
+
+        for (n = 0; cur != head && n < SMA_BIN_SEARCH; n++) {
+            if (cur->size >= realsize && cur->size < limit &&
+                cur != NEXT_SBLOCK(avoid) && NEXT_SBLOCK(cur) != avoid) {
+                return cur;
+            }
+            cur = BLOCKAT(cur->fnext);
         }
-        prv = cur;
-    }
-
-    if (prvnextfit == 0) {
-        return -1;
     }
+    return NULL;
+}
+/* }}} */
 
-    prv = prvnextfit;
-    cur = BLOCKAT(prv->fnext);
+/* {{{ sma_carve: hands out realsize bytes (size asked for) of the free block cur, or all of it */
+static APC_HOTSPOT size_t sma_carve(sma_header_t* header, block_t* cur, size_t realsize, size_t size, size_t fragment, size_t *allocated)
+{
+    void* shmaddr = header;
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
 
-    CHECK_CANARY(prv);
     CHECK_CANARY(cur);
+    sma_unlink(header, cur);
 
     if (cur->size == realsize || (cur->size > realsize && cur->size < (realsize + (MINBLOCKSIZE + fragment)))) {
-        /* cur is big enough for realsize, but too small to split - unlink it */
+        /* cur is big enough for realsize, but too small to split */
         *(allocated) = cur->size - block_size;
-        prv->fnext = cur->fnext;
-        BLOCKAT(cur->fnext)->fprev = OFFSET(prv);
         NEXT_SBLOCK(cur)->prev_size = 0;  /* block is alloc'd */
     } else {
-        /* nextfit is too big; split it into two smaller blocks */
+        /* cur is too big; split it into two smaller blocks */
         block_t* nxt;      /* the new block (chopped part of cur) */
         size_t oldsize;    /* size of cur before split */
 
@@ -244,11 +379,8 @@ static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, size_t size, size_t
         NEXT_SBLOCK(nxt)->prev_size = nxt->size;  /* adjust size */
         SET_CANARY(nxt);
 
-        /* replace cur with next in free list */
-        nxt->fnext = cur->fnext;
-        nxt->fprev = cur->fprev;
-        BLOCKAT(nxt->fnext)->fprev = OFFSET(nxt);
-        BLOCKAT(nxt->fprev)->fnext = OFFSET(nxt);
+        /* the rest goes to the list of its own class */
+        sma_link(header, nxt);
 #ifdef __APC_SMA_DEBUG__
         nxt->id = -1;
 #endif
@@ -272,6 +404,31 @@ static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, size_t size, size_t
 }
 /* }}} */
 
+/* {{{ sma_allocate: tries to allocate at least size bytes in a segment */
+static APC_HOTSPOT size_t sma_allocate(sma_header_t* header, size_t size, size_t fragment, size_t *allocated)
+{
+    block_t* cur;           /* block handed out */
+    size_t realsize;        /* actual size of block needed, including header */
+
+    realsize = ALIGNWORD(size + ALIGNWORD(sizeof(struct block_t)));
+
+    /*
+     * First, insure that the segment contains at least realsize free bytes,
+     * even if they are not contiguous.
+     */
+    if (header->avail < realsize) {
+        return -1;
+    }
+
+    cur = sma_find_block(header, realsize);
+    if (cur == NULL) {
+        return -1;
+    }
+
+    return sma_carve(header, cur, realsize, size, fragment, allocated);
+}
+/* }}} */
+
 /* {{{ sma_deallocate: deallocates the block at the given offset */
 static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
 {
@@ -293,10 +450,9 @@ static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
     size = cur->size;
 
     if (cur->prev_size != 0) {
-        /* remove prv from list */
+        /* remove prv from its list */
         prv = PREV_SBLOCK(cur);
-        BLOCKAT(prv->fnext)->fprev = prv->fprev;
-        BLOCKAT(prv->fprev)->fnext = prv->fnext;
+        sma_unlink(header, prv);
         /* cur and prv share an edge, combine them */
         prv->size +=cur->size;
         RESET_CANARY(cur);
@@ -307,8 +463,7 @@ static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
     if (nxt->fnext != 0) {
         assert(NEXT_SBLOCK(NEXT_SBLOCK(cur))->prev_size == nxt->size);
         /* cur and nxt shared an edge, combine them */
-        BLOCKAT(nxt->fnext)->fprev = nxt->fprev;
-        BLOCKAT(nxt->fprev)->fnext = nxt->fnext;
+        sma_unlink(header, nxt);
         cur->size += nxt->size;
 #ifdef __APC_SMA_DEBUG__
         CHECK_CANARY(nxt);
@@ -319,17 +474,356 @@ static APC_HOTSPOT size_t sma_deallocate(void* shmaddr, size_t offset)
 
     NEXT_SBLOCK(cur)->prev_size = cur->size;
 
-    /* insert new block after prv */
-    prv = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
-    cur->fnext = prv->fnext;
-    prv->fnext = OFFSET(cur);
-    cur->fprev = OFFSET(prv);
-    BLOCKAT(cur->fnext)->fprev = OFFSET(cur);
+    sma_link(header, cur);
 
     return size;
 }
 /* }}} */
 
+/* {{{ sma_reallocate: resizes the used block at the given offset to hold size
+ * bytes where it is, taking from or giving back to the block after it */
+static size_t sma_reallocate(sma_header_t* header, size_t offset, size_t size, size_t *allocated)
+{
+    void* shmaddr = header;
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+    size_t realsize = ALIGNWORD(size + block_size);
+    block_t* cur = BLOCKAT(offset - block_size);
+    block_t* nxt = NEXT_SBLOCK(cur);
+
+    CHECK_CANARY(cur);
+
+    if (realsize > cur->size) {
+        /* growing takes the block after cur, which has to be free and large enough */
+        if (!nxt->fnext || cur->size + nxt->size < realsize) {
+            return -1;
+        }
+        CHECK_CANARY(nxt);
+        sma_unlink(header, nxt);
+        header->avail -= nxt->size;
+        cur->size += nxt->size;
+        RESET_CANARY(nxt);
+#ifdef __APC_SMA_DEBUG__
+        nxt->id = -1;
+#endif
+        nxt = NEXT_SBLOCK(cur);
+        nxt->prev_size = 0;  /* block is alloc'd */
+    }
+
+    if (cur->size >= realsize + MINBLOCKSIZE + MINBLOCKSIZE) {
+        /* the tail is worth a block of its own; the block after it is never
+         * free here, unless it was free from the start and cur shrinks */
+        block_t* rest;
+
+        rest = (block_t*) ((char*) cur + realsize);
+        rest->size = cur->size - realsize;
+        rest->prev_size = 0;  /* cur is alloc'd */
+        cur->size = realsize;
+        header->avail += rest->size;
+        SET_CANARY(rest);
+#ifdef __APC_SMA_DEBUG__
+        rest->id = -1;
+#endif
+
+        if (nxt->fnext) {
+            sma_unlink(header, nxt);
+            rest->size += nxt->size;
+            RESET_CANARY(nxt);
+        }
+        NEXT_SBLOCK(rest)->prev_size = rest->size;
+        sma_link(header, rest);
+    }
+
+    *(allocated) = cur->size - block_size;
+    return offset;
+}
+/* }}} */
+
+#if SMA_MAGAZINES
+/* {{{ magazines
+ * A process keeps some of the blocks it frees, a lane of them per block size,
+ * and hands them out again without taking the segment lock. A lane that runs
+ * dry takes SMA_MAG_BATCH blocks at once. The blocks stay allocated as far as
+ * the segment is concerned and are chained through their fprev; the records
+ * live in the segment so that those of a process which died without its
+ * shutdown can be taken back. */
+#define SMA_MAG_RECORDS  256
+#define SMA_MAG_LANES    8
+#define SMA_MAG_BATCH    8
+#define SMA_MAG_MAX_SIZE 16384
+
+typedef struct sma_lane_t sma_lane_t;
+struct sma_lane_t {
+    size_t size;            /* size of the blocks of this lane, 0 if unused */
+    size_t head;            /* offset of the first block, 0 if empty */
+    unsigned int count;     /* blocks on the lane */
+};
+
+typedef struct sma_magazine_t sma_magazine_t;
+struct sma_magazine_t {
+    volatile long owner;    /* pid of the process the record belongs to, 0 if free */
+    size_t held;            /* bytes on all lanes */
+    sma_lane_t lanes[SMA_MAG_LANES];
+};
+
+#define SMA_MAGS(header) ((sma_magazine_t*)((char*)(header) + (header)->mags))
+
+static sma_magazine_t** sma_mags = NULL;  /* the record of this process, per segment */
+static pid_t sma_pid = 0;                 /* getpid() would be a system call every time */
+/* }}} */
+
+/* {{{ sma_forked: a child starts without records */
+static void sma_forked(void)
+{
+    uint i;
+
+    sma_pid = 0;
+    if (sma_mags) {
+        for (i = 0; i < sma_numseg; i++) {
+            sma_mags[i] = NULL;
+        }
+    }
+}
+/* }}} */
+
+/* {{{ sma_owner */
+static inline long sma_owner(void)
+{
+    if (!sma_pid) {
+        sma_pid = getpid();
+    }
+    return (long) sma_pid;
+}
+/* }}} */
+
+/* {{{ sma_mag_push */
+static inline void sma_mag_push(void* shmaddr, sma_magazine_t* mag, sma_lane_t* lane, block_t* cur)
+{
+    /* linked before it is counted, so a reaper finds all blocks of a dead owner */
+    cur->fprev = lane->head;
+    lane->head = OFFSET(cur);
+    lane->count++;
+    mag->held += cur->size;
+}
+/* }}} */
+
+/* {{{ sma_mag_flush: gives all blocks of a lane but keep back, under the segment lock */
+static void sma_mag_flush(sma_header_t* header, sma_magazine_t* mag, sma_lane_t* lane, unsigned int keep)
+{
+    void* shmaddr = header;
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+
+    while (lane->head && (!keep || lane->count > keep)) {
+        block_t* cur = BLOCKAT(lane->head);
+
+        lane->head = cur->fprev;
+        lane->count--;
+        mag->held -= cur->size;
+        sma_deallocate(shmaddr, OFFSET(cur) + block_size);
+    }
+    if (!lane->head) {
+        lane->count = 0;
+    }
+}
+/* }}} */
+
+/* {{{ sma_mag_reap: takes back the blocks of processes that died and those of
+ * this process, under the segment lock, before a failed allocation expunges */
+static int sma_mag_reap(sma_header_t* header)
+{
+    sma_magazine_t* mags;
+    long self = sma_owner();
+    int i, j, reaped = 0;
+
+    if (!header->mags) {
+        return 0;
+    }
+    mags = SMA_MAGS(header);
+    for (i = 0; i < SMA_MAG_RECORDS; i++) {
+        sma_magazine_t* mag = &mags[i];
+
+        if (mag->owner == self) {
+            /* the record stays ours, only the lanes go */
+            if (mag->held) {
+                for (j = 0; j < SMA_MAG_LANES; j++) {
+                    sma_mag_flush(header, mag, &mag->lanes[j], 0);
+                }
+                reaped = 1;
+            }
+            continue;
+        }
+        if (!mag->owner || kill((pid_t) mag->owner, 0) == 0 || errno != ESRCH) {
+            continue;
+        }
+        for (j = 0; j < SMA_MAG_LANES; j++) {
+            sma_mag_flush(header, mag, &mag->lanes[j], 0);
+        }
+        mag->held = 0;
+        mag->owner = 0;
+        reaped = 1;
+    }
+    return reaped;
+}
+/* }}} */
+
+/* {{{ sma_mag_claim: a record for this process, under the segment lock */
+static sma_magazine_t* sma_mag_claim(sma_header_t* header)
+{
+    sma_magazine_t* mags = SMA_MAGS(header);
+    int i, pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1 && !sma_mag_reap(header)) {
+            break;
+        }
+        for (i = 0; i < SMA_MAG_RECORDS; i++) {
+            if (!mags[i].owner) {
+                memset(&mags[i], 0, sizeof(sma_magazine_t));
+                mags[i].owner = sma_owner();
+                return &mags[i];
+            }
+        }
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ sma_mag_lane: the lane of blocks of size, an unused one if claim is set */
+static inline sma_lane_t* sma_mag_lane(sma_magazine_t* mag, size_t size, int claim)
+{
+    sma_lane_t* empty = NULL;
+    int i;
+
+    for (i = 0; i < SMA_MAG_LANES; i++) {
+        if (mag->lanes[i].size == size) {
+            return &mag->lanes[i];
+        }
+        if (!empty && !mag->lanes[i].count) {
+            empty = &mag->lanes[i];
+        }
+    }
+    if (claim && empty) {
+        empty->size = size;
+        empty->head = 0;
+        return empty;
+    }
+    return NULL;
+}
+/* }}} */
+
+/* {{{ sma_mag_alloc: a block of segment seg from the magazine of this process, NULL to allocate as usual */
+static void* sma_mag_alloc(int seg, size_t n, size_t* allocated TSRMLS_DC)
+{
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+    size_t realsize = ALIGNWORD(n + block_size);
+    sma_header_t* header = SMA_HDR(seg);
+    void* shmaddr = header;
+    sma_magazine_t* mag = sma_mags[seg];
+    sma_lane_t* lane = NULL;
+    block_t* cur;
+
+    /* not before the first request: a parent would keep what it took in
+     * MINIT until MSHUTDOWN, out of reach of the children it forks */
+    if (realsize > SMA_MAG_MAX_SIZE || !header->mags || !APCG(initialized)) {
+        return NULL;
+    }
+    if (mag) {
+        lane = sma_mag_lane(mag, realsize, 0);
+    }
+
+    if (!lane || !lane->count) {
+        size_t room, off, got;
+        int k = 0;
+
+        LOCK(SMA_LCK(seg));
+        if (!mag) {
+            mag = sma_mags[seg] = sma_mag_claim(header);
+        }
+        if (mag && (lane = sma_mag_lane(mag, realsize, 1)) != NULL) {
+            room = (size_t) APCG(sma_magazine_size) > mag->held ? (size_t) APCG(sma_magazine_size) - mag->held : 0;
+            k = room / realsize < SMA_MAG_BATCH ? (int) (room / realsize) : SMA_MAG_BATCH;
+        }
+        for (; k > 0; k--) {
+            off = sma_allocate(header, n, 0, &got);
+            if (off == -1) {
+                break;
+            }
+            sma_mag_push(shmaddr, mag, lane, BLOCKAT(off - block_size));
+        }
+        UNLOCK(SMA_LCK(seg));
+
+        if (!lane || !lane->count) {
+            return NULL;
+        }
+    }
+
+    cur = BLOCKAT(lane->head);
+    CHECK_CANARY(cur);
+    lane->head = cur->fprev;
+    lane->count--;
+    mag->held -= cur->size;
+    *(allocated) = cur->size - block_size;
+    return (char*) cur + block_size;
+}
+/* }}} */
+
+/* {{{ sma_mag_free: keeps a block of segment seg in the magazine, 0 to free it as usual */
+static int sma_mag_free(int seg, void* p TSRMLS_DC)
+{
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+    sma_header_t* header = SMA_HDR(seg);
+    void* shmaddr = header;
+    sma_magazine_t* mag = sma_mags[seg];
+    block_t* cur = (block_t*) ((char*) p - block_size);
+    sma_lane_t* lane;
+
+    if (!mag || cur->size > SMA_MAG_MAX_SIZE || (lane = sma_mag_lane(mag, cur->size, 1)) == NULL) {
+        return 0;
+    }
+
+    if (mag->held + cur->size > (size_t) APCG(sma_magazine_size)) {
+        /* over the limit, half of the lane goes back with the block */
+        LOCK(SMA_LCK(seg));
+        sma_mag_flush(header, mag, lane, lane->count / 2);
+        sma_deallocate(shmaddr, OFFSET(cur) + block_size);
+        UNLOCK(SMA_LCK(seg));
+        return 1;
+    }
+
+    sma_mag_push(shmaddr, mag, lane, cur);
+    return 1;
+}
+/* }}} */
+#endif
+
+/* {{{ apc_sma_release_magazines */
+void apc_sma_release_magazines(TSRMLS_D)
+{
+#if SMA_MAGAZINES
+    uint i;
+    int j;
+
+    if (!sma_initialized || !sma_mags) {
+        return;
+    }
+    for (i = 0; i < sma_numseg; i++) {
+        sma_magazine_t* mag = sma_mags[i];
+
+        if (!mag) {
+            continue;
+        }
+        LOCK(SMA_LCK(i));
+        for (j = 0; j < SMA_MAG_LANES; j++) {
+            sma_mag_flush(SMA_HDR(i), mag, &mag->lanes[j], 0);
+        }
+        mag->held = 0;
+        mag->owner = 0;
+        UNLOCK(SMA_LCK(i));
+        sma_mags[i] = NULL;
+    }
+#endif
+}
+/* }}} */
+
 /* {{{ apc_sma_init */
 
 void apc_sma_init(int numseg, size_t segsize, char *mmap_file_mask TSRMLS_DC)
@@ -363,8 +857,9 @@ void apc_sma_init(int numseg, size_t segsize, char *mmap_file_mask TSRMLS_DC)
 
     for (i = 0; i < sma_numseg; i++) {
         sma_header_t*   header;
-        block_t     *first, *empty, *last;
+        block_t     *empty, *last;
         void*       shmaddr;
+        int         j;
 
 #if APC_MMAP
         sma_segments[i] = apc_mmap(mmap_file_mask, sma_segsize TSRMLS_CC);
@@ -380,41 +875,64 @@ void apc_sma_init(int numseg, size_t segsize, char *mmap_file_mask TSRMLS_DC)
         header = (sma_header_t*) shmaddr;
         apc_lck_create(NULL, 0, 1, header->sma_lock);
         header->segsize = sma_segsize;
-        header->avail = sma_segsize - ALIGNWORD(sizeof(sma_header_t)) - ALIGNWORD(sizeof(block_t)) - ALIGNWORD(sizeof(block_t));
+        header->avail = sma_segsize - ALIGNWORD(sizeof(sma_header_t)) - ALIGNWORD(sizeof(block_t));
 #if ALLOC_DISTRIBUTION
-        {
-           int j;
-           for(j=0; j<30; j++) header->adist[j] = 0;
-        }
-#endif
-        first = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
-        first->size = 0;
-        first->fnext = ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t));
-        first->fprev = 0;
-        first->prev_size = 0;
-        SET_CANARY(first);
-#ifdef __APC_SMA_DEBUG__
-        first->id = -1;
+        for(j=0; j<30; j++) header->adist[j] = 0;
 #endif
-        empty = BLOCKAT(first->fnext);
-        empty->size = header->avail - ALIGNWORD(sizeof(block_t));
-        empty->fnext = OFFSET(empty) + empty->size;
-        empty->fprev = ALIGNWORD(sizeof(sma_header_t));
+        for (j = 0; j < SMA_NUM_BINS; j++) {
+            block_t* head = &header->bins[j];
+            head->size = 0;
+            head->prev_size = 0;
+            head->fnext = OFFSET(head);
+            head->fprev = OFFSET(head);
+            SET_CANARY(head);
+        }
+        memset(header->binmap, 0, sizeof(header->binmap));
+
+        empty = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
+        empty->size = header->avail;
         empty->prev_size = 0;
         SET_CANARY(empty);
 #ifdef __APC_SMA_DEBUG__
         empty->id = -1;
 #endif
-        last = BLOCKAT(empty->fnext);
+        sma_link(header, empty);
+
+        last = NEXT_SBLOCK(empty);
         last->size = 0;
         last->fnext = 0;
-        last->fprev =  OFFSET(empty);
+        last->fprev = 0;
         last->prev_size = empty->size;
         SET_CANARY(last);
 #ifdef __APC_SMA_DEBUG__
         last->id = -1;
 #endif
+
+        header->mags = 0;
+#if SMA_MAGAZINES
+        if (APCG(sma_magazine_size) > 0) {
+            size_t got, off = sma_allocate(header, SMA_MAG_RECORDS * sizeof(sma_magazine_t), 0, &got);
+
+            if (off != -1) {
+                header->mags = off;
+                memset(SMA_MAGS(header), 0, SMA_MAG_RECORDS * sizeof(sma_magazine_t));
+            }
+        }
+#endif
+    }
+
+#if SMA_MAGAZINES
+    sma_mags = (sma_magazine_t**) apc_emalloc(sma_numseg * sizeof(sma_magazine_t*) TSRMLS_CC);
+    memset(sma_mags, 0, sma_numseg * sizeof(sma_magazine_t*));
+    {
+        static int hooked = 0;
+
+        if (!hooked) {
+            pthread_atfork(NULL, NULL, sma_forked);
+            hooked = 1;
+        }
     }
+#endif
 }
 /* }}} */
 
@@ -435,6 +953,54 @@ void apc_sma_cleanup(TSRMLS_D)
     }
     sma_initialized = 0;
     apc_efree(sma_segments TSRMLS_CC);
+#if SMA_MAGAZINES
+    apc_efree(sma_mags TSRMLS_CC);
+    sma_mags = NULL;
+#endif
+}
+/* }}} */
+
+/* {{{ apc_sma_set_placement */
+void apc_sma_set_placement(int placement)
+{
+    sma_placement = placement;
+}
+/* }}} */
+
+/* {{{ sma_home: the segment an allocation tries first */
+static int sma_home(TSRMLS_D)
+{
+    static uint turn = 0;
+    unsigned long h;
+    uint a, b;
+
+    if (sma_placement == APC_SMA_PLACE_MRU || sma_numseg == 1) {
+        return sma_lastseg;
+    }
+
+    /* of two segments, the one with more room, which keeps the segments
+     * evenly used while writers still spread over the locks: for a key
+     * both come from its hash, a process has its own and goes round the
+     * others for the second */
+    if (sma_placement == APC_SMA_PLACE_KEY && APCG(sma_hint)) {
+        h = APCG(sma_hint);
+        a = h % sma_numseg;
+        b = (h / sma_numseg) % (sma_numseg - 1);
+    } else {
+#ifdef ZTS
+        h = (unsigned long) tsrm_thread_id();
+#elif SMA_MAGAZINES
+        h = (unsigned long) sma_owner();
+#else
+        h = (unsigned long) getpid();
+#endif
+        a = h % sma_numseg;
+        b = turn++ % (sma_numseg - 1);
+    }
+    if (b >= a) {
+        b++;
+    }
+    return SMA_HDR(b)->avail > SMA_HDR(a)->avail ? b : a;
 }
 /* }}} */
 
@@ -442,57 +1008,84 @@ void apc_sma_cleanup(TSRMLS_D)
 void* apc_sma_malloc_ex(size_t n, size_t fragment, size_t* allocated TSRMLS_DC)
 {
     size_t off;
-    uint i;
+    uint i, seg;
     int nuked = 0;
+    int home = sma_home(TSRMLS_C);
+
+#if SMA_MAGAZINES
+    {
+        void* p = sma_mag_alloc(home, n, allocated TSRMLS_CC);
+
+        if (p) {
+#ifdef VALGRIND_MALLOCLIKE_BLOCK
+            VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
+#endif
+            return p;
+        }
+    }
+#endif
 
 restart:
     assert(sma_initialized);
-    LOCK(SMA_LCK(sma_lastseg));
+    LOCK(SMA_LCK(home));
 
-    off = sma_allocate(SMA_HDR(sma_lastseg), n, fragment, allocated);
+    off = sma_allocate(SMA_HDR(home), n, fragment, allocated);
+
+#if SMA_MAGAZINES
+    if (off == -1 && sma_mag_reap(SMA_HDR(home))) {
+        off = sma_allocate(SMA_HDR(home), n, fragment, allocated);
+    }
+#endif
 
     if(off == -1 && APCG(current_cache)) { 
         /* retry failed allocation after we expunge */
-        UNLOCK(SMA_LCK(sma_lastseg));
+        UNLOCK(SMA_LCK(home));
         APCG(current_cache)->expunge_cb(APCG(current_cache), (n+fragment) TSRMLS_CC);
-        LOCK(SMA_LCK(sma_lastseg));
-        off = sma_allocate(SMA_HDR(sma_lastseg), n, fragment, allocated);
+        LOCK(SMA_LCK(home));
+        off = sma_allocate(SMA_HDR(home), n, fragment, allocated);
     }
 
     if (off != -1) {
-        void* p = (void *)(SMA_ADDR(sma_lastseg) + off);
-        UNLOCK(SMA_LCK(sma_lastseg));
+        void* p = (void *)(SMA_ADDR(home) + off);
+        UNLOCK(SMA_LCK(home));
 #ifdef VALGRIND_MALLOCLIKE_BLOCK
         VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
 #endif
         return p;
     }
     
-    UNLOCK(SMA_LCK(sma_lastseg));
-
-    for (i = 0; i < sma_numseg; i++) {
-        if (i == sma_lastseg) {
-            continue;
+    UNLOCK(SMA_LCK(home));
+
+    /* the others in turn from the one after home, so that processes with
+     * different homes do not all fall back onto the same segment */
+    for (i = 1; i < sma_numseg; i++) {
+        seg = (home + i) % sma_numseg;
+        LOCK(SMA_LCK(seg));
+        off = sma_allocate(SMA_HDR(seg), n, fragment, allocated);
+#if SMA_MAGAZINES
+        if (off == -1 && sma_mag_reap(SMA_HDR(seg))) {
+            off = sma_allocate(SMA_HDR(seg), n, fragment, allocated);
         }
-        LOCK(SMA_LCK(i));
-        off = sma_allocate(SMA_HDR(i), n, fragment, allocated);
+#endif
         if(off == -1 && APCG(current_cache)) { 
             /* retry failed allocation after we expunge */
-            UNLOCK(SMA_LCK(i));
+            UNLOCK(SMA_LCK(seg));
             APCG(current_cache)->expunge_cb(APCG(current_cache), (n+fragment) TSRMLS_CC);
-            LOCK(SMA_LCK(i));
-            off = sma_allocate(SMA_HDR(i), n, fragment, allocated);
+            LOCK(SMA_LCK(seg));
+            off = sma_allocate(SMA_HDR(seg), n, fragment, allocated);
         }
         if (off != -1) {
-            void* p = (void *)(SMA_ADDR(i) + off);
-            UNLOCK(SMA_LCK(i));
-            sma_lastseg = i;
+            void* p = (void *)(SMA_ADDR(seg) + off);
+            UNLOCK(SMA_LCK(seg));
+            if (sma_placement == APC_SMA_PLACE_MRU) {
+                sma_lastseg = seg;
+            }
 #ifdef VALGRIND_MALLOCLIKE_BLOCK
             VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
 #endif
             return p;
         }
-        UNLOCK(SMA_LCK(i));
+        UNLOCK(SMA_LCK(seg));
     }
 
     /* I've tried being nice, but now you're just asking for it */
@@ -519,11 +1112,91 @@ void* apc_sma_malloc(size_t n TSRMLS_DC)
 }
 /* }}} */
 
+/* {{{ apc_sma_malloc_fit */
+void* apc_sma_malloc_fit(size_t n, size_t limit, const void* old TSRMLS_DC)
+{
+    /* unlike apc_sma_malloc this never makes room, so it may be called with
+     * cache locks held, and it skips the magazine, which would not care
+     * where the block is */
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+    size_t realsize = ALIGNWORD(n + block_size);
+    block_t* avoid = (block_t*) ((char*) old - block_size);
+    size_t off, allocated;
+    uint i;
+
+    assert(sma_initialized);
+
+    if (realsize >= limit) {
+        return NULL;
+    }
+
+    for (i = 0; i < sma_numseg; i++) {
+        sma_header_t* header = SMA_HDR(i);
+        block_t* cur;
+
+        if (header->avail < realsize) {
+            continue;
+        }
+        LOCK(SMA_LCK(i));
+        cur = sma_find_fit(header, realsize, limit, avoid);
+        off = cur ? sma_carve(header, cur, realsize, n, MINBLOCKSIZE, &allocated) : -1;
+        UNLOCK(SMA_LCK(i));
+
+        if (off != -1) {
+            void* p = (void *)(SMA_ADDR(i) + off);
+#ifdef VALGRIND_MALLOCLIKE_BLOCK
+            VALGRIND_MALLOCLIKE_BLOCK(p, n, 0, 0);
+#endif
+            return p;
+        }
+    }
+    return NULL;
+}
+/* }}} */
+
 /* {{{ apc_sma_realloc */
 void* apc_sma_realloc(void *p, size_t n TSRMLS_DC)
 {
-    apc_sma_free(p TSRMLS_CC);
-    return apc_sma_malloc(n TSRMLS_CC);
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+    uint i;
+    size_t offset, old, allocated;
+    void* q;
+
+    if (p == NULL) {
+        return apc_sma_malloc(n TSRMLS_CC);
+    }
+
+    assert(sma_initialized);
+
+    for (i = 0; i < sma_numseg; i++) {
+        offset = (size_t)((char *)p - SMA_ADDR(i));
+        if (p >= (void*)SMA_ADDR(i) && offset < sma_segsize) {
+            /* only the owner of p changes the size of its block */
+            old = ((block_t*) ((char*) p - block_size))->size - block_size;
+
+            LOCK(SMA_LCK(i));
+            offset = sma_reallocate(SMA_HDR(i), offset, n, &allocated);
+            UNLOCK(SMA_LCK(i));
+            if (offset != -1) {
+#ifdef VALGRIND_RESIZEINPLACE_BLOCK
+                VALGRIND_RESIZEINPLACE_BLOCK(p, old, n, 0);
+#endif
+                return p;
+            }
+
+            /* no room next to it, p stays valid if there is none elsewhere */
+            q = apc_sma_malloc(n TSRMLS_CC);
+            if (!q) {
+                return NULL;
+            }
+            memcpy(q, p, old < n ? old : n);
+            apc_sma_free(p TSRMLS_CC);
+            return q;
+        }
+    }
+
+    apc_error("apc_sma_realloc: could not locate address %p" TSRMLS_CC, p);
+    return NULL;
 }
 /* }}} */
 
@@ -559,9 +1232,14 @@ void apc_sma_free(void* p TSRMLS_DC)
     for (i = 0; i < sma_numseg; i++) {
         offset = (size_t)((char *)p - SMA_ADDR(i));
         if (p >= (void*)SMA_ADDR(i) && offset < sma_segsize) {
-            LOCK(SMA_LCK(i));
-            sma_deallocate(SMA_HDR(i), offset);
-            UNLOCK(SMA_LCK(i));
+#if SMA_MAGAZINES
+            if (!sma_mag_free(i, p TSRMLS_CC))
+#endif
+            {
+                LOCK(SMA_LCK(i));
+                sma_deallocate(SMA_HDR(i), offset);
+                UNLOCK(SMA_LCK(i));
+            }
 #ifdef VALGRIND_FREELIKE_BLOCK
             VALGRIND_FREELIKE_BLOCK(p, 0);
 #endif
@@ -648,7 +1326,6 @@ apc_sma_info_t* apc_sma_info(zend_bool limited TSRMLS_DC)
     apc_sma_link_t** link;
     uint i;
     char* shmaddr;
-    block_t* prv;
 
     if (!sma_initialized) {
         return NULL;
@@ -656,44 +1333,62 @@ apc_sma_info_t* apc_sma_info(zend_bool limited TSRMLS_DC)
 
     info = (apc_sma_info_t*) apc_emalloc(sizeof(apc_sma_info_t) TSRMLS_CC);
     info->num_seg = sma_numseg;
-    info->seg_size = sma_segsize - (ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t)) + ALIGNWORD(sizeof(block_t)));
+    info->seg_size = sma_segsize - (ALIGNWORD(sizeof(sma_header_t)) + ALIGNWORD(sizeof(block_t)));
 
+    info->seg_avail = apc_emalloc(info->num_seg * sizeof(size_t) TSRMLS_CC);
     info->list = apc_emalloc(info->num_seg * sizeof(apc_sma_link_t*) TSRMLS_CC);
+    info->mag_held = 0;
     for (i = 0; i < sma_numseg; i++) {
+        info->seg_avail[i] = SMA_HDR(i)->avail;
         info->list[i] = NULL;
+#if SMA_MAGAZINES
+        if (SMA_HDR(i)->mags) {
+            sma_magazine_t* mags = SMA_MAGS(SMA_HDR(i));
+            int j;
+
+            /* the owners change held without the lock, this is a snapshot */
+            for (j = 0; j < SMA_MAG_RECORDS; j++) {
+                if (mags[j].owner) {
+                    info->mag_held += mags[j].held;
+                }
+            }
+        }
+#endif
     }
 
     if(limited) return info;
 
     /* For each segment */
     for (i = 0; i < sma_numseg; i++) {
+        sma_header_t* header;
+        int b;
+
         RDLOCK(SMA_LCK(i));
         shmaddr = SMA_ADDR(i);
-        prv = BLOCKAT(ALIGNWORD(sizeof(sma_header_t)));
+        header = (sma_header_t*) shmaddr;
 
         link = &info->list[i];
 
-        /* For each block in this segment */
-        while (BLOCKAT(prv->fnext)->fnext != 0) {
-            block_t* cur = BLOCKAT(prv->fnext);
+        /* For each free block in this segment, by size class */
+        for (b = sma_next_bin(header, 0); b >= 0; b = sma_next_bin(header, b + 1)) {
+            block_t* head = &header->bins[b];
+            block_t* cur;
+
+            for (cur = BLOCKAT(head->fnext); cur != head; cur = BLOCKAT(cur->fnext)) {
 #ifdef __APC_SMA_DEBUG__
-            CHECK_CANARY(cur);
+                CHECK_CANARY(cur);
 #endif
-
-            *link = apc_emalloc(sizeof(apc_sma_link_t) TSRMLS_CC);
-            (*link)->size = cur->size;
-            (*link)->offset = prv->fnext;
-            (*link)->next = NULL;
-            link = &(*link)->next;
-
-            prv = cur;
+                *link = apc_emalloc(sizeof(apc_sma_link_t) TSRMLS_CC);
+                (*link)->size = cur->size;
+                (*link)->offset = OFFSET(cur);
+                (*link)->next = NULL;
+                link = &(*link)->next;
+            }
+        }
 
 #if ALLOC_DISTRIBUTION
-            sma_header_t* header = (sma_header_t*) segment->shmaddr;
-            memcpy(info->seginfo[i].adist, header->adist, sizeof(size_t) * 30);
+        memcpy(info->seginfo[i].adist, header->adist, sizeof(size_t) * 30);
 #endif
-
-        }
         RDUNLOCK(SMA_LCK(i));
     }
 
@@ -714,6 +1409,7 @@ void apc_sma_free_info(apc_sma_info_t* info TSRMLS_DC)
             apc_efree(q TSRMLS_CC);
         }
     }
+    apc_efree(info->seg_avail TSRMLS_CC);
     apc_efree(info->list TSRMLS_CC);
     apc_efree(info TSRMLS_CC);
 }
@@ -733,6 +1429,17 @@ size_t apc_sma_get_avail_mem()
 }
 /* }}} */
 
+/* {{{ apc_sma_get_segment */
+void* apc_sma_get_segment(int i, size_t* size)
+{
+    if (!sma_initialized || i < 0 || (uint) i >= sma_numseg) {
+        return NULL;
+    }
+    *size = sma_segments[i].size;
+    return sma_segments[i].shmaddr;
+}
+/* }}} */
+
 /* {{{ apc_sma_get_avail_size */
 zend_bool apc_sma_get_avail_size(size_t size)
 {
@@ -748,6 +1455,102 @@ zend_bool apc_sma_get_avail_size(size_t size)
 }
 /* }}} */
 
+/* {{{ apc_sma_get_avail_block */
+zend_bool apc_sma_get_avail_block(size_t size TSRMLS_DC)
+{
+    /* unlike apc_sma_get_avail_size, only counts a free block that size
+     * bytes actually fit in */
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+    size_t realsize = ALIGNWORD(size + block_size);
+    zend_bool found = 0;
+    uint i;
+
+    for (i = 0; i < sma_numseg && !found; i++) {
+        sma_header_t* header = SMA_HDR(i);
+
+        if (header->avail < realsize) {
+            continue;
+        }
+        LOCK(SMA_LCK(i));
+        found = sma_find_block(header, realsize) != NULL;
+        UNLOCK(SMA_LCK(i));
+    }
+    return found;
+}
+/* }}} */
+
+/* {{{ apc_sma_get_hole */
+size_t apc_sma_get_hole(const void* p)
+{
+    const size_t block_size = ALIGNWORD(sizeof(struct block_t));
+    size_t hole = 0;
+    uint i;
+
+    for (i = 0; i < sma_numseg; i++) {
+        size_t offset = (size_t)((char *)p - SMA_ADDR(i));
+
+        if (p >= (void*)SMA_ADDR(i) && offset < sma_segsize) {
+            block_t* cur = (block_t*) ((char*) p - block_size);
+            block_t* nxt;
+
+            RDLOCK(SMA_LCK(i));
+            if (cur->prev_size) {
+                hole += cur->prev_size;
+            }
+            nxt = NEXT_SBLOCK(cur);
+            if (nxt->fnext != 0) {
+                hole += nxt->size;
+            }
+            if (hole) {
+                hole += cur->size;
+            }
+            RDUNLOCK(SMA_LCK(i));
+            break;
+        }
+    }
+    return hole;
+}
+/* }}} */
+
+/* {{{ apc_sma_get_fragmentation */
+int apc_sma_get_fragmentation()
+{
+    size_t avail = 0, largest = 0;
+    uint i;
+
+    for (i = 0; i < sma_numseg; i++) {
+        sma_header_t* header = SMA_HDR(i);
+        void* shmaddr = header;
+        int b;
+
+        RDLOCK(SMA_LCK(i));
+        avail += header->avail;
+        /* the largest block is in the highest class that has one */
+        for (b = SMA_NUM_BINS - 1; b >= 0; b--) {
+            if (header->binmap[b >> 5] & (1U << (b & 31))) {
+                block_t* head = &header->bins[b];
+                block_t* cur;
+                size_t max = 0;
+
+                for (cur = BLOCKAT(head->fnext); cur != head; cur = BLOCKAT(cur->fnext)) {
+                    if (cur->size > max) {
+                        max = cur->size;
+                    }
+                }
+                largest += max;
+                break;
+            }
+        }
+        RDUNLOCK(SMA_LCK(i));
+    }
+
+    if (!avail) {
+        return 0;
+    }
+    return (int) (100.0 * (double) (avail - largest) / (double) avail);
+}
+/* }}} */
+
 #if ALLOC_DISTRIBUTION
 size_t *apc_sma_get_alloc_distribution(void) {
     sma_header_t* header = (sma_header_t*) segment->sma_shmaddr;
@@ -46,13 +46,26 @@ struct _apc_segment_t {
 #endif
 };
 
+/* where an allocation looks first, see apc_sma_set_placement() */
+#define APC_SMA_PLACE_MRU       0   /* the segment this process last got memory from */
+#define APC_SMA_PLACE_PROCESS   1   /* a segment picked by the process id */
+#define APC_SMA_PLACE_KEY       2   /* a segment picked by APCG(sma_hint), the process id without one */
+
 extern void apc_sma_init(int numseg, size_t segsize, char *mmap_file_mask TSRMLS_DC);
+extern void apc_sma_set_placement(int placement);
 extern void apc_sma_cleanup(TSRMLS_D);
 extern void* apc_sma_malloc(size_t size TSRMLS_DC);
 extern void* apc_sma_malloc_ex(size_t size, size_t fragment, size_t* allocated TSRMLS_DC);
+/* grows or shrinks the block of p where it is if it can, else moves it;
+ * NULL leaves p as it was, like realloc() */
 extern void* apc_sma_realloc(void* p, size_t size TSRMLS_DC);
 extern char* apc_sma_strdup(const char *s TSRMLS_DC);
 extern void apc_sma_free(void* p TSRMLS_DC);
+/* n bytes out of a free block smaller than limit bytes which does not border
+ * the block of old, NULL if there is none. Never expunges a cache for room */
+extern void* apc_sma_malloc_fit(size_t n, size_t limit, const void* old TSRMLS_DC);
+/* gives the blocks this process keeps back to the segments, from its shutdown */
+extern void apc_sma_release_magazines(TSRMLS_D);
 #if ALLOC_DISTRIBUTION 
 extern size_t *apc_sma_get_alloc_distribution();
 #endif
@@ -74,6 +87,8 @@ typedef struct apc_sma_info_t apc_sma_info_t;
 struct apc_sma_info_t {
     int num_seg;            /* number of shared memory segments */
     size_t seg_size;           /* size of each shared memory segment */
+    size_t* seg_avail;      /* free bytes of each segment */
+    size_t mag_held;        /* free blocks kept in process magazines, not in seg_avail */
     apc_sma_link_t** list;  /* there is one list per segment */
 };
 /* }}} */
@@ -83,8 +98,17 @@ extern void apc_sma_free_info(apc_sma_info_t* info TSRMLS_DC);
 
 extern size_t apc_sma_get_avail_mem();
 extern zend_bool apc_sma_get_avail_size(size_t size);
+extern zend_bool apc_sma_get_avail_block(size_t size TSRMLS_DC);
 extern void apc_sma_check_integrity();
 
+/* size of the free block freeing p would leave, 0 if p borders no free block */
+extern size_t apc_sma_get_hole(const void* p);
+/* percentage of the free memory outside the largest free block of each segment */
+extern int apc_sma_get_fragmentation();
+
+/* address and size of segment i, NULL if there is no such segment */
+extern void* apc_sma_get_segment(int i, size_t* size);
+
 /* {{{ ALIGNWORD: pad up x, aligned to the system's word boundary */
 typedef union { void* p; int i; long l; double d; void (*f)(); } apc_word_t;
 #define ALIGNSIZE(x, size) ((size) * (1 + (((x)-1)/(size))))
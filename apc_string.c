@@ -45,6 +45,9 @@ typedef struct _apc_interned_strings_data_t {
 
 apc_interned_strings_data_t *apc_interned_strings_data = NULL;
 
+const char *apc_interned_start = NULL;
+const char *apc_interned_end = NULL;
+
 #define APCSG(v) (apc_interned_strings_data->v)
 
 static char *old_interned_strings_start;
@@ -243,6 +246,27 @@ void apc_interned_strings_init(TSRMLS_D)
     }
 }
 
+/* {{{ apc_shared_strings_init */
+zend_bool apc_shared_strings_init(void *start, size_t size TSRMLS_DC)
+{
+    const char *seg_start = (const char*) start;
+    const char *seg_end = seg_start + size;
+
+    /* the engine knows one interned range: widening it may not take in
+     * anything but shared memory, so our interned buffer must lie inside */
+    if (!apc_interned_strings_data || !start ||
+        APCSG(interned_strings_start) < seg_start || APCSG(interned_strings_end) > seg_end) {
+        return 0;
+    }
+
+    apc_interned_start = APCSG(interned_strings_start);
+    apc_interned_end = APCSG(interned_strings_end);
+    CG(interned_strings_start) = (char*) seg_start;
+    CG(interned_strings_end) = (char*) seg_end;
+    return 1;
+}
+/* }}} */
+
 void apc_interned_strings_shutdown(TSRMLS_D)
 {	
     if (apc_interned_strings_data) {
@@ -252,6 +276,8 @@ void apc_interned_strings_shutdown(TSRMLS_D)
 
         CG(interned_strings_start) = old_interned_strings_start;
         CG(interned_strings_end) = old_interned_strings_end;
+        apc_interned_start = NULL;
+        apc_interned_end = NULL;
         zend_new_interned_string = old_new_interned_string;
         zend_interned_strings_snapshot = old_interned_strings_snapshot;
         zend_interned_strings_restore = old_interned_strings_restore;
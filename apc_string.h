@@ -31,12 +31,32 @@
 #define APC_STRING
 
 #include "apc.h"
+#include "apc_php.h"
 
 #ifndef ZTS
 void apc_interned_strings_init(TSRMLS_D);
 void apc_interned_strings_shutdown(TSRMLS_D);
 #endif
 
+#if defined(ZEND_ENGINE_2_4) && !defined(ZTS)
+zend_bool apc_shared_strings_init(void *start, size_t size TSRMLS_DC);
+
+/* The interned range apc_shared_strings_init widened to all of shared
+ * memory, so that the engine takes user cache strings handed out in place
+ * for interned ones; NULL when it did not. */
+extern const char *apc_interned_start;
+extern const char *apc_interned_end;
+
+/* strings interned for good, as opposed to user cache strings which the
+ * engine treats as interned while their entry is held */
+# define APC_IS_INTERNED(s) (apc_interned_end ? \
+    ((const char*)(s) >= apc_interned_start && (const char*)(s) < apc_interned_end) : IS_INTERNED(s))
+# define APC_SHARED_STRINGS() (apc_interned_end != NULL)
+#else
+# define APC_IS_INTERNED(s) IS_INTERNED(s)
+# define APC_SHARED_STRINGS() 0
+#endif
+
 const char *apc_new_interned_string(const char *arKey, int nKeyLength TSRMLS_DC);
 
 #endif
@@ -0,0 +1,108 @@
+<?php
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+  Chain length distribution of the user cache for a few key corpora, next
+  to what a uniform hash would give for the same load, and the time of a
+  fetch. The paths corpus walks a source tree, the words corpus reads a
+  dictionary when there is one. Run with apc.user_index=chained so the
+  fetches walk the chains:
+
+    php -d apc.enable_cli=1 -d apc.shm_size=128M bench/chains.php [keys [dir [words]]]
+
+ */
+
+if (!extension_loaded('apc') || !ini_get('apc.enable_cli')) {
+    die("apc with apc.enable_cli=1 is needed\n");
+}
+
+$count = isset($argv[1]) ? max(1, (int)$argv[1]) : 100000;
+$dir   = isset($argv[2]) ? $argv[2] : dirname(__FILE__) . '/..';
+$words = isset($argv[3]) ? $argv[3] : '/usr/share/dict/words';
+
+function corpus_paths($dir, $count)
+{
+    $keys = array();
+    $it = new RecursiveIteratorIterator(new RecursiveDirectoryIterator($dir));
+    foreach ($it as $file) {
+        $keys[] = 'file:' . $file->getPathname();
+        if (count($keys) >= $count) {
+            break;
+        }
+    }
+    return $keys;
+}
+
+function corpus_words($file, $count)
+{
+    if (!is_readable($file)) {
+        return array();
+    }
+    return array_slice(array_map('trim', file($file)), 0, $count);
+}
+
+function bench($name, $keys)
+{
+    if (!$keys) {
+        printf("%-10s no keys\n", $name);
+        return;
+    }
+    apc_clear_cache('user');
+    foreach ($keys as $key) {
+        apc_store($key, 1);
+    }
+
+    $info = apc_cache_info('user');
+    $dist = $info['slot_distribution'];
+    $n = array_sum($dist);
+    $m = $info['num_slots'];
+    $hist = array();
+    foreach ($dist as $len) {
+        $hist[min($len, 8)] = isset($hist[min($len, 8)]) ? $hist[min($len, 8)] + 1 : 1;
+    }
+    ksort($hist);
+
+    $start = microtime(true);
+    foreach ($keys as $key) {
+        apc_fetch($key);
+    }
+    $ns = (microtime(true) - $start) * 1e9 / count($keys);
+
+    /* a uniform hash leaves m * e^(-n/m) of the slots empty */
+    printf("%-10s %7d keys %7d slots  used %6.2f%% (uniform %6.2f%%)  longest %2d  %5.0f ns/fetch\n",
+        $name, $n, $m, 100 * count($dist) / $m, 100 * (1 - exp(-$n / $m)), max($dist), $ns);
+    $line = '';
+    foreach ($hist as $len => $slots) {
+        $line .= sprintf("  %s%d: %d", $len == 8 ? '>=' : '', $len, $slots);
+    }
+    printf("%-10s%s\n", '', $line);
+}
+
+$sequential = array();
+$digests = array();
+$sessions = array();
+for ($i = 0; $i < $count; $i++) {
+    $sequential[] = "user:$i";
+    $digests[] = md5($i);
+    $sessions[] = 'sess_' . substr(sha1(mt_rand()), 0, 26);
+}
+
+printf("apc.user_index=%s\n", ini_get('apc.user_index'));
+bench('sequential', $sequential);
+bench('md5', $digests);
+bench('sessions', $sessions);
+bench('paths', corpus_paths($dir, $count));
+bench('words', corpus_words($words, $count));
+apc_clear_cache('user');
@@ -0,0 +1,91 @@
+<?php
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+  Throughput of apc_inc() and apc_cas() on a few hot counters hammered by
+  several processes at once, with the counters updated in place
+  (apc.atomic_inc=1) and under the write lock of their stripe
+  (apc.atomic_inc=0). Needs the pcntl extension:
+
+    php -d apc.enable_cli=1 bench/inc.php [processes [seconds [counters]]]
+
+ */
+
+if (!extension_loaded('apc') || !ini_get('apc.enable_cli')) {
+    die("apc with apc.enable_cli=1 is needed\n");
+}
+if (!function_exists('pcntl_fork')) {
+    die("pcntl is needed to run several processes\n");
+}
+
+$procs    = isset($argv[1]) ? max(1, (int)$argv[1]) : 4;
+$seconds  = isset($argv[2]) ? max(1, (int)$argv[2]) : 3;
+$counters = isset($argv[3]) ? max(1, (int)$argv[3]) : 4;
+
+function bench($op, $atomic, $procs, $seconds, $counters)
+{
+    ini_set('apc.atomic_inc', $atomic);
+    for ($c = 0; $c < $counters; $c++) {
+        apc_store("bench_inc_$c", 0);
+    }
+    apc_store("bench_inc_ops", 0);
+
+    $pids = array();
+    for ($p = 0; $p < $procs; $p++) {
+        $pid = pcntl_fork();
+        if ($pid == -1) {
+            die("fork failed\n");
+        }
+        if ($pid == 0) {
+            $ops = 0;
+            $end = microtime(true) + $seconds;
+            while (microtime(true) < $end) {
+                for ($i = 0; $i < 1000; $i++) {
+                    $key = "bench_inc_" . (($i + $p) % $counters);
+                    if ($op == 'inc') {
+                        apc_inc($key);
+                    } else {
+                        /* a failed swap is retried like a client would */
+                        do {
+                            $old = apc_fetch($key);
+                        } while (!apc_cas($key, $old, $old + 1));
+                    }
+                }
+                $ops += 1000;
+            }
+            ini_set('apc.atomic_inc', 1);
+            apc_inc("bench_inc_ops", $ops);
+            exit(0);
+        }
+        $pids[] = $pid;
+    }
+    foreach ($pids as $pid) {
+        pcntl_waitpid($pid, $status);
+    }
+
+    $total = 0;
+    for ($c = 0; $c < $counters; $c++) {
+        $total += apc_fetch("bench_inc_$c");
+    }
+    $ops = apc_fetch("bench_inc_ops");
+    printf("%-4s %-8s %12.0f ops/s  %s\n", $op, $atomic ? "atomic" : "locked",
+        $ops / $seconds, $total == $ops ? "ok" : "LOST " . ($ops - $total));
+}
+
+printf("%d processes, %d counters, %d s per run\n", $procs, $counters, $seconds);
+foreach (array('inc', 'cas') as $op) {
+    bench($op, 0, $procs, $seconds, $counters);
+    bench($op, 1, $procs, $seconds, $counters);
+}
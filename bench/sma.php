@@ -0,0 +1,64 @@
+<?php
+/*
+  +----------------------------------------------------------------------+
+  | APC                                                                  |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 2006-2011 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+
+  Latency of apc_store() on a fragmented segment. The cache is filled with
+  values of mixed sizes and every other one is deleted, leaving many small
+  holes; then values larger than most holes are stored and the time of
+  each store is reported as percentiles. Compare builds of the allocator
+  with the same arguments:
+
+    php -d apc.enable_cli=1 -d apc.shm_size=512M bench/sma.php [keys [stores]]
+
+ */
+
+if (!extension_loaded('apc') || !ini_get('apc.enable_cli')) {
+    die("apc with apc.enable_cli=1 is needed\n");
+}
+
+$keys   = isset($argv[1]) ? max(1, (int)$argv[1]) : 200000;
+$stores = isset($argv[2]) ? max(1, (int)$argv[2]) : 20000;
+
+function percentile($sorted, $p)
+{
+    return $sorted[min(count($sorted) - 1, (int)(count($sorted) * $p))];
+}
+
+apc_clear_cache('user');
+mt_srand(1);
+for ($i = 0; $i < $keys; $i++) {
+    apc_store("frag_$i", str_repeat('x', mt_rand(16, 2000)));
+}
+for ($i = 0; $i < $keys; $i += 2) {
+    apc_delete("frag_$i");
+}
+$sma = apc_sma_info();
+$holes = 0;
+foreach ($sma['block_lists'] as $list) {
+    $holes += count($list);
+}
+printf("%d keys, %d free blocks, %.1f MB free\n", $keys, $holes, $sma['avail_mem'] / 1048576);
+
+$lat = array();
+for ($i = 0; $i < $stores; $i++) {
+    $val = str_repeat('y', mt_rand(1000, 5000));
+    $start = microtime(true);
+    apc_store("big_$i", $val);
+    $lat[] = (microtime(true) - $start) * 1e6;
+}
+sort($lat);
+printf("apc_store: mean %.1f us  p50 %.1f us  p99 %.1f us  max %.1f us\n",
+    array_sum($lat) / count($lat), percentile($lat, 0.5), percentile($lat, 0.99), end($lat));
+apc_clear_cache('user');
@@ -251,6 +251,7 @@ if test "$PHP_APC" != "no"; then
 	fi
 
   AC_CHECK_FUNCS(sigaction)
+  AC_CHECK_FUNCS(pthread_atfork)
   AC_CACHE_CHECK(for union semun, php_cv_semun,
   [
     AC_TRY_COMPILE([
@@ -298,6 +299,10 @@ if test "$PHP_APC" != "no"; then
                pgsql_s_lock.c \
                apc_sma.c \
                apc_stack.c \
+               apc_epoch.c \
+               apc_lease.c \
+               apc_compress.c \
+               apc_namespace.c \
                apc_zend.c \
                apc_rfc1867.c \
                apc_signal.c \
@@ -35,6 +35,9 @@
 #include "apc_sma.h"
 #include "apc_lock.h"
 #include "apc_bin.h"
+#include "apc_lease.h"
+#include "apc_namespace.h"
+#include "apc_string.h"
 #include "php_globals.h"
 #include "php_ini.h"
 #include "ext/standard/info.h"
@@ -72,6 +75,9 @@ PHP_FUNCTION(apc_bin_load);
 PHP_FUNCTION(apc_bin_dumpfile);
 PHP_FUNCTION(apc_bin_loadfile);
 PHP_FUNCTION(apc_exists);
+PHP_FUNCTION(apc_fetch_or_lease);
+PHP_FUNCTION(apc_store_with_lease);
+PHP_FUNCTION(apc_invalidate_namespace);
 /* }}} */
 
 /* {{{ ZEND_DECLARE_MODULE_GLOBALS(apc) */
@@ -101,13 +107,37 @@ static void php_apc_init_globals(zend_apc_globals* apc_globals TSRMLS_DC)
     memset(&(apc_globals->rfc1867_data), 0, sizeof(apc_rfc1867_data));
 #endif
     memset(&apc_globals->copied_zvals, 0, sizeof(HashTable));
+    memset(&apc_globals->held_entries, 0, sizeof(HashTable));
+    memset(&apc_globals->local_cache, 0, sizeof(HashTable));
+    apc_globals->local_hits = 0;
+    apc_globals->local_misses = 0;
     apc_globals->force_file_update = 0;
     apc_globals->coredump_unmap = 0;
     apc_globals->preload_path = NULL;
     apc_globals->use_request_time = 1;
+    apc_globals->atomic_inc = 1;
+    apc_globals->hit_sample = 1;
+    apc_globals->shared_strings = 0;
+    apc_globals->local_size = 0;
+    apc_globals->compress_threshold = 0;
+    apc_globals->compact_threshold = 0;
+    apc_globals->compact_budget = 1000;
+    apc_globals->compact_limit = 0;
+    apc_globals->compact_from = NULL;
+    apc_globals->sma_hint = 0;
+    apc_globals->shm_placement = NULL;
     apc_globals->lazy_class_table = NULL;
     apc_globals->lazy_function_table = NULL;
     apc_globals->serializer_name = NULL;
+    apc_globals->namespace_separator = NULL;
+    apc_globals->user_index = NULL;
+    apc_globals->eviction = NULL;
+    apc_globals->user_eviction = NULL;
+    apc_globals->epoch_record = -1;
+    apc_globals->epoch_owner = 0;
+    apc_globals->epoch_depth = 0;
+    apc_globals->lease_count = 0;
+    apc_globals->hit_tick = 0;
     apc_globals->serializer = NULL;
     apc_globals->compiler_hook_func_table = NULL;
     apc_globals->compiler_hook_class_table = NULL;
@@ -242,15 +272,26 @@ PHP_INI_BEGIN()
 STD_PHP_INI_BOOLEAN("apc.enabled",      "1",    PHP_INI_SYSTEM, OnUpdateBool,              enabled,         zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.shm_segments",   "1",    PHP_INI_SYSTEM, OnUpdateShmSegments,       shm_segments,    zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.shm_size",       "32M",  PHP_INI_SYSTEM, OnUpdateShmSize,           shm_size,        zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.sma_magazine_size", "0",   PHP_INI_SYSTEM, OnUpdateLong,       sma_magazine_size, zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.shm_placement", "mru", PHP_INI_SYSTEM, OnUpdateStringUnempty,   shm_placement,   zend_apc_globals, apc_globals)
 #ifdef ZEND_ENGINE_2_4
 STD_PHP_INI_ENTRY("apc.shm_strings_buffer", "4M",   PHP_INI_SYSTEM, OnUpdateLong,           shm_strings_buffer,        zend_apc_globals, apc_globals)
 #endif
 STD_PHP_INI_BOOLEAN("apc.include_once_override", "0", PHP_INI_SYSTEM, OnUpdateBool,     include_once,    zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.num_files_hint", "1000", PHP_INI_SYSTEM, OnUpdateLong,            num_files_hint,  zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.user_entries_hint", "4096", PHP_INI_SYSTEM, OnUpdateLong,          user_entries_hint, zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.user_lock_stripes", "16", PHP_INI_SYSTEM, OnUpdateLong,          user_lock_stripes, zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.user_index", "chained", PHP_INI_SYSTEM, OnUpdateStringUnempty,   user_index,       zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.gc_ttl",         "3600", PHP_INI_SYSTEM, OnUpdateLong,            gc_ttl,           zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.ttl",            "0",    PHP_INI_SYSTEM, OnUpdateLong,            ttl,              zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.user_ttl",       "0",    PHP_INI_SYSTEM, OnUpdateLong,            user_ttl,         zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.eviction",       "clock", PHP_INI_SYSTEM, OnUpdateStringUnempty,  eviction,         zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.user_eviction",  "clock", PHP_INI_SYSTEM, OnUpdateStringUnempty,  user_eviction,    zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.lease_slots",    "1024", PHP_INI_SYSTEM, OnUpdateLong,            lease_slots,      zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.namespace_separator", "", PHP_INI_SYSTEM, OnUpdateString,       namespace_separator, zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.namespaces",     "1024", PHP_INI_SYSTEM, OnUpdateLong,            namespaces,       zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.lease_ttl",      "10",   PHP_INI_ALL,    OnUpdateLong,            lease_ttl,        zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.lease_wait",     "0",    PHP_INI_ALL,    OnUpdateLong,            lease_wait,       zend_apc_globals, apc_globals)
 #if APC_MMAP
 STD_PHP_INI_ENTRY("apc.mmap_file_mask",  NULL,  PHP_INI_SYSTEM, OnUpdateString,         mmap_file_mask,   zend_apc_globals, apc_globals)
 #endif
@@ -276,6 +317,13 @@ STD_PHP_INI_BOOLEAN("apc.coredump_unmap", "0", PHP_INI_SYSTEM, OnUpdateBool, cor
 STD_PHP_INI_ENTRY("apc.preload_path", (char*)NULL,              PHP_INI_SYSTEM, OnUpdateString,       preload_path,  zend_apc_globals, apc_globals)
 STD_PHP_INI_BOOLEAN("apc.file_md5", "0", PHP_INI_SYSTEM, OnUpdateBool, file_md5,  zend_apc_globals, apc_globals)
 STD_PHP_INI_BOOLEAN("apc.use_request_time", "1", PHP_INI_ALL, OnUpdateBool, use_request_time,  zend_apc_globals, apc_globals)
+STD_PHP_INI_BOOLEAN("apc.atomic_inc", "1", PHP_INI_ALL, OnUpdateBool, atomic_inc,  zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.hit_sample", "1", PHP_INI_SYSTEM, OnUpdateLong, hit_sample,  zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.shared_strings", "0", PHP_INI_SYSTEM, OnUpdateLong, shared_strings,  zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.local_size", "0", PHP_INI_ALL, OnUpdateLong, local_size,  zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.compress_threshold", "0", PHP_INI_ALL, OnUpdateLong, compress_threshold,  zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.compact_threshold", "0", PHP_INI_SYSTEM, OnUpdateLong, compact_threshold,  zend_apc_globals, apc_globals)
+STD_PHP_INI_ENTRY("apc.compact_budget", "1000", PHP_INI_SYSTEM, OnUpdateLong, compact_budget,  zend_apc_globals, apc_globals)
 STD_PHP_INI_BOOLEAN("apc.lazy_functions", "0", PHP_INI_SYSTEM, OnUpdateBool, lazy_functions, zend_apc_globals, apc_globals)
 STD_PHP_INI_BOOLEAN("apc.lazy_classes", "0", PHP_INI_SYSTEM, OnUpdateBool, lazy_classes, zend_apc_globals, apc_globals)
 STD_PHP_INI_ENTRY("apc.serializer", "default", PHP_INI_SYSTEM, OnUpdateStringUnempty, serializer_name, zend_apc_globals, apc_globals)
@@ -415,6 +463,24 @@ static PHP_RSHUTDOWN_FUNCTION(apc)
 }
 /* }}} */
 
+/* {{{ ZEND_MODULE_POST_ZEND_DEACTIVATE_D(apc) */
+static ZEND_MODULE_POST_ZEND_DEACTIVATE_D(apc)
+{
+    TSRMLS_FETCH();
+
+    /* the executor is gone and with it the strings left in shared memory,
+     * the local copies may point at them too */
+    if(APCG(local_cache).nTableSize) {
+        zend_hash_destroy(&APCG(local_cache));
+        APCG(local_cache).nTableSize = 0;
+    }
+    if(APCG(enabled) && apc_user_cache) {
+        apc_cache_release_held(apc_user_cache TSRMLS_CC);
+    }
+    return SUCCESS;
+}
+/* }}} */
+
 /* {{{ proto array apc_cache_info([string type [, bool limited]]) */
 PHP_FUNCTION(apc_cache_info)
 {
@@ -430,6 +496,12 @@ PHP_FUNCTION(apc_cache_info)
     if(ZEND_NUM_ARGS()) {
         if(!strcasecmp(cache_type,"user")) {
             info = apc_cache_info(apc_user_cache, limited TSRMLS_CC);
+            if (info) {
+                apc_lease_info(info TSRMLS_CC);
+                apc_ns_info(info TSRMLS_CC);
+                add_assoc_long(info, "local_hits", APCG(local_hits));
+                add_assoc_long(info, "local_misses", APCG(local_misses));
+            }
         } else if(!strcasecmp(cache_type,"filehits")) {
 #ifdef APC_FILEHITS
             RETVAL_ZVAL(APCG(filehits), 1, 0);
@@ -480,6 +552,7 @@ PHP_FUNCTION(apc_sma_info)
 {
     apc_sma_info_t* info;
     zval* block_lists;
+    zval* seg_avail;
     int i;
     zend_bool limited = 0;
 
@@ -499,6 +572,14 @@ PHP_FUNCTION(apc_sma_info)
     add_assoc_double(return_value, "seg_size", (double)info->seg_size);
     add_assoc_double(return_value, "avail_mem", (double)apc_sma_get_avail_mem());
 
+    ALLOC_INIT_ZVAL(seg_avail);
+    array_init(seg_avail);
+    for (i = 0; i < info->num_seg; i++) {
+        add_next_index_double(seg_avail, (double)info->seg_avail[i]);
+    }
+    add_assoc_zval(return_value, "seg_avail_mem", seg_avail);
+    add_assoc_double(return_value, "magazine_mem", (double)info->mag_held);
+
     if(limited) {
         apc_sma_free_info(info TSRMLS_CC);
         return;
@@ -571,7 +652,7 @@ int _apc_update(char *strkey, int strkey_len, apc_cache_updater_t updater, void*
 /* }}} */
     
 /* {{{ _apc_store */
-int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int ttl, const int exclusive TSRMLS_DC) {
+int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int ttl, const unsigned int grace, const int exclusive TSRMLS_DC) {
     apc_cache_entry_t *entry;
     apc_cache_key_t key;
     time_t t;
@@ -591,8 +672,17 @@ int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int
 
     APCG(current_cache) = apc_user_cache;
 
+    /* the key first, its hash places the pool with apc.shm_placement=key */
+    if (!apc_cache_make_user_key(&key, strkey, strkey_len, t)) {
+        APCG(current_cache) = NULL;
+        HANDLE_UNBLOCK_INTERRUPTIONS();
+        return 0;
+    }
+    APCG(sma_hint) = key.h;
+
     ctxt.pool = apc_pool_create(APC_SMALL_POOL, apc_sma_malloc, apc_sma_free, apc_sma_protect, apc_sma_unprotect TSRMLS_CC);
     if (!ctxt.pool) {
+        APCG(sma_hint) = 0;
         HANDLE_UNBLOCK_INTERRUPTIONS();
         apc_warning("apc_store: Unable to allocate memory for pool." TSRMLS_CC);
         return 0;
@@ -605,15 +695,11 @@ int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int
         goto nocache;
     }
 
-    if (!apc_cache_make_user_key(&key, strkey, strkey_len, t)) {
-        goto freepool;
-    }
-
-    if (apc_cache_is_last_key(apc_user_cache, &key, t TSRMLS_CC)) {
+    if (apc_cache_is_leased(apc_user_cache, &key TSRMLS_CC)) {
         goto freepool;
     }
 
-    if (!(entry = apc_cache_make_user_entry(strkey, strkey_len, val, &ctxt, ttl TSRMLS_CC))) {
+    if (!(entry = apc_cache_make_user_entry(strkey, strkey_len, val, &ctxt, ttl, grace TSRMLS_CC))) {
         goto freepool;
     }
 
@@ -621,10 +707,14 @@ int _apc_store(char *strkey, int strkey_len, const zval *val, const unsigned int
 freepool:
         apc_pool_destroy(ctxt.pool TSRMLS_CC);
         ret = 0;
+    } else if (APCG(lease_count) > 0) {
+        /* the refresh of a stale entry is done, if it was ours */
+        apc_lease_release(key.h, 0 TSRMLS_CC);
     }
 
 nocache:
 
+    APCG(sma_hint) = 0;
     APCG(current_cache) = NULL;
 
     HANDLE_UNBLOCK_INTERRUPTIONS();
@@ -633,6 +723,108 @@ nocache:
 }
 /* }}} */
 
+/* {{{ _apc_store_mult */
+static void _apc_store_mult(HashTable *hash, const unsigned int ttl, const unsigned int grace, const int exclusive, zval *failed TSRMLS_DC) {
+    int num_entries = zend_hash_num_elements(hash);
+    apc_cache_key_t *keys;
+    apc_cache_entry_t **entries;
+    char **hkeys;
+    uint *hkey_lens;
+    ulong *hkey_idxs;
+    int *rval = NULL;
+    HashPosition hpos;
+    zval **hentry;
+    time_t t;
+    apc_context_t ctxt={0,};
+    int i;
+
+    if (num_entries == 0) {
+        return;
+    }
+
+    t = apc_time();
+
+    keys = (apc_cache_key_t*) emalloc(sizeof(apc_cache_key_t) * num_entries);
+    entries = (apc_cache_entry_t**) ecalloc(num_entries, sizeof(apc_cache_entry_t*));
+    hkeys = (char**) ecalloc(num_entries, sizeof(char*));
+    hkey_lens = (uint*) emalloc(sizeof(uint) * num_entries);
+    hkey_idxs = (ulong*) emalloc(sizeof(ulong) * num_entries);
+
+    if (!APCG(serializer) && APCG(serializer_name)) {
+        /* Avoid race conditions between MINIT of apc and serializer exts like igbinary */
+        APCG(serializer) = apc_find_serializer(APCG(serializer_name) TSRMLS_CC);
+    }
+
+    HANDLE_BLOCK_INTERRUPTIONS();
+
+    APCG(current_cache) = apc_user_cache;
+    ctxt.copy = APC_COPY_IN_USER;
+    ctxt.force_update = 0;
+
+    /* copy every value in before the cache is locked at all */
+    i = 0;
+    zend_hash_internal_pointer_reset_ex(hash, &hpos);
+    while (i < num_entries && zend_hash_get_current_data_ex(hash, (void**)&hentry, &hpos) == SUCCESS) {
+        zend_hash_get_current_key_ex(hash, &hkeys[i], &hkey_lens[i], &hkey_idxs[i], 0, &hpos);
+        if (hkeys[i] && APCG(enabled) && apc_cache_make_user_key(&keys[i], hkeys[i], hkey_lens[i], t)) {
+            APCG(sma_hint) = keys[i].h;
+            ctxt.pool = apc_pool_create(APC_SMALL_POOL, apc_sma_malloc, apc_sma_free, apc_sma_protect, apc_sma_unprotect TSRMLS_CC);
+            if (!ctxt.pool) {
+                apc_warning("apc_store: Unable to allocate memory for pool." TSRMLS_CC);
+            } else if (apc_cache_is_leased(apc_user_cache, &keys[i] TSRMLS_CC)
+                       || !(entries[i] = apc_cache_make_user_entry(hkeys[i], hkey_lens[i], *hentry, &ctxt, ttl, grace TSRMLS_CC))) {
+                apc_pool_destroy(ctxt.pool TSRMLS_CC);
+            }
+            APCG(sma_hint) = 0;
+        }
+        zend_hash_move_forward_ex(hash, &hpos);
+        i++;
+    }
+    num_entries = i;
+
+    if (APCG(enabled)) {
+        rval = apc_cache_user_insert_mult(apc_user_cache, keys, entries, t, exclusive, num_entries TSRMLS_CC);
+    }
+
+    for (i = 0; i < num_entries; i++) {
+        if (!entries[i]) {
+            continue;
+        }
+        if (rval[i] != 1) {
+            apc_pool_destroy(entries[i]->pool TSRMLS_CC);
+            entries[i] = NULL;
+        } else if (APCG(lease_count) > 0) {
+            /* the refresh of a stale entry is done, if it was ours */
+            apc_lease_release(keys[i].h, 0 TSRMLS_CC);
+        }
+    }
+
+    APCG(current_cache) = NULL;
+
+    HANDLE_UNBLOCK_INTERRUPTIONS();
+
+    for (i = 0; i < num_entries; i++) {
+        if (entries[i]) {
+            continue;
+        }
+        if (hkeys[i]) {
+            add_assoc_long_ex(failed, hkeys[i], hkey_lens[i], -1);  /* -1: insertion error */
+        } else {
+            add_index_long(failed, hkey_idxs[i], -1);  /* -1: insertion error */
+        }
+    }
+
+    if (rval) {
+        efree(rval);
+    }
+    efree(hkey_idxs);
+    efree(hkey_lens);
+    efree(hkeys);
+    efree(entries);
+    efree(keys);
+}
+/* }}} */
+
 /* {{{ apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const int exclusive)
  */
 static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const int exclusive)
@@ -640,39 +832,21 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const int exclusive)
     zval *key = NULL;
     zval *val = NULL;
     long ttl = 0L;
-    HashTable *hash;
-    HashPosition hpos;
-    zval **hentry;
-    char *hkey=NULL;
-    uint hkey_len;
-    ulong hkey_idx;
+    long grace = 0L;
 
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|zl", &key, &val, &ttl) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|zll", &key, &val, &ttl, &grace) == FAILURE) {
         return;
     }
 
     if (!key) RETURN_FALSE;
 
     if (Z_TYPE_P(key) == IS_ARRAY) {
-        hash = Z_ARRVAL_P(key);
         array_init(return_value);
-        zend_hash_internal_pointer_reset_ex(hash, &hpos);
-        while(zend_hash_get_current_data_ex(hash, (void**)&hentry, &hpos) == SUCCESS) {
-            zend_hash_get_current_key_ex(hash, &hkey, &hkey_len, &hkey_idx, 0, &hpos);
-            if (hkey) {
-                if(!_apc_store(hkey, hkey_len, *hentry, (unsigned int)ttl, exclusive TSRMLS_CC)) {
-                    add_assoc_long_ex(return_value, hkey, hkey_len, -1);  /* -1: insertion error */
-                }
-                hkey = NULL;
-            } else {
-                add_index_long(return_value, hkey_idx, -1);  /* -1: insertion error */
-            }
-            zend_hash_move_forward_ex(hash, &hpos);
-        }
+        _apc_store_mult(Z_ARRVAL_P(key), (unsigned int)ttl, (unsigned int)grace, exclusive, return_value TSRMLS_CC);
         return;
     } else if (Z_TYPE_P(key) == IS_STRING) {
         if (!val) RETURN_FALSE;
-        if(_apc_store(Z_STRVAL_P(key), Z_STRLEN_P(key) + 1, val, (unsigned int)ttl, exclusive TSRMLS_CC))
+        if(_apc_store(Z_STRVAL_P(key), Z_STRLEN_P(key) + 1, val, (unsigned int)ttl, (unsigned int)grace, exclusive TSRMLS_CC))
             RETURN_TRUE;
     } else {
         apc_warning("apc_store expects key parameter to be a string or an array of key/value pairs." TSRMLS_CC);
@@ -682,14 +856,14 @@ static void apc_store_helper(INTERNAL_FUNCTION_PARAMETERS, const int exclusive)
 }
 /* }}} */
 
-/* {{{ proto int apc_store(mixed key, mixed var [, long ttl ])
+/* {{{ proto int apc_store(mixed key, mixed var [, long ttl [, long grace ]])
  */
 PHP_FUNCTION(apc_store) {
     apc_store_helper(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
 }
 /* }}} */
 
-/* {{{ proto int apc_add(mixed key, mixed var [, long ttl ])
+/* {{{ proto int apc_add(mixed key, mixed var [, long ttl [, long grace ]])
  */
 PHP_FUNCTION(apc_add) {
     apc_store_helper(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
@@ -719,6 +893,19 @@ static int inc_updater(apc_cache_t* cache, apc_cache_entry_t* entry, void* data)
 }
 /* }}} */
 
+/* {{{ _apc_inc */
+static int _apc_inc(char *strkey, int strkey_len, struct _inc_update_args* args TSRMLS_DC)
+{
+    if (!APCG(atomic_inc)) {
+        return _apc_update(strkey, strkey_len, inc_updater, args TSRMLS_CC);
+    }
+    if (!APCG(enabled)) {
+        return 0;
+    }
+    return apc_cache_user_inc(apc_user_cache, strkey, strkey_len + 1, args->step, &args->lval TSRMLS_CC);
+}
+/* }}} */
+
 /* {{{ proto long apc_inc(string key [, long step [, bool& success]])
  */
 PHP_FUNCTION(apc_inc) {
@@ -735,7 +922,7 @@ PHP_FUNCTION(apc_inc) {
 		zval_dtor(success);
 	}
 
-    if(_apc_update(strkey, strkey_len, inc_updater, &args TSRMLS_CC)) {
+    if(_apc_inc(strkey, strkey_len, &args TSRMLS_CC)) {
         if(success) ZVAL_TRUE(success);
         RETURN_LONG(args.lval);
     }
@@ -764,7 +951,7 @@ PHP_FUNCTION(apc_dec) {
 
     args.step = args.step * -1;
 
-    if(_apc_update(strkey, strkey_len, inc_updater, &args TSRMLS_CC)) {
+    if(_apc_inc(strkey, strkey_len, &args TSRMLS_CC)) {
         if(success) ZVAL_TRUE(success);
         RETURN_LONG(args.lval);
     }
@@ -804,6 +991,11 @@ PHP_FUNCTION(apc_cas) {
         return;
     }
 
+    if (APCG(atomic_inc)) {
+        if (APCG(enabled) && apc_cache_user_cas(apc_user_cache, strkey, strkey_len + 1, vals[0], vals[1] TSRMLS_CC)) RETURN_TRUE;
+        RETURN_FALSE;
+    }
+
     if(_apc_update(strkey, strkey_len, cas_updater, &vals TSRMLS_CC)) RETURN_TRUE;
     RETURN_FALSE;
 }
@@ -813,11 +1005,110 @@ void *apc_erealloc_wrapper(void *ptr, size_t size) {
     return _erealloc(ptr, size, 0 ZEND_FILE_LINE_CC ZEND_FILE_LINE_EMPTY_CC);
 }
 
-/* {{{ proto mixed apc_fetch(mixed key[, bool &success])
+/* {{{ apc_stale_refresh */
+static int apc_stale_refresh(char *strkey, int strkey_len, time_t t TSRMLS_DC)
+{
+    /* whether this caller is the one to refresh a stale entry, the others
+     * are handed the stale value meanwhile */
+    apc_cache_key_t key;
+
+    apc_cache_make_user_key(&key, strkey, strkey_len, t);
+    return apc_lease_acquire(key.h, (int) APCG(lease_ttl) TSRMLS_CC) != 0;
+}
+/* }}} */
+
+/* {{{ apc_local_entry_t */
+typedef struct apc_local_entry_t {
+    apc_cache_entry_t* entry;   /* shared entry the copy was made from */
+    unsigned long gen;          /* and its generation, the address alone may be reused */
+    zval* val;
+} apc_local_entry_t;
+
+static void apc_local_entry_dtor(void* pDest)
+{
+    apc_local_entry_t* local = (apc_local_entry_t*) pDest;
+
+    zval_ptr_dtor(&local->val);
+}
+/* }}} */
+
+/* {{{ apc_local_add */
+static void apc_local_add(char *strkey, int keylen, apc_cache_entry_t* entry, zval* val TSRMLS_DC)
+{
+    /* only strings and plain arrays, whose copies behave as values; longs
+     * change in place under apc_inc and the rest is cheap to copy anyway */
+    HashTable* ht = &APCG(local_cache);
+    apc_local_entry_t local;
+    char* key;
+    uint key_len;
+    ulong idx;
+
+    if (!(Z_TYPE_P(val) == IS_STRING || (Z_TYPE_P(val) == IS_ARRAY && entry->data.user.tree))) {
+        return;
+    }
+
+    if (!ht->nTableSize) {
+        zend_hash_init(ht, 16, NULL, apc_local_entry_dtor, 0);
+    }
+    /* the oldest copies make room */
+    while (zend_hash_num_elements(ht) >= (uint) APCG(local_size)) {
+        zend_hash_internal_pointer_reset(ht);
+        if (zend_hash_get_current_key_ex(ht, &key, &key_len, &idx, 0, NULL) != HASH_KEY_IS_STRING) {
+            break;
+        }
+        zend_hash_del(ht, key, key_len);
+    }
+
+    local.entry = entry;
+    local.gen = entry->data.user.gen;
+    MAKE_STD_ZVAL(local.val);
+    ZVAL_ZVAL(local.val, val, 1, 0);
+    zend_hash_update(ht, strkey, keylen, (void*) &local, sizeof(apc_local_entry_t), NULL);
+}
+/* }}} */
+
+/* {{{ apc_fetch_entry */
+static void apc_fetch_entry(zval *dst, char *strkey, int keylen, apc_cache_entry_t* entry, apc_context_t* ctxt TSRMLS_DC)
+{
+    apc_local_entry_t* local;
+
+    /* a copy made earlier in the request will do while the key still maps to the same entry */
+    if (APCG(local_cache).nTableSize &&
+        zend_hash_find(&APCG(local_cache), strkey, keylen, (void**) &local) == SUCCESS) {
+        if (local->entry == entry && local->gen == entry->data.user.gen) {
+            APCG(local_hits)++;
+            ZVAL_ZVAL(dst, local->val, 1, 0);
+            apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+            return;
+        }
+        zend_hash_del(&APCG(local_cache), strkey, keylen);
+    }
+
+    /* deep-copy returned shm zval to emalloc'ed dst, long strings aside with apc.shared_strings */
+    ctxt->share_strings = APC_SHARED_STRINGS();
+    ctxt->shared = 0;
+    ctxt->tree = entry->data.user.tree;
+    ctxt->raw_len = entry->data.user.raw_len;
+    apc_cache_fetch_zval(dst, entry->data.user.val, ctxt TSRMLS_CC);
+    if (ctxt->shared) {
+        apc_cache_hold(apc_user_cache, entry TSRMLS_CC);
+    }
+
+    if (APCG(local_size) > 0) {
+        APCG(local_misses)++;
+        apc_local_add(strkey, keylen, entry, dst TSRMLS_CC);
+    }
+    apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ proto mixed apc_fetch(mixed key[, bool &success[, bool &stale]])
  */
 PHP_FUNCTION(apc_fetch) {
     zval *key;
     zval *success = NULL;
+    zval *stale = NULL;
+    zend_bool is_stale = 0;
     HashTable *hash;
     HashPosition hpos;
     zval **hentry;
@@ -831,7 +1122,7 @@ PHP_FUNCTION(apc_fetch) {
 
     if(!APCG(enabled)) RETURN_FALSE;
 
-    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|z", &key, &success) == FAILURE) {
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z|zz", &key, &success, &stale) == FAILURE) {
         return;
     }
 
@@ -840,6 +1131,9 @@ PHP_FUNCTION(apc_fetch) {
     if (success) {
         ZVAL_BOOL(success, 0);
     }
+    if (stale) {
+        ZVAL_BOOL(stale, 0);
+    }
 
     ctxt.pool = apc_pool_create(APC_UNPOOL, apc_php_malloc, apc_php_free, NULL, NULL TSRMLS_CC);
     if (!ctxt.pool) {
@@ -857,34 +1151,64 @@ PHP_FUNCTION(apc_fetch) {
         strkey = Z_STRVAL_P(key);
         strkey_len = Z_STRLEN_P(key);
         if(!strkey_len) RETURN_FALSE;
-        entry = apc_cache_user_find(apc_user_cache, strkey, (strkey_len + 1), t TSRMLS_CC);
-        if(entry) {
-            /* deep-copy returned shm zval to emalloc'ed return_value */
-            apc_cache_fetch_zval(return_value, entry->data.user.val, &ctxt TSRMLS_CC);
+        entry = apc_cache_user_find(apc_user_cache, strkey, (strkey_len + 1), t, &is_stale TSRMLS_CC);
+        if(entry && is_stale && apc_stale_refresh(strkey, strkey_len + 1, t TSRMLS_CC)) {
+            /* a miss for the caller refreshing it */
             apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+            entry = NULL;
+        }
+        if(entry) {
+            apc_fetch_entry(return_value, strkey, strkey_len + 1, entry, &ctxt TSRMLS_CC);
+            if (stale && is_stale) {
+                ZVAL_BOOL(stale, 1);
+            }
         } else {
             goto freepool;
         }
     } else if(Z_TYPE_P(key) == IS_ARRAY) {
+        apc_cache_user_req_t* reqs;
+        int num_reqs = 0;
+        int i;
+
         hash = Z_ARRVAL_P(key);
-        MAKE_STD_ZVAL(result);
-        array_init(result); 
+        reqs = (apc_cache_user_req_t*) safe_emalloc(zend_hash_num_elements(hash) + 1, sizeof(apc_cache_user_req_t), 0);
         zend_hash_internal_pointer_reset_ex(hash, &hpos);
         while(zend_hash_get_current_data_ex(hash, (void**)&hentry, &hpos) == SUCCESS) {
             if(Z_TYPE_PP(hentry) != IS_STRING) {
                 apc_warning("apc_fetch() expects a string or array of strings." TSRMLS_CC);
+                efree(reqs);
                 goto freepool;
             }
-            entry = apc_cache_user_find(apc_user_cache, Z_STRVAL_PP(hentry), (Z_STRLEN_PP(hentry) + 1), t TSRMLS_CC);
+            reqs[num_reqs].strkey = Z_STRVAL_PP(hentry);
+            reqs[num_reqs].keylen = Z_STRLEN_PP(hentry) + 1;
+            num_reqs++;
+            zend_hash_move_forward_ex(hash, &hpos);
+        }
+
+        /* one pass over the cache pins every entry found, the copies are made after it */
+        apc_cache_user_find_mult(apc_user_cache, reqs, num_reqs, t, APC_FIND_STALE TSRMLS_CC);
+
+        MAKE_STD_ZVAL(result);
+        array_init(result); 
+        for (i = 0; i < num_reqs; i++) {
+            entry = reqs[i].entry;
+            if(entry && reqs[i].stale && apc_stale_refresh(reqs[i].strkey, reqs[i].keylen, t TSRMLS_CC)) {
+                apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+                entry = NULL;
+            }
             if(entry) {
-                /* deep-copy returned shm zval to emalloc'ed return_value */
+                if (stale && reqs[i].stale) {
+                    ZVAL_BOOL(stale, 1);
+                }
                 MAKE_STD_ZVAL(result_entry);
-                apc_cache_fetch_zval(result_entry, entry->data.user.val, &ctxt TSRMLS_CC);
-                apc_cache_release(apc_user_cache, entry TSRMLS_CC);
-                zend_hash_add(Z_ARRVAL_P(result), Z_STRVAL_PP(hentry), Z_STRLEN_PP(hentry) +1, &result_entry, sizeof(zval*), NULL);
+                apc_fetch_entry(result_entry, reqs[i].strkey, reqs[i].keylen, entry, &ctxt TSRMLS_CC);
+                if (zend_hash_add(Z_ARRVAL_P(result), reqs[i].strkey, reqs[i].keylen, &result_entry, sizeof(zval*), NULL) == FAILURE) {
+                    /* the key was asked for twice */
+                    zval_ptr_dtor(&result_entry);
+                }
             } /* don't set values we didn't find */
-            zend_hash_move_forward_ex(hash, &hpos);
         }
+        efree(reqs);
         RETVAL_ZVAL(result, 0, 1);
     } else {
         apc_warning("apc_fetch() expects a string or array of strings." TSRMLS_CC);
@@ -902,6 +1226,159 @@ freepool:
 }
 /* }}} */
 
+/* {{{ proto mixed apc_fetch_or_lease(string key, long &lease [, long lease_ttl])
+ */
+PHP_FUNCTION(apc_fetch_or_lease) {
+    char *strkey;
+    int strkey_len;
+    zval *lease;
+    long lease_ttl = 0;
+    long waited = 0;
+    long delay = 1;
+    int contended = 0;
+    zend_bool stale = 0;
+    unsigned long token;
+    apc_cache_key_t key;
+    apc_cache_entry_t* entry;
+    apc_context_t ctxt = {0,};
+    time_t t;
+
+    if(!APCG(enabled)) RETURN_FALSE;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sz|l", &strkey, &strkey_len, &lease, &lease_ttl) == FAILURE) {
+        return;
+    }
+
+    zval_dtor(lease);
+    ZVAL_LONG(lease, 0);
+
+    if(!strkey_len) RETURN_FALSE;
+    if(lease_ttl <= 0) {
+        lease_ttl = APCG(lease_ttl);
+    }
+
+    t = apc_time();
+    apc_cache_make_user_key(&key, strkey, strkey_len + 1, t);
+
+    for (;;) {
+        entry = apc_cache_user_find(apc_user_cache, strkey, strkey_len + 1, t, &stale TSRMLS_CC);
+        if(entry && stale) {
+            /* one caller refreshes a stale entry, the others take it as it is */
+            token = apc_lease_acquire(key.h, (int) lease_ttl TSRMLS_CC);
+            if (token) {
+                apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+                ZVAL_LONG(lease, (long) token);
+                RETURN_FALSE;
+            }
+        }
+        if(entry) {
+            ctxt.pool = apc_pool_create(APC_UNPOOL, apc_php_malloc, apc_php_free, NULL, NULL TSRMLS_CC);
+            if (!ctxt.pool) {
+                apc_cache_release(apc_user_cache, entry TSRMLS_CC);
+                apc_warning("apc_fetch_or_lease: Unable to allocate memory for pool." TSRMLS_CC);
+                RETURN_FALSE;
+            }
+            ctxt.copy = APC_COPY_OUT_USER;
+            ctxt.force_update = 0;
+            apc_fetch_entry(return_value, strkey, strkey_len + 1, entry, &ctxt TSRMLS_CC);
+            apc_pool_destroy(ctxt.pool TSRMLS_CC);
+            if (contended) {
+                apc_lease_waited(0 TSRMLS_CC);
+            }
+            return;
+        }
+
+        /* the first to miss computes the value, or whoever finds the lease
+         * given up while waiting */
+        token = apc_lease_acquire(key.h, (int) lease_ttl TSRMLS_CC);
+        if (token) {
+            ZVAL_LONG(lease, (long) token);
+            if (contended) {
+                apc_lease_waited(0 TSRMLS_CC);
+            }
+            RETURN_FALSE;
+        }
+
+        contended = 1;
+        if (waited >= APCG(lease_wait)) {
+            break;
+        }
+        if (delay > APCG(lease_wait) - waited) {
+            delay = APCG(lease_wait) - waited;
+        }
+#if HAVE_USLEEP
+        usleep((unsigned int) delay * 1000);
+#elif defined(PHP_WIN32)
+        Sleep((DWORD) delay);
+#endif
+        waited += delay;
+        if (delay < 16) {
+            delay <<= 1;
+        }
+    }
+
+    /* somebody else is still computing it, back off */
+    apc_lease_waited(1 TSRMLS_CC);
+    RETURN_FALSE;
+}
+/* }}} */
+
+/* {{{ proto bool apc_store_with_lease(string key, mixed var, long lease [, long ttl [, long grace]])
+ */
+PHP_FUNCTION(apc_store_with_lease) {
+    char *strkey;
+    int strkey_len;
+    zval *val;
+    long token;
+    long ttl = 0L;
+    long grace = 0L;
+    apc_cache_key_t key;
+    int ret;
+    time_t t;
+
+    if(!APCG(enabled)) RETURN_FALSE;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "szl|ll", &strkey, &strkey_len, &val, &token, &ttl, &grace) == FAILURE) {
+        return;
+    }
+
+    if(!strkey_len) RETURN_FALSE;
+
+    t = apc_time();
+    apc_cache_make_user_key(&key, strkey, strkey_len + 1, t);
+    if (apc_lease_held(key.h TSRMLS_CC)) {
+        /* our lease lapsed and the new holder's value wins */
+        RETURN_FALSE;
+    }
+
+    /* stored before the lease goes, so nobody misses in between */
+    ret = _apc_store(strkey, strkey_len + 1, val, (unsigned int) ttl, (unsigned int) grace, 0 TSRMLS_CC);
+    apc_lease_release(key.h, (unsigned long) token TSRMLS_CC);
+
+    if (ret) RETURN_TRUE;
+    RETURN_FALSE;
+}
+/* }}} */
+
+/* {{{ proto bool apc_invalidate_namespace(string namespace)
+ */
+PHP_FUNCTION(apc_invalidate_namespace) {
+    char *ns;
+    int ns_len;
+
+    if(!APCG(enabled)) RETURN_FALSE;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &ns, &ns_len) == FAILURE) {
+        return;
+    }
+
+    if(!ns_len) RETURN_FALSE;
+
+    if (apc_ns_invalidate(ns, ns_len TSRMLS_CC)) RETURN_TRUE;
+    RETURN_FALSE;
+}
+/* }}} */
+
 /* {{{ proto mixed apc_exists(mixed key)
  */
 PHP_FUNCTION(apc_exists) {
@@ -913,7 +1390,6 @@ PHP_FUNCTION(apc_exists) {
     int strkey_len;
     apc_cache_entry_t* entry;
     zval *result;
-    zval *result_entry;
     time_t t;
 
     if(!APCG(enabled)) RETURN_FALSE;
@@ -937,24 +1413,36 @@ PHP_FUNCTION(apc_exists) {
             RETURN_TRUE;
         }
     } else if(Z_TYPE_P(key) == IS_ARRAY) {
+        apc_cache_user_req_t* reqs;
+        int num_reqs = 0;
+        int i;
+
         hash = Z_ARRVAL_P(key);
-        MAKE_STD_ZVAL(result);
-        array_init(result); 
+        reqs = (apc_cache_user_req_t*) safe_emalloc(zend_hash_num_elements(hash) + 1, sizeof(apc_cache_user_req_t), 0);
         zend_hash_internal_pointer_reset_ex(hash, &hpos);
         while(zend_hash_get_current_data_ex(hash, (void**)&hentry, &hpos) == SUCCESS) {
             if(Z_TYPE_PP(hentry) != IS_STRING) {
                 apc_warning("apc_exists() expects a string or array of strings." TSRMLS_CC);
+                efree(reqs);
                 RETURN_FALSE;
             }
+            reqs[num_reqs].strkey = Z_STRVAL_PP(hentry);
+            reqs[num_reqs].keylen = Z_STRLEN_PP(hentry) + 1;
+            num_reqs++;
+            zend_hash_move_forward_ex(hash, &hpos);
+        }
 
-            entry = apc_cache_user_exists(apc_user_cache, Z_STRVAL_PP(hentry), Z_STRLEN_PP(hentry) + 1, t TSRMLS_CC);
-            if(entry) {
-                MAKE_STD_ZVAL(result_entry);
-                ZVAL_BOOL(result_entry, 1);
-                zend_hash_add(Z_ARRVAL_P(result), Z_STRVAL_PP(hentry), Z_STRLEN_PP(hentry) +1, &result_entry, sizeof(zval*), NULL);
+        apc_cache_user_find_mult(apc_user_cache, reqs, num_reqs, t, APC_FIND_PEEK TSRMLS_CC);
+
+        MAKE_STD_ZVAL(result);
+        array_init(result); 
+        for (i = 0; i < num_reqs; i++) {
+            if(reqs[i].entry) {
+                apc_cache_release(apc_user_cache, reqs[i].entry TSRMLS_CC);
+                add_assoc_bool_ex(result, reqs[i].strkey, reqs[i].keylen, 1);
             } /* don't set values we didn't find */
-            zend_hash_move_forward_ex(hash, &hpos);
         }
+        efree(reqs);
         RETURN_ZVAL(result, 0, 1);
     } else {
         apc_warning("apc_exists() expects a string or array of strings." TSRMLS_CC);
@@ -1122,7 +1610,7 @@ PHP_FUNCTION(apc_define_constants) {
     if(!strkey_len) RETURN_FALSE;
 
     _apc_define_constants(constants, case_sensitive TSRMLS_CC);
-    if(_apc_store(strkey, strkey_len + 1, constants, 0, 0 TSRMLS_CC)) RETURN_TRUE;
+    if(_apc_store(strkey, strkey_len + 1, constants, 0, 0, 0 TSRMLS_CC)) RETURN_TRUE;
     RETURN_FALSE;
 } /* }}} */
 
@@ -1144,7 +1632,7 @@ PHP_FUNCTION(apc_load_constants) {
 
     t = apc_time();
 
-    entry = apc_cache_user_find(apc_user_cache, strkey, (strkey_len + 1), t TSRMLS_CC);
+    entry = apc_cache_user_find(apc_user_cache, strkey, (strkey_len + 1), t, NULL TSRMLS_CC);
 
     if(entry) {
         _apc_define_constants(entry->data.user.val, case_sensitive TSRMLS_CC);
@@ -1570,6 +2058,7 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_apc_store, 0, 0, 2)
     ZEND_ARG_INFO(0, key)
     ZEND_ARG_INFO(0, var)
     ZEND_ARG_INFO(0, ttl)
+    ZEND_ARG_INFO(0, grace)
 ZEND_END_ARG_INFO()
 
 PHP_APC_ARGINFO
@@ -1609,6 +2098,28 @@ PHP_APC_ARGINFO
 ZEND_BEGIN_ARG_INFO_EX(arginfo_apc_fetch, 0, 0, 1)
     ZEND_ARG_INFO(0, key)
     ZEND_ARG_INFO(1, success)
+    ZEND_ARG_INFO(1, stale)
+ZEND_END_ARG_INFO()
+
+PHP_APC_ARGINFO
+ZEND_BEGIN_ARG_INFO_EX(arginfo_apc_fetch_or_lease, 0, 0, 2)
+    ZEND_ARG_INFO(0, key)
+    ZEND_ARG_INFO(1, lease)
+    ZEND_ARG_INFO(0, lease_ttl)
+ZEND_END_ARG_INFO()
+
+PHP_APC_ARGINFO
+ZEND_BEGIN_ARG_INFO_EX(arginfo_apc_store_with_lease, 0, 0, 3)
+    ZEND_ARG_INFO(0, key)
+    ZEND_ARG_INFO(0, var)
+    ZEND_ARG_INFO(0, lease)
+    ZEND_ARG_INFO(0, ttl)
+    ZEND_ARG_INFO(0, grace)
+ZEND_END_ARG_INFO()
+
+PHP_APC_ARGINFO
+ZEND_BEGIN_ARG_INFO_EX(arginfo_apc_invalidate_namespace, 0, 0, 1)
+    ZEND_ARG_INFO(0, namespace)
 ZEND_END_ARG_INFO()
 
 PHP_APC_ARGINFO
@@ -1692,6 +2203,9 @@ zend_function_entry apc_functions[] = {
     PHP_FE(apc_bin_dumpfile,        arginfo_apc_bin_dumpfile)
     PHP_FE(apc_bin_loadfile,        arginfo_apc_bin_loadfile)
     PHP_FE(apc_exists,              arginfo_apc_exists)
+    PHP_FE(apc_fetch_or_lease,      arginfo_apc_fetch_or_lease)
+    PHP_FE(apc_store_with_lease,    arginfo_apc_store_with_lease)
+    PHP_FE(apc_invalidate_namespace, arginfo_apc_invalidate_namespace)
     {NULL, NULL, NULL}
 };
 /* }}} */
@@ -1708,7 +2222,9 @@ zend_module_entry apc_module_entry = {
     PHP_RSHUTDOWN(apc),
     PHP_MINFO(apc),
     PHP_APC_VERSION,
-    STANDARD_MODULE_PROPERTIES
+    NO_MODULE_GLOBALS,
+    ZEND_MODULE_POST_ZEND_DEACTIVATE_N(apc),
+    STANDARD_MODULE_PROPERTIES_EX
 };
 
 #ifdef COMPILE_DL_APC
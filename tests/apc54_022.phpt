@@ -0,0 +1,59 @@
+--TEST--
+APC: apc.shared_strings hands long strings out of shared memory, copy on write (php 5.4)
+--SKIPIF--
+<?php
+    require_once(dirname(__FILE__) . '/skipif.inc'); 
+    if (PHP_MAJOR_VERSION < 5 || (PHP_MAJOR_VERSION == 5 && PHP_MINOR_VERSION < 4)) {
+		die('skip PHP 5.4+ only');
+	}
+    if (PHP_ZTS) {
+		die('skip not for ZTS builds');
+	}
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_segments=1
+apc.shared_strings=16
+--FILE--
+<?php
+
+$big = str_repeat("0123456789", 1000);
+apc_store("big", $big);
+apc_store("arr", array("short", $big));
+
+$a = apc_fetch("big");
+$b = apc_fetch("big");
+var_dump($a === $big, $b === $big);
+
+$a[0] = "x";
+$b .= "tail";
+var_dump(substr($a, 0, 3), strlen($b));
+var_dump(apc_fetch("big") === $big);
+
+apc_delete("big");
+var_dump(apc_fetch("big"), $a === "x" . substr($big, 1));
+
+$arr = apc_fetch("arr");
+$arr[1] = strtoupper(substr($arr[1], 0, 3));
+var_dump($arr, apc_fetch("arr") === array("short", $big));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(true)
+string(3) "x12"
+int(10004)
+bool(true)
+bool(false)
+bool(true)
+array(2) {
+  [0]=>
+  string(5) "short"
+  [1]=>
+  string(3) "012"
+}
+bool(true)
+===DONE===
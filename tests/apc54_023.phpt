@@ -0,0 +1,96 @@
+--TEST--
+APC: apc.compact_threshold moves user entries out of the way of fragmented free memory (php 5.4)
+--SKIPIF--
+<?php
+    require_once(dirname(__FILE__) . '/skipif.inc');
+    if (PHP_MAJOR_VERSION < 5 || (PHP_MAJOR_VERSION == 5 && PHP_MINOR_VERSION < 4)) {
+		die('skip PHP 5.4+ only');
+	}
+	if(PHP_ZTS === 1) {
+		die('skip PHP non-ZTS only');
+	}
+--FILE--
+<?php
+include "server_test.inc";
+
+$file = <<<'FL'
+function value($i) {
+	switch (($i >> 1) % 4) {
+		case 0:
+			/* plain, below apc.compress_threshold */
+			return str_repeat(md5($i), 30);
+		case 1:
+			/* compressed */
+			return str_repeat("compressible $i ", 200);
+		case 2:
+			/* serialized */
+			$o = new stdClass;
+			$o->i = $i;
+			$o->s = str_repeat(sha1($i), 40);
+			return $o;
+		default:
+			return array('i' => $i, 's' => str_repeat(md5($i), 10), 'l' => range($i, $i + 20));
+	}
+}
+
+$op = isset($_GET['op']) ? $_GET['op'] : '';
+if ($op == 'fill') {
+	for ($i = 0; $i < 600; $i++) {
+		apc_store("key$i", value($i));
+	}
+	/* every other entry goes, the rest sit between holes */
+	for ($i = 1; $i < 600; $i += 2) {
+		apc_delete("key$i");
+	}
+	apc_store('filled', 1);
+	echo "filled\n";
+} else if ($op == 'check') {
+	$info = apc_cache_info('user', true);
+	echo "relocated: ";
+	var_dump($info['relocations'] > 0);
+	$bad = 0;
+	for ($i = 0; $i < 600; $i += 2) {
+		$v = apc_fetch("key$i", $ok);
+		if (!$ok || serialize($v) !== serialize(value($i))) {
+			$bad++;
+		}
+	}
+	echo "mismatches: $bad\n";
+}
+FL;
+
+$args = array(
+	'apc.enabled=1',
+	'apc.enable_cli=1',
+	'apc.shm_segments=1',
+	'apc.shm_size=2M',
+	'apc.use_request_time=0',
+	'apc.compress_threshold=1024',
+	'apc.compact_threshold=5',
+	'apc.compact_budget=1000000',
+);
+
+server_start($file, $args);
+
+/* compaction runs once a second at most, the start-up requests took this one */
+sleep(1);
+
+/* compaction runs as the fill request ends */
+run_test_simple('?op=fill');
+run_test_simple('?op=check');
+echo "done\n";
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+filled
+filled
+filled
+relocated: bool(true)
+mismatches: 0
+relocated: bool(true)
+mismatches: 0
+relocated: bool(true)
+mismatches: 0
+done
+===DONE===
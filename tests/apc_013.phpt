@@ -0,0 +1,48 @@
+--TEST--
+APC: user cache with lock stripes
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.user_entries_hint=1000
+apc.user_lock_stripes=7
+--FILE--
+<?php
+
+$info = apc_cache_info('user', true);
+var_dump($info['num_stripes']);
+
+for($i = 0; $i < 100; $i++) {
+  apc_store("key$i", "value$i");
+}
+$ok = true;
+for($i = 0; $i < 100; $i++) {
+  if (apc_fetch("key$i") !== "value$i") $ok = false;
+}
+var_dump($ok);
+
+for($i = 0; $i < 100; $i += 2) {
+  apc_delete("key$i");
+}
+var_dump(apc_exists("key2"), apc_exists("key3"));
+
+$it = new APCIterator('user');
+var_dump($it->getTotalCount());
+
+apc_clear_cache('user');
+$info = apc_cache_info('user', true);
+var_dump($info['num_entries']);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+int(4)
+bool(true)
+bool(false)
+bool(true)
+int(50)
+int(0)
+===DONE===
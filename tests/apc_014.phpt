@@ -0,0 +1,46 @@
+--TEST--
+APC: user cache slot table grows past apc.user_entries_hint
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.user_entries_hint=1
+apc.user_lock_stripes=4
+--FILE--
+<?php
+
+$info = apc_cache_info('user', true);
+var_dump($info['num_slots']);
+
+for($i = 0; $i < 3000; $i++) {
+  apc_store("key$i", $i);
+}
+
+$info = apc_cache_info('user', true);
+var_dump($info['num_slots'] > 256);
+var_dump($info['num_entries']);
+
+$ok = true;
+for($i = 0; $i < 3000; $i++) {
+  if (apc_fetch("key$i") !== $i) $ok = false;
+}
+var_dump($ok);
+
+for($i = 0; $i < 3000; $i += 3) {
+  apc_delete("key$i");
+}
+$it = new APCIterator('user');
+var_dump($it->getTotalCount());
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+int(256)
+bool(true)
+int(3000)
+bool(true)
+int(2000)
+===DONE===
@@ -0,0 +1,62 @@
+--TEST--
+APC: user cache lookups through the tagged index
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.user_entries_hint=1
+apc.user_lock_stripes=4
+apc.user_index=tagged
+--FILE--
+<?php
+
+$info = apc_cache_info('user', true);
+var_dump($info['index_type']);
+
+for($i = 0; $i < 5000; $i++) {
+  apc_store("key$i", $i);
+}
+
+$ok = true;
+for($i = 0; $i < 5000; $i++) {
+  if (apc_fetch("key$i") !== $i) $ok = false;
+}
+var_dump($ok);
+
+for($i = 0; $i < 5000; $i += 2) {
+  apc_delete("key$i");
+}
+for($i = 1; $i < 5000; $i += 2) {
+  apc_store("key$i", "new$i");
+}
+
+$ok = true;
+for($i = 0; $i < 5000; $i++) {
+  $v = apc_fetch("key$i", $success);
+  if ($i % 2 ? $v !== "new$i" : $success) $ok = false;
+}
+var_dump($ok);
+var_dump(apc_exists("key1"), apc_exists("key2"));
+
+$info = apc_cache_info('user', true);
+var_dump($info['num_entries']);
+var_dump($info['index_size'] >= 2 * $info['num_entries']);
+
+apc_clear_cache('user');
+var_dump(apc_fetch("key1"));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+string(6) "tagged"
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+int(2500)
+bool(true)
+bool(false)
+===DONE===
@@ -0,0 +1,44 @@
+--TEST--
+APC: clock eviction keeps hot user cache entries when memory runs out
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_size=8M
+apc.user_eviction=clock
+--FILE--
+<?php
+
+$info = apc_cache_info('user', true);
+var_dump($info['eviction_policy']);
+
+apc_store("hot", "hot value");
+$blob = str_repeat("x", 20000);
+
+$hot = true;
+for($i = 0; $i < 1000; $i++) {
+  @apc_store("cold$i", $blob);
+  if (apc_fetch("hot") !== "hot value") $hot = false;
+}
+var_dump($hot);
+
+$info = apc_cache_info('user', true);
+var_dump($info['expunges'] > 0);
+var_dump($info['evictions'] > 0);
+/* only part of the cache was evicted */
+var_dump($info['num_entries'] > 1);
+var_dump(apc_fetch("cold999") === $blob);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+string(5) "clock"
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+===DONE===
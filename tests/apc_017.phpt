@@ -0,0 +1,45 @@
+--TEST--
+APC: expired user cache entries make room before anything is evicted
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_size=8M
+apc.user_eviction=clock
+apc.use_request_time=0
+--FILE--
+<?php
+
+$blob = str_repeat("x", 20000);
+
+for($i = 0; $i < 200; $i++) {
+  apc_store("short$i", $blob, 1);
+}
+sleep(2);
+
+$stored = true;
+for($i = 0; $i < 200; $i++) {
+  if (!apc_store("long$i", $blob)) $stored = false;
+}
+var_dump($stored);
+
+$info = apc_cache_info('user', true);
+var_dump($info['expunges'] > 0);
+var_dump($info['evictions']);
+var_dump($info['num_entries']);
+var_dump(apc_fetch("short0"));
+var_dump(apc_fetch("long0") === $blob);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(true)
+bool(true)
+int(0)
+int(200)
+bool(false)
+bool(true)
+===DONE===
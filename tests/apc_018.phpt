@@ -0,0 +1,47 @@
+--TEST--
+APC: user cache entries are gone right after a clear and can be stored again
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.user_index=tagged
+--FILE--
+<?php
+
+for($i = 0; $i < 5000; $i++) {
+  apc_store("key$i", "value$i", $i % 2 ? 100 : 0);
+}
+var_dump(apc_fetch("key42"));
+
+apc_clear_cache('user');
+
+$info = apc_cache_info('user', true);
+var_dump($info['num_entries']);
+var_dump(apc_fetch("key42"));
+var_dump(apc_exists("key43"));
+
+$ok = true;
+for($i = 0; $i < 5000; $i++) {
+  if (!apc_store("key$i", "again$i")) $ok = false;
+}
+for($i = 0; $i < 5000; $i++) {
+  if (apc_fetch("key$i") !== "again$i") $ok = false;
+}
+var_dump($ok);
+
+$info = apc_cache_info('user', true);
+var_dump($info['num_entries']);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+string(7) "value42"
+int(0)
+bool(false)
+bool(false)
+bool(true)
+int(5000)
+===DONE===
@@ -0,0 +1,47 @@
+--TEST--
+APC: apc_fetch_or_lease hands out a lease on a miss and apc_store_with_lease stores with it
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+
+var_dump(apc_fetch_or_lease("foo", $lease));
+var_dump($lease > 0);
+
+/* asking again from the same process gets the same lease back */
+var_dump(apc_fetch_or_lease("foo", $again));
+var_dump($again === $lease);
+
+var_dump(apc_store_with_lease("foo", array(1, 2, 3), $lease));
+var_dump(apc_fetch_or_lease("foo", $lease));
+var_dump($lease);
+
+$info = apc_cache_info('user', true);
+var_dump($info['leases_granted'] >= 1);
+var_dump($info['leases_held']);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+bool(false)
+bool(true)
+bool(false)
+bool(true)
+bool(true)
+array(3) {
+  [0]=>
+  int(1)
+  [1]=>
+  int(2)
+  [2]=>
+  int(3)
+}
+int(0)
+bool(true)
+int(0)
+===DONE===
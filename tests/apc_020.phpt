@@ -0,0 +1,47 @@
+--TEST--
+APC: entries past their ttl are refreshed by one caller within their grace period
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.use_request_time=0
+--FILE--
+<?php
+
+apc_store("foo", "old", 1, 100);
+apc_store("bar", "old", 1);
+var_dump(apc_fetch("foo", $success, $stale), $success, $stale);
+
+sleep(2);
+
+/* the only caller around is the one told to refresh */
+var_dump(apc_fetch("foo", $success, $stale), $success, $stale);
+var_dump(apc_fetch("bar", $success));
+
+var_dump(apc_store("foo", "new", 1, 100));
+var_dump(apc_fetch("foo", $success, $stale), $success, $stale);
+
+$info = apc_cache_info('user');
+foreach ($info['cache_list'] as $entry) {
+  if ($entry['info'] == 'foo') var_dump($entry['grace']);
+}
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECT--
+string(3) "old"
+bool(true)
+bool(false)
+bool(false)
+bool(false)
+bool(false)
+bool(false)
+bool(true)
+string(3) "new"
+bool(true)
+bool(false)
+int(100)
+===DONE===
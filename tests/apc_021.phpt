@@ -0,0 +1,61 @@
+--TEST--
+APC: apc_fetch and apc_exists with arrays of keys, missing and repeated ones included
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+
+for($i = 0; $i < 200; $i++) {
+  apc_store("key$i", array($i, "value$i"));
+}
+
+$keys = array();
+for($i = 0; $i < 300; $i += 3) {
+  $keys[] = "key$i";
+}
+$keys[] = "key3";
+
+$values = apc_fetch($keys, $success);
+var_dump($success, count($values));
+var_dump($values["key3"], isset($values["key201"]));
+
+$ok = true;
+foreach ($values as $k => $v) {
+  if ($v !== array((int)substr($k, 3), "value" . substr($k, 3))) $ok = false;
+}
+var_dump($ok);
+
+var_dump(apc_exists(array("key0", "nope", "key199", "key0")));
+var_dump(apc_fetch(array()));
+var_dump(apc_fetch(array("key1", 42)));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+int(67)
+array(2) {
+  [0]=>
+  int(3)
+  [1]=>
+  string(6) "value3"
+}
+bool(false)
+bool(true)
+array(2) {
+  ["key0"]=>
+  bool(true)
+  ["key199"]=>
+  bool(true)
+}
+array(0) {
+}
+
+Warning: apc_fetch(): apc_fetch() expects a string or array of strings. in %s on line %d
+bool(false)
+===DONE===
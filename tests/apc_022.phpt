@@ -0,0 +1,60 @@
+--TEST--
+APC: apc_store and apc_add with arrays of keys and values
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+
+$values = array();
+for($i = 0; $i < 200; $i++) {
+  $values["key$i"] = array($i, "value$i");
+}
+var_dump(apc_store($values));
+
+$ok = true;
+foreach (apc_fetch(array_keys($values)) as $k => $v) {
+  if ($v !== $values[$k]) $ok = false;
+}
+var_dump($ok);
+
+$more = array();
+for($i = 190; $i < 210; $i++) {
+  $more["key$i"] = "added$i";
+}
+$failed = apc_add($more);
+var_dump(count($failed), $failed["key190"], isset($failed["key200"]));
+var_dump(apc_fetch("key190"), apc_fetch("key205"));
+
+var_dump(apc_store(array("key0" => "replaced", 7 => "int key")));
+var_dump(apc_fetch("key0"));
+var_dump(apc_store(array()));
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+array(0) {
+}
+bool(true)
+int(10)
+int(-1)
+bool(false)
+array(2) {
+  [0]=>
+  int(190)
+  [1]=>
+  string(8) "value190"
+}
+string(8) "added205"
+array(1) {
+  [7]=>
+  int(-1)
+}
+string(8) "replaced"
+array(0) {
+}
+===DONE===
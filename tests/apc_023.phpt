@@ -0,0 +1,43 @@
+--TEST--
+APC: apc_fetch of arrays with and without references
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+--FILE--
+<?php
+
+$v = "shared";
+$plain = array($v, $v, array($v, 1), array($v, 1));
+apc_store('plain', $plain);
+$a = apc_fetch('plain');
+var_dump($a === $plain);
+$a[0] = "changed";
+$a[2][0] = "changed";
+var_dump($a[1], $a[3][0]);
+
+$x = 1;
+$refs = array(&$x, &$x);
+apc_store('refs', $refs);
+$b = apc_fetch('refs');
+$b[0] = 2;
+var_dump($b[1]);
+
+$rec = array(1);
+$rec[] = &$rec;
+apc_store('rec', $rec);
+$c = apc_fetch('rec');
+var_dump($c[1][1][0]);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+string(6) "shared"
+string(6) "shared"
+int(2)
+int(1)
+===DONE===
@@ -0,0 +1,57 @@
+--TEST--
+APC: apc_fetch with apc.local_size
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.local_size=2
+--FILE--
+<?php
+
+apc_store('routes', array('a' => array(1, 2), 'b' => 'x'));
+$r = apc_fetch('routes');
+$r['a'][] = 3;
+$r = apc_fetch('routes');
+var_dump(count($r['a']));
+
+apc_store('routes', array('a' => array(1)));
+$r = apc_fetch('routes');
+var_dump(count($r['a']));
+
+apc_store('str', 'foo');
+apc_store('n', 1);
+apc_fetch('str');
+apc_fetch('str');
+apc_fetch('n');
+apc_inc('n');
+var_dump(apc_fetch('n'));
+
+apc_store('k1', 'one');
+apc_store('k2', 'two');
+apc_fetch('k1');
+apc_fetch('k2');
+var_dump(apc_fetch(array('k1', 'k2', 'str')));
+
+$info = apc_cache_info('user', true);
+var_dump($info['local_hits'], $info['local_misses']);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+int(2)
+int(1)
+int(2)
+array(3) {
+  ["k1"]=>
+  string(3) "one"
+  ["k2"]=>
+  string(3) "two"
+  ["str"]=>
+  string(3) "foo"
+}
+int(4)
+int(8)
+===DONE===
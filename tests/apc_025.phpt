@@ -0,0 +1,55 @@
+--TEST--
+APC: apc.compress_threshold
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.compress_threshold=1024
+--FILE--
+<?php
+
+class Route { public $path; public $handler; }
+
+$big = str_repeat("GET /users/{id}/profile => UserController::profile\n", 200);
+$small = "short";
+$routes = array();
+for ($i = 0; $i < 100; $i++) {
+  $r = new Route;
+  $r->path = "/path/$i";
+  $r->handler = "Controller::action$i";
+  $routes[] = $r;
+}
+$obj = new ArrayObject($routes);
+
+apc_store('big', $big);
+apc_store('small', $small);
+apc_store('obj', $obj);
+
+var_dump(apc_fetch('big') === $big);
+var_dump(apc_fetch('small') === $small);
+var_dump(apc_fetch('obj') == $obj);
+
+$info = apc_cache_info('user');
+var_dump($info['raw_mem_size'] > $info['mem_size']);
+foreach ($info['cache_list'] as $e) {
+  if ($e['info'] == 'big') var_dump($e['raw_size'] > $e['mem_size']);
+  if ($e['info'] == 'small') var_dump($e['raw_size'] == $e['mem_size']);
+}
+foreach (new APCIterator('user', '/^obj$/', APC_ITER_MEM_SIZE) as $e) {
+  var_dump($e['raw_size'] > $e['mem_size']);
+}
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+===DONE===
@@ -0,0 +1,46 @@
+--TEST--
+APC: apc_invalidate_namespace
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.namespace_separator=:
+--FILE--
+<?php
+
+apc_store('users:1', 'alice');
+apc_store('users:2', 'bob');
+apc_store('routes:home', '/');
+apc_store('plain', 'value');
+apc_store('users:n', 1);
+
+var_dump(apc_invalidate_namespace('users'));
+
+var_dump(apc_fetch('users:1'), apc_exists('users:2'));
+var_dump(apc_fetch('routes:home'), apc_fetch('plain'));
+var_dump(apc_inc('users:n'));
+var_dump(apc_add('users:1', 'carol'), apc_fetch('users:1'));
+
+apc_store('users:2', 'dave');
+var_dump(apc_fetch('users:2'));
+
+$info = apc_cache_info('user', true);
+var_dump($info['namespace_invalidations']);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(false)
+bool(false)
+string(1) "/"
+string(5) "value"
+bool(false)
+bool(true)
+string(5) "carol"
+string(4) "dave"
+int(1)
+===DONE===
@@ -0,0 +1,56 @@
+--TEST--
+APC: apc.shm_placement=key and seg_avail_mem
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_placement=key
+apc.shm_segments=4
+apc.shm_size=8M
+apc.mmap_file_mask=/tmp/apc.XXXXXX
+--FILE--
+<?php
+
+$before = apc_sma_info(true);
+
+for ($i = 0; $i < 100; $i++) {
+    apc_store("key_$i", str_repeat('x', $i * 10));
+}
+apc_store(array('a' => 1, 'b' => array(1, 2, 3)));
+
+var_dump(apc_fetch('key_42') === str_repeat('x', 420));
+var_dump(apc_fetch('b'));
+
+$sma = apc_sma_info(true);
+var_dump(count($sma['seg_avail_mem']) == $sma['num_seg']);
+var_dump(array_sum($sma['seg_avail_mem']) == $sma['avail_mem']);
+
+/* the stores went to more than one segment */
+$used = 0;
+for ($i = 0; $i < $sma['num_seg']; $i++) {
+    if ($sma['seg_avail_mem'][$i] < $before['seg_avail_mem'][$i]) {
+        $used++;
+    }
+}
+var_dump($sma['num_seg'], $used > 1);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+array(3) {
+  [0]=>
+  int(1)
+  [1]=>
+  int(2)
+  [2]=>
+  int(3)
+}
+bool(true)
+bool(true)
+int(4)
+bool(true)
+===DONE===
@@ -0,0 +1,67 @@
+--TEST--
+APC: apc.sma_magazine_size keeps freed blocks per process within its limit
+--SKIPIF--
+<?php
+    require_once(dirname(__FILE__) . '/skipif.inc');
+    if (PHP_ZTS || substr(PHP_OS, 0, 3) == 'WIN') {
+        die('skip magazines need a non-ZTS build');
+    }
+?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.shm_segments=1
+apc.sma_magazine_size=65536
+--FILE--
+<?php
+
+$values = array();
+$max = 0;
+$over = 0;
+
+for ($round = 0; $round < 20; $round++) {
+    for ($i = 0; $i < 200; $i++) {
+        switch ($i % 4) {
+            case 0: $v = $i * $round; break;
+            case 1: $v = str_repeat('x', $i + $round); break;
+            case 2: $v = array($i, "round $round"); break;
+            default: $v = $i / 4; break;
+        }
+        apc_store("key$i", $v);
+        $values["key$i"] = $v;
+    }
+    for ($i = $round % 3; $i < 200; $i += 3) {
+        apc_delete("key$i");
+        unset($values["key$i"]);
+    }
+
+    $info = apc_sma_info(true);
+    if ($info['magazine_mem'] > 65536) {
+        $over++;
+    }
+    $max = max($max, $info['magazine_mem']);
+}
+
+$bad = 0;
+for ($i = 0; $i < 200; $i++) {
+    $v = apc_fetch("key$i", $ok);
+    if (isset($values["key$i"]) ? !$ok || $v !== $values["key$i"] : $ok) {
+        $bad++;
+    }
+}
+
+var_dump(array_key_exists('magazine_mem', $info));
+var_dump($max > 0);
+var_dump($over);
+var_dump($bad);
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(true)
+int(0)
+int(0)
+===DONE===
@@ -0,0 +1,41 @@
+--TEST--
+APC: apc.hit_sample samples entry hits, the cache totals stay exact
+--SKIPIF--
+<?php require_once(dirname(__FILE__) . '/skipif.inc'); ?>
+--INI--
+apc.enabled=1
+apc.enable_cli=1
+apc.file_update_protection=0
+apc.hit_sample=4
+--FILE--
+<?php
+
+apc_store('hot', 'value');
+
+for ($i = 0; $i < 37; $i++) {
+    apc_fetch('hot');
+}
+for ($i = 0; $i < 5; $i++) {
+    apc_fetch('missing');
+}
+
+$info = apc_cache_info('user');
+var_dump($info['num_hits'] == 37, $info['num_misses'] == 5);
+
+foreach ($info['cache_list'] as $entry) {
+    if ($entry['info'] == 'hot') {
+        /* counted 4 at a time, so short of the hits by less than 4 */
+        var_dump($entry['num_hits'] % 4 == 0);
+        var_dump($entry['num_hits'] <= 37 && $entry['num_hits'] > 37 - 4);
+    }
+}
+
+?>
+===DONE===
+<?php exit(0); ?>
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+===DONE===